@@ -0,0 +1,384 @@
+// Microbenchmarks for the hot paths of FATik: `make bench` (or ./fatik_bench [filter]).
+// fatvol.c is included as a whole so that static helpers can be measured too.
+#include "fatvol.c"
+
+#include <time.h>
+
+#define BENCH_MIN_NS 20000000.0   // one repetition runs at least 20 ms
+#define BENCH_REPETITIONS 7
+
+typedef void (*bench_fn)(void *ctx, unsigned long iterations);
+
+static const char *bench_filter = NULL;
+static volatile unsigned long bench_sink; // results go here, so the work is not optimized away
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Runs 'fn' with a growing number of iterations until one run takes BENCH_MIN_NS (that is
+// also the warm-up), then BENCH_REPETITIONS more times. Prints median and best ns/op and the
+// throughput; 'bytes_per_op' (if not 0) gives MB/s as well.
+static void bench(const char *name, bench_fn fn, void *ctx, double bytes_per_op)
+{
+    if (bench_filter && strstr(name, bench_filter) == NULL) return;
+
+    unsigned long iterations = 1;
+    while (1)
+    {
+        double start = now_ns();
+        fn(ctx, iterations);
+        double elapsed = now_ns() - start;
+        if (elapsed >= BENCH_MIN_NS || iterations >= (1UL << 40)) break;
+        iterations *= (elapsed < BENCH_MIN_NS / 16) ? 8 : 2;
+    }
+
+    double ns_per_op[BENCH_REPETITIONS];
+    for (int r = 0; r < BENCH_REPETITIONS; r++)
+    {
+        double start = now_ns();
+        fn(ctx, iterations);
+        ns_per_op[r] = (now_ns() - start) / iterations;
+    }
+    qsort(ns_per_op, BENCH_REPETITIONS, sizeof(double), compare_double);
+
+    double median = ns_per_op[BENCH_REPETITIONS / 2];
+    printf("%-36s %12.1f ns/op  (best %10.1f)  %12.0f op/s", name, median, ns_per_op[0], 1e9 / median);
+    if (bytes_per_op > 0) printf("  %9.1f MB/s", bytes_per_op / median * 1e3);
+    printf("\n");
+    fflush(stdout);
+}
+
+static uint32_t lcg_state = 12345;
+
+static uint32_t lcg_next(void)
+{
+    lcg_state = lcg_state * 1664525u + 1013904223u;
+    return lcg_state >> 1;
+}
+
+// Formats a sparse mapped scratch image; the benchmarks work on it in memory.
+static void bench_volume(struct Volume *vol, long size)
+{
+    FILE *file = tmpfile();
+    if (file == NULL || ftruncate(fileno(file), size) != 0)
+    {
+        perror("tmpfile");
+        exit(1);
+    }
+    open_volume(vol, file, size, 1, DEFAULT_CACHE_CLUSTERS, DEFAULT_FAT_CACHE_KB, NULL);
+    if (vol->map == NULL) exit(1);
+    format_volume(vol, NULL);
+}
+
+// ---- find_free_cluster ----
+
+#define START_POINTS 4096
+
+struct FreeClusterCtx
+{
+    struct Volume *vol;
+    uint32_t starts[START_POINTS];
+};
+
+static void run_find_free_cluster(void *p, unsigned long iterations)
+{
+    struct FreeClusterCtx *ctx = p;
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+        sum += find_free_cluster(ctx->vol, ctx->starts[i % START_POINTS]);
+    bench_sink = sum;
+}
+
+static void bench_find_free_cluster(void)
+{
+    static const int fill_percent[] = { 0, 50, 90, 99 };
+    char name[64];
+
+    for (size_t f = 0; f < sizeof(fill_percent) / sizeof(fill_percent[0]); f++)
+    {
+        struct Volume vol;
+        bench_volume(&vol, 256L * 1024 * 1024);
+
+        // random clusters are marked used until the fill ratio is reached
+        uint32_t total = vol.total_clusters;
+        uint32_t target = (uint64_t)total * fill_percent[f] / 100;
+        for (uint32_t used = 1; used < target; )
+        {
+            uint32_t cluster = 2 + lcg_next() % total;
+            if (get_fat_entry(&vol, cluster) != 0) continue;
+            set_fat_entry(&vol, cluster, FAT_EOC);
+            used++;
+        }
+
+        struct FreeClusterCtx *ctx = malloc(sizeof(*ctx));
+        ctx->vol = &vol;
+        for (int i = 0; i < START_POINTS; i++) ctx->starts[i] = 2 + lcg_next() % total;
+
+        snprintf(name, sizeof(name), "find_free_cluster/%d%% full", fill_percent[f]);
+        bench(name, run_find_free_cluster, ctx, 0);
+        free(ctx);
+        close_volume(&vol);
+    }
+}
+
+// ---- directory iteration, name index, slot search ----
+
+struct DirCtx
+{
+    struct Volume *vol;
+    uint32_t dir;
+    unsigned int slot_count;     // 'count' for find_hole_run
+    const char *name;            // name for dir_lookup
+};
+
+static void run_dir_iterate(void *p, unsigned long iterations)
+{
+    struct DirCtx *ctx = p;
+    struct DirIterator it;
+    struct ParsedEntry entry;
+    unsigned long count = 0;
+
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        dir_open(&it, ctx->vol, ctx->dir);
+        while (dir_next(&it, &entry)) count++;
+    }
+    bench_sink = count;
+}
+
+static void run_index_build(void *p, unsigned long iterations)
+{
+    struct DirCtx *ctx = p;
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        drop_dir_indexes(ctx->vol);
+        sum += get_dir_index(ctx->vol, ctx->dir)->hole_count;
+    }
+    bench_sink = sum;
+}
+
+static void run_dir_lookup(void *p, unsigned long iterations)
+{
+    struct DirCtx *ctx = p;
+    unsigned long found = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+        found += dir_lookup(ctx->vol, ctx->dir, ctx->name) != NULL;
+    bench_sink = found;
+}
+
+static void run_find_hole_run(void *p, unsigned long iterations)
+{
+    struct DirCtx *ctx = p;
+    struct DirIndex *index = get_dir_index(ctx->vol, ctx->dir);
+    long sum = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+        sum += find_hole_run(ctx->vol, index, ctx->slot_count);
+    bench_sink = sum;
+}
+
+// Fills a new directory 'dir_name' with 'count' entries; long names give LFN runs.
+static uint32_t fill_directory(struct Volume *vol, const char *dir_name, unsigned int count, int long_names)
+{
+    char name_buf[64];
+    snprintf(name_buf, sizeof(name_buf), "%s", dir_name);
+    int dir = make_directory(vol, vol->bpb.root_cluster, name_buf);
+    if (dir < 0)
+    {
+        printf("%s: %s\n", fs_error(dir), dir_name);
+        exit(1);
+    }
+
+    uint8_t entries[MAX_NAME_ENTRIES * DIR_ENTRY_SIZE];
+    for (unsigned int i = 0; i < count; i++)
+    {
+        struct DirIndex *index = get_dir_index(vol, dir);
+        char name[64];
+        int slots;
+        if (long_names)
+        {
+            snprintf(name, sizeof(name), "a rather long file name %06u", i);
+            slots = create_folder(name, &index->sfns, entries, 0);
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "F%06u.TXT", i);
+            slots = create_file_entry(name, &index->sfns, entries, 0, 0);
+        }
+
+        uint32_t entry_cluster;
+        unsigned int entry_offset;
+        if (!dir_add_entries(vol, dir, name, entries, slots, &entry_cluster, &entry_offset))
+        {
+            printf("No space for %s\n", name);
+            exit(1);
+        }
+    }
+    return dir;
+}
+
+// directory size in bytes, for the MB/s column
+static double dir_bytes(struct Volume *vol, uint32_t dir)
+{
+    unsigned int clusters = 0;
+    for (uint32_t c = dir; c != 0; c = next_cluster(vol, c)) clusters++;
+    return (double)clusters * vol->cluster_size;
+}
+
+static void bench_directories(void)
+{
+    struct Volume vol;
+    bench_volume(&vol, 64L * 1024 * 1024);
+
+    struct DirCtx sfn = { &vol, fill_directory(&vol, "sfn", 4096, 0), 1, "F004095.TXT" };
+    struct DirCtx lfn = { &vol, fill_directory(&vol, "lfn", 1365, 1), 3, "a rather long file name 001364" };
+
+    bench("dir_next/SFN-only 4096", run_dir_iterate, &sfn, dir_bytes(&vol, sfn.dir));
+    bench("dir_next/LFN-heavy 1365", run_dir_iterate, &lfn, dir_bytes(&vol, lfn.dir));
+    bench("get_dir_index/SFN-only 4096", run_index_build, &sfn, dir_bytes(&vol, sfn.dir));
+    bench("dir_lookup/SFN-only 4096", run_dir_lookup, &sfn, 0);
+
+    // every other entry deleted: holes everywhere, but never two in a row
+    uint32_t c = sfn.dir;
+    for (unsigned int n = 0; c != 0; c = next_cluster(&vol, c))
+    {
+        uint8_t *data = get_cluster(&vol, c);
+        for (unsigned int off = 0; off < vol.cluster_size; off += DIR_ENTRY_SIZE, n++)
+        {
+            if (n >= 2 && (n & 1) && data[off] != 0) data[off] = 0xE5;
+        }
+        put_cluster(&vol, c, data);
+    }
+    drop_dir_indexes(&vol);
+    sfn.slot_count = 1;
+    bench("find_hole_run/1 slot, sparse holes", run_find_hole_run, &sfn, 0);
+    sfn.slot_count = 3;
+    bench("find_hole_run/3 slots, sparse holes", run_find_hole_run, &sfn, 0);
+
+    close_volume(&vol);
+}
+
+// ---- entry builders ----
+
+#define NAME_COUNT 1024
+
+struct NamesCtx
+{
+    unsigned char sfn[NAME_COUNT][11];
+    char long_name[256];
+};
+
+static void run_sfn_checksum(void *p, unsigned long iterations)
+{
+    struct NamesCtx *ctx = p;
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+        sum += sfn_checksum(ctx->sfn[i % NAME_COUNT]);
+    bench_sink = sum;
+}
+
+static void run_create_folder(void *p, unsigned long iterations)
+{
+    struct NamesCtx *ctx = p;
+    uint8_t entries[MAX_NAME_ENTRIES * DIR_ENTRY_SIZE];
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+        sum += create_folder(ctx->long_name, NULL, entries, i);
+    bench_sink = sum;
+}
+
+static void run_utf8_to_utf16(void *p, unsigned long iterations)
+{
+    struct NamesCtx *ctx = p;
+    uint16_t units[MAX_LFN_UNITS];
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+        sum += utf8_to_utf16(ctx->long_name, units, MAX_LFN_UNITS);
+    bench_sink = sum;
+}
+
+static void run_utf16_to_utf8(void *p, unsigned long iterations)
+{
+    struct NamesCtx *ctx = p;
+    uint16_t units[MAX_LFN_UNITS];
+    char name[MAX_NAME_BYTES];
+    int count = utf8_to_utf16(ctx->long_name, units, MAX_LFN_UNITS);
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+        sum += utf16_to_utf8(units, count, name, sizeof(name));
+    bench_sink = sum;
+}
+
+static void bench_entries(void)
+{
+    struct NamesCtx *ctx = malloc(sizeof(*ctx));
+    for (int i = 0; i < NAME_COUNT; i++)
+        for (int j = 0; j < 11; j++) ctx->sfn[i][j] = 'A' + lcg_next() % 26;
+
+    bench("sfn_checksum", run_sfn_checksum, ctx, 11);
+
+    static const int lengths[] = { 13, 64, 255 };
+    char name[64];
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++)
+    {
+        memset(ctx->long_name, 0, sizeof(ctx->long_name));
+        for (int j = 0; j < lengths[l]; j++) ctx->long_name[j] = 'a' + j % 26;
+        snprintf(name, sizeof(name), "create_folder/%d chars", lengths[l]);
+        bench(name, run_create_folder, ctx, lengths[l]);
+    }
+
+    // 120 Cyrillic letters: 2 bytes of UTF-8 each
+    memset(ctx->long_name, 0, sizeof(ctx->long_name));
+    for (int j = 0; j < 120; j++) memcpy(&ctx->long_name[j * 2], "\xd0\xb6", 2);
+    bench("utf8_to_utf16/120 chars", run_utf8_to_utf16, ctx, 240);
+    bench("utf16_to_utf8/120 chars", run_utf16_to_utf8, ctx, 240);
+    free(ctx);
+}
+
+// ---- to_format ----
+
+static void run_to_format(void *p, unsigned long iterations)
+{
+    long size = *(long *)p;
+    struct FAT32_BPB bpb;
+    unsigned long sum = 0;
+    for (unsigned long i = 0; i < iterations; i++)
+    {
+        to_format(&bpb, size, NULL);
+        sum += bpb.fat32_size;
+    }
+    bench_sink = sum;
+}
+
+static void bench_to_format(void)
+{
+    static const long sizes_mb[] = { 2, 64, 1024, 32768 };
+    char name[64];
+    for (size_t i = 0; i < sizeof(sizes_mb) / sizeof(sizes_mb[0]); i++)
+    {
+        long size = sizes_mb[i] * 1024 * 1024;
+        snprintf(name, sizeof(name), "to_format/%ld MB", sizes_mb[i]);
+        bench(name, run_to_format, &size, 0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1) bench_filter = argv[1];
+
+    bench_find_free_cluster();
+    bench_directories();
+    bench_entries();
+    bench_to_format();
+    return 0;
+}
@@ -1,775 +1,1702 @@
-#include <stdint.h>
+#define _GNU_SOURCE
+
+#include "fatvol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/types.h>
-#include <wchar.h>
-
-#define MAX_FAT_SIZE_BYTES (4 * 1024 * 1024)
-
-struct FAT32_BPB // SECTOR 0
-{
-    char jmp[3];
-    char oem[8];                               // OC label
-    unsigned short bytes_per_sector;          // size sector (e.g. 512 bytes)
-    unsigned char sectors_per_cluster;       // number of sectors per cluster (e.g.8 => 8 * 512 = 4096 bytes (4KB) size of cluster)
-    unsigned short reserved_sectors;        // size of reserved sector of FAT table: adress of FAT table (32 * 512 as 0x20 * 0x200 = 0x4000)
-    unsigned char fat_amount;              // amount of copies of FAT table (if someone is corrupted, we can use another one)
-    unsigned short root_dir_entries;      //  number of entries in root directory (number of clusters in data block)
-    unsigned short total_sectors_16;
-
-    unsigned char media_descriptor;      // type of media 0xF8 hard disk (0xF0 = floppy)
-    //unsigned short sectors_per_fat;     //  size of FAT32 table; e.g.(8 * 512) * 512 = 1,8MB
-    unsigned short fat16_size; // 0
-    unsigned short sectors_per_track;
-    unsigned short heads;              // number of heads
-    unsigned int hidden_sectors;      // number of sector before the disk
-
-    unsigned int total_sectors;      // size of disk; e.g. 15118440 sectors * 512 = 7,2GB
-    unsigned int fat32_size;
-
-    unsigned short flags;
-    unsigned short version;
-    unsigned int root_cluster;
-    unsigned short sector_FS_info;
-    unsigned short sector_backup_boot;
-    unsigned char reserved[12];
-    unsigned char drive_number;   // number of drive
-    unsigned char reserved2;
-    unsigned char boot_signature; // 0x29
-    unsigned int volume_id;
-    char volume_label[11];
-    char file_system[8];
-
-    unsigned char unused[420]; // if it was boot device here should be a code to be executed.
-    unsigned char signature[2]; // 0x55, 0xAA
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_COMMANDS 32
+#define LATENCY_BUCKETS 496        // 8 per power of two up to 2^63 ns
+
+// Latency histogram of one command. Buckets are log-linear (1/8 of a power of two wide),
+// so percentiles are within 12.5% of the real value; 'max_ns' is exact.
+struct CommandStats
+{
+    const char *name;              // NULL until the command runs for the first time
+    unsigned long count;
+    unsigned long errors;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long io_ops;     // image reads + writes + seeks + flushes it caused
+    unsigned long buckets[LATENCY_BUCKETS];
 };
 
-struct LFNentry
+// State of the command line: opened volume, the current directory and per-command stats.
+// Every session of a server (--serve) has its own, all on the same volume.
+struct Shell
 {
-    uint8_t sequence_number;       // sequence number
-    uint16_t name1[5];             // (Unicode)
-    uint8_t attributes;            // 0x0F
-    uint8_t entry_type;           // 0x00
-    uint8_t checksum;             // SFN checksum
-    uint16_t name2[6];
-    uint16_t first_cluster;        // 0x0000
-    uint16_t name3[2];
+    struct Volume *vol;            // the one the running command uses
+    struct Volume *view;           // a session's view of the served volume, NULL otherwise
+    FILE *out;                     // stdout, or the client of a session
+    uint32_t current_cluster;
+    char path[1024];
+    int done;                      // 'exit' was run
+    unsigned int session;          // in a trace (--record): 0 for the main shell, 1... for clients
+    struct CommandStats stats[MAX_COMMANDS]; // same order as commands[]
 };
 
-struct SFNentry
-{
-    unsigned char name[8];
-    unsigned char ext[3];
-    unsigned char attributes;
-    unsigned char reserved;
-    unsigned short time_created;
-    unsigned short date_created;
-    unsigned short date_last_accessed;
-    unsigned short cluster_high;
-    unsigned short time_last_modified;
-    unsigned short date_last_modified;
-    unsigned short cluster_low;
-    unsigned int size;
-};
+static unsigned int latency_bucket(unsigned long long ns)
+{
+    if (ns < 8) return ns;
+    unsigned int e = 63 - __builtin_clzll(ns);
+    return 8 + (e - 3) * 8 + ((ns >> (e - 3)) & 7);
+}
 
-int find_free_entry_offset(uint8_t* cluster, int cluster_size) {
-    for (int offset = 0; offset < cluster_size; offset += 32) {
-        if (cluster[offset] == 0x00 || cluster[offset] == 0xE5) {
-            return offset;
-        }
-    }
-    return -1; // no free slot
+// largest latency that falls into 'bucket'
+static unsigned long long bucket_limit(unsigned int bucket)
+{
+    if (bucket < 8) return bucket;
+    unsigned int e = (bucket - 8) / 8 + 3, m = (bucket - 8) % 8;
+    return ((8ULL + m + 1) << (e - 3)) - 1;
 }
 
-unsigned char sfn_checksum(const unsigned char *sfn)
+// 'p' in (0, 1]: latency that 'p' of the runs did not exceed
+unsigned long long latency_percentile(const struct CommandStats *cs, double p)
 {
-    unsigned char sum = 0;
-    for (int i = 0; i < 11; i++)
+    unsigned long rank = (unsigned long)(p * cs->count + 0.999999);
+    if (rank == 0) rank = 1;
+
+    unsigned long seen = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
     {
-        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + sfn[i];
+        seen += cs->buckets[i];
+        if (seen >= rank) return bucket_limit(i) < cs->max_ns ? bucket_limit(i) : cs->max_ns;
     }
-    return sum;
+    return cs->max_ns;
 }
 
-void create_folder(char* name, uint8_t* cluster, unsigned int id_cluster, int cluster_size)
+static unsigned long long io_total(const struct IoStats *io)
 {
-    struct SFNentry folder;
+    unsigned long long total = io->flushes;
+    for (int r = 0; r < REGION_COUNT; r++) total += io->reads[r] + io->writes[r] + io->seeks[r];
+    return total;
+}
 
-    struct LFNentry lfn;
+static unsigned long long clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    int entry_offset = find_free_entry_offset(cluster, cluster_size);
-    if (entry_offset < 0)
+// "64G", "512M", "1T", "1048576"; 0 if it is not a size
+long long parse_size(const char *text)
+{
+    char *end;
+    long long size = strtoll(text, &end, 10);
+    switch (*end)
     {
-        printf("No free directory entries!\n");
-        return;
+        case 'T': case 't': size <<= 10; // fall through
+        case 'G': case 'g': size <<= 10; // fall through
+        case 'M': case 'm': size <<= 10; // fall through
+        case 'K': case 'k': size <<= 10; end++; break;
+        default: break;
     }
-    if(strlen(name) <= 8 )
-    {
-        memcpy(folder.name, name, strlen(name) + 1);
-        memcpy(folder.ext, "   ", 3);
-        folder.attributes = 0x10;
-        folder.cluster_high = (id_cluster >> 16) & 0xFFFF;
-        folder.cluster_low = id_cluster & 0xFFFF;
-        folder.size = 0;
+    return (*end == '\0' && end != text) ? size : 0;
+}
 
-        // SFN
-        memcpy(&cluster[entry_offset], &folder, sizeof(folder));
+// Next word of '*args' (which is moved past it), NULL at the end. Words are separated by
+// blanks; "a name with blanks" or 'a pattern*' is one word, without the quotes.
+static char *next_word(char **args)
+{
+    char *word = *args + strspn(*args, " \t");
+    if (*word == '\0') return NULL;
 
+    char *end;
+    if (*word == '"' || *word == '\'')
+    {
+        char quote[2] = { *word++, '\0' };
+        end = word + strcspn(word, quote);
     }
     else
+        end = word + strcspn(word, " \t");
+    *args = end + (*end != '\0');
+    *end = '\0';
+    return word;
+}
+
+// Splits 'args' into 'min' to 'max' words with next_word(); returns how many, -1 if there
+// are fewer or more.
+static int split_words(char *args, char **words, int min, int max)
+{
+    int count = 0;
+    for (char *word = next_word(&args); word; word = next_word(&args))
     {
-        unsigned char checksum = sfn_checksum((uint8_t *)&folder);
-        lfn.attributes = 0x0F;
-        lfn.entry_type = 0;
-        lfn.checksum = checksum;
-        lfn.first_cluster = 0;
+        if (count == max) return -1;
+        words[count++] = word;
+    }
+    return count < min ? -1 : count;
+}
 
+static int cmd_exit(struct Shell *sh, char *args)
+{
+    (void)args;
+    sh->done = 1;
+    return 0;
+}
 
-        uint16_t *unicode_name = calloc(strlen(name), sizeof(uint16_t));
-        mbstowcs((wchar_t *)unicode_name, name, strlen(name));
+static int cmd_sync(struct Shell *sh, char *args)
+{
+    (void)args;
+    // cached clusters, FAT and FSInfo go to the image
+    sync_volume(sh->vol);
+    return 0;
+}
 
-        int total_chars = wcslen((wchar_t *)unicode_name);
-        int entries_needed = (total_chars + 12) / 13;
+static int cmd_cache(struct Shell *sh, char *args)
+{
+    (void)args;
+    if (sh->vol->map)
+    {
+        fprintf(sh->out, "Image is mapped, clusters are not cached\n");
+        return 0;
+    }
+    struct BlockCache *caches[2] = { &sh->vol->cache, &sh->vol->fat_cache };
+    const char *names[2] = { "clusters", "FAT sectors" };
+    for (int i = 0; i < 2; i++)
+    {
+        struct BlockCache *cache = caches[i];
+        fprintf(sh->out, "%s: %u/%u hits: %lu misses: %lu evictions: %lu writebacks: %lu\n", names[i],
+               cache->used, cache->capacity, cache->hits, cache->misses, cache->evictions, cache->writebacks);
+    }
+    return 0;
+}
 
-        for (int i = 0; i < entries_needed; i++) {
-            struct LFNentry lfn = {0};
+static int cmd_ls(struct Shell *sh, char *args)
+{
+    // ls [path], the current directory by default
+    char *path = NULL;
+    if (split_words(args, &path, 0, 1) < 0)
+    {
+        fprintf(sh->out, "Use: ls [path] (quoted if it has blanks)\n");
+        return -1;
+    }
 
-            lfn.sequence_number = (uint8_t)(entries_needed - i);
-            if (i == 0) lfn.sequence_number |= 0x40; // last
+    uint32_t cluster = sh->current_cluster;
+    if (path != NULL)
+    {
+        unsigned char is_directory;
+        int err = resolve_path(sh->vol, sh->current_cluster, path, &cluster, &is_directory, NULL, 0);
+        if (err == FS_OK && !is_directory) err = FS_NOT_DIR;
+        if (err < 0)
+        {
+            fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+            return -1;
+        }
+    }
 
-            lfn.attributes = 0x0F;
-            lfn.entry_type = 0;
-            lfn.checksum = checksum;
-            lfn.first_cluster = 0;
+    struct DirIterator it;
+    struct ParsedEntry entry;
 
-            // 13 symbols in 3 parts
-            for (int j = 0; j < 5; j++)
-                lfn.name1[j] = (i * 13 + j < total_chars) ? unicode_name[i * 13 + j] : 0xFFFF;
+    lock_directory(sh->vol, cluster);
+    dir_open(&it, sh->vol, cluster);
+    while (dir_next(&it, &entry))
+    {
+        fprintf(sh->out, "%s ", entry.name);
+    }
+    unlock_directory(sh->vol, cluster);
+    fprintf(sh->out, "\n");
+    return 0;
+}
 
-            for (int j = 0; j < 6; j++)
-                lfn.name2[j] = (i * 13 + 5 + j < total_chars) ? unicode_name[i * 13 + 5 + j] : 0xFFFF;
+static int cmd_mkdir(struct Shell *sh, char *args)
+{
+    // mkdir [-p] <path> [-p]
+    char *folder_name = NULL;
+    int parents = 0, extra = 0;
+    for (char *arg = next_word(&args); arg; arg = next_word(&args))
+    {
+        if (strcmp(arg, "-p") == 0)
+            parents = 1;
+        else if (folder_name == NULL)
+            folder_name = arg;
+        else
+            extra = 1;
+    }
 
-            for (int j = 0; j < 2; j++)
-                lfn.name3[j] = (i * 13 + 11 + j < total_chars) ? unicode_name[i * 13 + 11 + j] : 0xFFFF;
+    if (folder_name == NULL || folder_name[0] == '\0' || extra)
+    {
+        fprintf(sh->out, "Use: mkdir [-p] <path> (quoted if it has blanks)\n");
+        return -1;
+    }
 
-            int lfn_total_size = entries_needed * 32;
-            entry_offset -= lfn_total_size; // LFN м
+    int cluster = make_directories(sh->vol, sh->current_cluster, folder_name, parents);
+    if (cluster < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(cluster), folder_name);
+        return -1;
+    }
 
-            // check
-            for (int i = 0; i < entries_needed; i++) {
-                memcpy(&cluster[entry_offset + i * 32], &lfn, sizeof(lfn));
-            }
-        }
+    fprintf(sh->out, "Created folder: %s (cluster %d)\n", folder_name, cluster);
+    return 0;
+}
+
+static int is_power_of_two(long long n)
+{
+    return n > 0 && (n & (n - 1)) == 0;
+}
 
-        free(unicode_name);
-        // SFN after LFN
-        memcpy(&cluster[entries_needed * 32], &folder, sizeof(folder));
-    }
-}
-
-void to_format(struct FAT32_BPB* bpb, long size_file)
-{
-    memset(bpb, 0, sizeof(struct FAT32_BPB));
-    bpb->jmp[0] = 0xEB;
-    bpb->jmp[1] = 0x3C;
-    bpb->jmp[2] = 0x90;
-
-    bpb->oem[0] = 'F';
-    bpb->oem[1] = 'A';
-
-    bpb->bytes_per_sector = 512;
-    bpb->sectors_per_cluster = 8;
-    bpb->reserved_sectors = 32;
-    bpb->fat_amount = 2;
-    bpb->root_dir_entries = 0;
-    bpb->total_sectors_16 = 0;
-    bpb->media_descriptor = 0xF8;
-    bpb->fat16_size = 0;
-    bpb->sectors_per_track = 63;
-    bpb->heads = 255;
-    bpb->hidden_sectors = 0;
-    bpb->total_sectors = size_file / 512;
-
-    // size of FAT32 table;
-    bpb->fat32_size = 1;
-    int data_sectors, clusters;
-    int required_fat_sectors;
-    while (1)
-    {
-        data_sectors =  bpb->total_sectors - bpb->reserved_sectors - (bpb->fat_amount * bpb->fat32_size);
-        clusters = data_sectors / bpb->sectors_per_cluster;
-        required_fat_sectors = (clusters * 4 + bpb->bytes_per_sector - 1) / bpb->bytes_per_sector;
-
-        if (required_fat_sectors <= bpb->fat32_size)
-            break;
-
-        bpb->fat32_size++;
-    }
-
-
-    bpb->flags =  0x0000;
-    bpb->version =  0x0000;
-    bpb->root_cluster = 2;
-    bpb->sector_FS_info = 1;
-    bpb->sector_backup_boot = 63;
-    bpb->drive_number = 0x80;
-    bpb->boot_signature = 0x29;
-    bpb->volume_id = 0x12345678;
-
-    bpb->volume_label[0] = 'F';
-    bpb->volume_label[1] = 'A';
-    bpb->volume_label[2] = 'T';
-    bpb->volume_label[3] = '3';
-    bpb->volume_label[4] = '2';
-    bpb->volume_label[5] = 'I';
-    bpb->volume_label[6] = 'M';
-    bpb->volume_label[7] = 'G';
-    bpb->volume_label[8] = '\0';
-    bpb->file_system[0] = 'F';
-    bpb->file_system[1] = 'A';
-    bpb->file_system[2] = 'T';
-    bpb->file_system[3] = '3';
-    bpb->file_system[4] = '2';
-
-    bpb->signature[0] = 0x55;
-    bpb->signature[1] = 0xAA;
-}
-
-void init_root_directory(uint8_t *cluster_data, uint32_t self_cluster, uint32_t parent_cluster)
-{
-    struct SFNentry dot = {0};
-    struct SFNentry dotdot = {0};
-
-    // "."
-    memset(dot.name, ' ', 8);
-    dot.name[0] = '.';
-    memset(dot.ext, ' ', 3);
-    dot.attributes = 0x10; // directory
-    dot.cluster_low = self_cluster & 0xFFFF;
-    dot.cluster_high = (self_cluster >> 16) & 0xFFFF;
-
-    //  ".."
-    memset(dotdot.name, ' ', 8);
-    dotdot.name[0] = '.';
-    dotdot.name[1] = '.';
-    memset(dotdot.ext, ' ', 3);
-    dotdot.attributes = 0x10;
-    if (parent_cluster == 0)
-    {
-        dotdot.cluster_low = self_cluster & 0xFFFF;     // root point to itself
-        dotdot.cluster_high = (self_cluster >> 16) & 0xFFFF;
+static int cmd_format(struct Shell *sh, char *args)
+{
+    // format [-c <cluster size>] [-s <file size>] [-n <FATs>] [-r <reserved sectors>] [-a <alignment>]
+    //        [-L <label>] [-i <volume id>]
+    struct FormatOptions opt = {0};
+    int valid = 1;
+    char *saveptr;
+    for (char *arg = strtok_r(args, " \t", &saveptr); arg && valid; arg = strtok_r(NULL, " \t", &saveptr))
+    {
+        char *value = strtok_r(NULL, " \t", &saveptr);
+        long long number = value ? parse_size(value) : 0;
+        if (value == NULL)
+            valid = 0;
+        else if (strcmp(arg, "-c") == 0)
+            valid = is_power_of_two(number) && number >= 512 && number <= 65536 && (opt.cluster_size = number);
+        else if (strcmp(arg, "-s") == 0)
+            valid = number > 0 && (opt.file_size = number);
+        else if (strcmp(arg, "-n") == 0)
+            valid = (number == 1 || number == 2) && (opt.fat_count = number);
+        else if (strcmp(arg, "-r") == 0)
+            valid = number >= 8 && number <= 0xFFFF && (opt.reserved_sectors = number);
+        else if (strcmp(arg, "-a") == 0)
+            valid = is_power_of_two(number) && number >= 512 && number <= (16 << 20) && (opt.align = number);
+        else if (strcmp(arg, "-L") == 0)
+            valid = strlen(value) <= 11 && snprintf(opt.label, sizeof(opt.label), "%s", value) > 0;
+        else if (strcmp(arg, "-i") == 0)
+        {
+            char *end;
+            unsigned long id = strtoul(value, &end, 16);
+            valid = *end == '\0' && id > 0 && id <= 0xFFFFFFFFUL && (opt.volume_id = id);
+        }
+        else
+            valid = 0;
     }
-    else
+    if (!valid)
     {
-        dotdot.cluster_low = parent_cluster & 0xFFFF;
-        dotdot.cluster_high = (parent_cluster >> 16) & 0xFFFF;
+        fprintf(sh->out, "Use: format [-c <cluster size>] [-s <file size>] [-n 1|2] [-r <reserved sectors>] "
+                "[-a <alignment>] [-L <label>] [-i <hex volume id>]\n");
+        return -1;
     }
-    memcpy(&cluster_data[0], &dot, sizeof(dot));
-    memcpy(&cluster_data[32], &dotdot, sizeof(dotdot));
+
+    if (!format_volume(sh->vol, &opt))
+    {
+        fprintf(sh->out, "The volume (%ld bytes) is too small or too big for this geometry\n", sh->vol->size);
+        return -1;
+    }
+
+    const struct FAT32_BPB *bpb = &sh->vol->bpb;
+    fprintf(sh->out, "format: %u clusters of %u bytes, %u FAT(s) of %u sectors, data at byte %ld\n",
+            sh->vol->total_clusters, sh->vol->cluster_size, bpb->fat_amount, bpb->fat32_size,
+            (long)sh->vol->first_data_sector * bpb->bytes_per_sector);
+
+    sh->current_cluster = sh->vol->bpb.root_cluster;
+    strcpy(sh->path, "/");
+    return 0;
 }
-struct ParsedEntry
+
+static int cmd_cd(struct Shell *sh, char *args)
 {
-    char name[256];           // LFN or SFN
-    unsigned int first_cluster;
+    char *folder_name = next_word(&args);
+    if (folder_name == NULL || folder_name[0] == '\0' || next_word(&args) != NULL)
+    {
+        fprintf(sh->out, "Use: cd <path> (quoted if it has blanks)\n");
+        return -1;
+    }
+
+    // cd /a/b, cd ../c, cd ..
+    char new_path[1024];
+    uint32_t cluster;
     unsigned char is_directory;
-};
+    strcpy(new_path, sh->path);
 
-int parse_directory(uint8_t *cluster, struct ParsedEntry *entries, int cluster_size, int max_entries)
-{
-    int count = 0;
-    wchar_t lfn_buffer[260];
-    int lfn_index = 0;
-    memset(lfn_buffer, 0, sizeof(lfn_buffer));
+    int err = resolve_path(sh->vol, sh->current_cluster, folder_name, &cluster, &is_directory, new_path, sizeof(new_path));
+    if (err == FS_OK && !is_directory) err = FS_NOT_DIR;
+    if (err < 0)
+    {
+        fprintf(sh->out, "Directory not found: %s\n", folder_name);
+        return -1;
+    }
 
-    for (int offset = 0; offset < cluster_size; offset += 32) {
-        uint8_t *entry = &cluster[offset];
+    sh->current_cluster = cluster;
+    strcpy(sh->path, new_path);
+    return 0;
+}
 
-        // Empty (0x00)
-        if (entry[0] == 0x00) break;
+static int cmd_touch(struct Shell *sh, char *args)
+{
+    char *file_name;
+    if (split_words(args, &file_name, 1, 1) < 0)
+    {
+        fprintf(sh->out, "Use: touch <filename>\n");
+        return -1;
+    }
 
-        // Deleted (0xE5)
-        //if (entry[0] == 0xE5) continue;
+    // touch a/b/name
+    uint32_t parent;
+    char name[MAX_NAME_BYTES];
+    int err = resolve_parent(sh->vol, sh->current_cluster, file_name, &parent, name, sizeof(name));
+    if (err == FS_OK) err = create_file(sh->vol, parent, name);
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), file_name);
+        return -1;
+    }
 
-        uint8_t attr = entry[11];
-        if (attr == 0x0F)
-        {
-            // LFN
-            struct LFNentry *lfn = (struct LFNentry *)entry;
-            int seq = lfn->sequence_number & 0x1F; // without LAST_LONG_ENTRY
-            int offset_in_lfn = (seq - 1) * 13;
-
-            for (int i = 0; i < 5; i++)
-                lfn_buffer[offset_in_lfn + i] = lfn->name1[i];
-            for (int i = 0; i < 6; i++)
-                lfn_buffer[offset_in_lfn + 5 + i] = lfn->name2[i];
-            for (int i = 0; i < 2; i++)
-                lfn_buffer[offset_in_lfn + 11 + i] = lfn->name3[i];
-
-            lfn_index = offset_in_lfn + 13;
-        }
-        else
-        {
-            // SFN
-            struct SFNentry *sfn = (struct SFNentry *)entry;
+    fprintf(sh->out, "Created file \"%s\" (empty)\n", file_name);
+    return 0;
+}
 
-            if (count >= max_entries) break;
+static int cmd_write(struct Shell *sh, char *args)
+{
+    // write <path> <text>: the text and a newline become the file contents
+    char *text = args;
+    char *path = next_word(&text);
+    if (path == NULL)
+    {
+        fprintf(sh->out, "Use: write <path> <text>\n");
+        return -1;
+    }
 
-            struct ParsedEntry *pe = &entries[count];
-            memset(pe, 0, sizeof(*pe));
+    size_t length = strlen(text);
+    text[length++] = '\n';
+    int err = store_file(sh->vol, sh->current_cluster, path, -1, NULL, (const uint8_t *)text, length);
+    text[--length] = '\0';
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+        return -1;
+    }
+    return 0;
+}
 
-            // UTF-16 to UTF-8 (if LFN)
-            if (lfn_index > 0)
-            {
-                wcstombs(pe->name, lfn_buffer, sizeof(pe->name) - 1);
-                memset(lfn_buffer, 0, sizeof(lfn_buffer));
-                lfn_index = 0;
-            }
-            else
-            {
-                // SFN
-                char name[9] = {0}, ext[4] = {0};
-                memcpy(name, sfn->name, 8);
-                memcpy(ext, sfn->ext, 3);
-
-                // Видалити пробіли
-                for (int i = 7; i >= 0 && name[i] == ' '; i--) name[i] = '\0';
-                for (int i = 2; i >= 0 && ext[i] == ' '; i--) ext[i] = '\0';
-
-                if (ext[0])
-                    snprintf(pe->name, sizeof(pe->name), "%s.%s", name, ext);
-                else
-                    snprintf(pe->name, sizeof(pe->name), "%s", name);
-            }
+static int cmd_mkfile(struct Shell *sh, char *args)
+{
+    // mkfile <path> <size>[K|M|G]: a file of that many zero bytes, created or replaced
+    char *words[2];
+    long long size = split_words(args, words, 2, 2) < 0 ? -1 : parse_size(words[1]);
+    if (size < 0 || (size == 0 && strcmp(words[1], "0") != 0))
+    {
+        fprintf(sh->out, "Use: mkfile <path> <size>[K|M|G]\n");
+        return -1;
+    }
 
-            pe->first_cluster = ((uint32_t)sfn->cluster_high << 16) | sfn->cluster_low;
-            pe->is_directory = (sfn->attributes & 0x10) ? 1 : 0;
+    int fd = open("/dev/zero", O_RDONLY);
+    if (fd < 0)
+    {
+        perror("/dev/zero");
+        return -1;
+    }
+    int err = store_file(sh->vol, sh->current_cluster, words[0], fd, NULL, NULL, size);
+    close(fd);
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), words[0]);
+        return -1;
+    }
+    return 0;
+}
 
-            count++;
-        }
+static int cmd_rm(struct Shell *sh, char *args)
+{
+    // rm [-r] <path>
+    enum RemoveMode mode = REMOVE_FILE;
+    char *path = NULL;
+    int extra = 0;
+    for (char *arg = next_word(&args); arg; arg = next_word(&args))
+    {
+        if (strcmp(arg, "-r") == 0 && path == NULL)
+            mode = REMOVE_TREE;
+        else if (path == NULL)
+            path = arg;
+        else
+            extra = 1;
+    }
+    if (path == NULL || extra)
+    {
+        fprintf(sh->out, "Use: rm [-r] <path>\n");
+        return -1;
     }
 
-    return count;
+    int err = remove_path(sh->vol, sh->current_cluster, path, mode, NULL);
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+        return -1;
+    }
+    return 0;
 }
 
-void create_file_entry(char *name, uint8_t *cluster, unsigned int start_cluster, unsigned int size_bytes, unsigned int cluster_size)
+static int cmd_rmdir(struct Shell *sh, char *args)
 {
-    struct SFNentry file = {0};
+    char *path;
+    if (split_words(args, &path, 1, 1) < 0)
+    {
+        fprintf(sh->out, "Use: rmdir <path>\n");
+        return -1;
+    }
 
-    memset(file.name, ' ', 8);
-    memset(file.ext, ' ', 3);
+    int err = remove_path(sh->vol, sh->current_cluster, path, REMOVE_DIR, NULL);
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+        return -1;
+    }
+    return 0;
+}
 
-    char *dot = strchr(name, '.');
-    if (dot) {
-        strncpy((char*)file.name, name, dot - name);
-        strncpy((char*)file.ext, dot + 1, 3);
-    } else {
-        strncpy((char*)file.name, name, 8);
+static int cmd_compact(struct Shell *sh, char *args)
+{
+    (void)args;
+    struct stat before, after;
+    int fd = fileno(sh->vol->file);
+    fstat(fd, &before);
+    unsigned long runs;
+    unsigned long clusters = compact_volume(sh->vol, &runs);
+    fstat(fd, &after);
+
+    if (clusters == 0 && sh->vol->fsinfo.free_count > 0)
+    {
+        fprintf(sh->out, "The image can not have holes here\n");
+        return -1;
     }
+    long long reclaimed = (long long)(before.st_blocks - after.st_blocks) * 512;
+    fprintf(sh->out, "compact: %lu free clusters in %lu runs, %.1f MiB reclaimed, the image takes %.1f MiB\n",
+            clusters, runs, reclaimed / 1048576.0, after.st_blocks * 512 / 1048576.0);
+    return 0;
+}
 
-    file.attributes = 0x20; // archive (файл)
-    file.cluster_high = (start_cluster >> 16) & 0xFFFF;
-    file.cluster_low = start_cluster & 0xFFFF;
-    file.size = size_bytes;
+static int cmd_cat(struct Shell *sh, char *args)
+{
+    char *path;
+    if (split_words(args, &path, 1, 1) < 0)
+    {
+        fprintf(sh->out, "Use: cat <path>\n");
+        return -1;
+    }
 
-    int offset = find_free_entry_offset(cluster, cluster_size);
-    if (offset >= 0) {
-        memcpy(&cluster[offset], &file, sizeof(file));
+    struct FileRef file;
+    int err = find_file(sh->vol, sh->current_cluster, path, &file);
+    if (err == FS_OK)
+    {
+        fflush(sh->out); // the contents go straight to the descriptor
+        err = read_file(sh->vol, &file, fileno(sh->out), NULL);
     }
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+        return -1;
+    }
+    return 0;
 }
 
+static int cmd_import(struct Shell *sh, char *args)
+{
+    // import <host file> [<path>], by default into the current directory under the same name
+    char *words[2];
+    int count = split_words(args, words, 1, 2);
+    if (count < 0)
+    {
+        fprintf(sh->out, "Use: import <host file> [<path>]\n");
+        return -1;
+    }
+    char *host = words[0], *path = words[1];
+    if (count == 1)
+    {
+        char *slash = strrchr(host, '/');
+        path = slash ? slash + 1 : host;
+    }
+
+    int fd = open(host, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        if (fd < 0) perror(host); else fprintf(sh->out, "Not a regular file: %s\n", host);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    loff_t offset = 0;
+    int err = store_file(sh->vol, sh->current_cluster, path, fd, &offset, NULL, st.st_size);
+    close(fd);
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+        return -1;
+    }
+
+    fprintf(sh->out, "Imported %s (%lld bytes)\n", path, (long long)st.st_size);
+    return 0;
+}
 
-int find_free_cluster(uint32_t *FAT, int total_clusters)
+static int cmd_export(struct Shell *sh, char *args)
 {
-    for (int i = 2; i <= total_clusters; i++)
+    // export <path> <host file>
+    char *words[2];
+    if (split_words(args, words, 2, 2) < 0)
     {
-        if (FAT[i] == 0) return i;
+        fprintf(sh->out, "Use: export <path> <host file>\n");
+        return -1;
     }
-    return -1; // no free clusters
+    char *path = words[0], *host = words[1];
+
+    struct FileRef file;
+    int err = find_file(sh->vol, sh->current_cluster, path, &file);
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+        return -1;
+    }
+
+    int fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(host);
+        return -1;
+    }
+    loff_t offset = 0;
+    err = read_file(sh->vol, &file, fd, &offset);
+    close(fd);
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+        return -1;
+    }
+
+    fprintf(sh->out, "Exported %s (%u bytes)\n", path, file.size);
+    return 0;
 }
 
-void trim_to_parent(char *path)
+static int cmd_populate(struct Shell *sh, char *args)
 {
-    int len = strlen(path);
-    for (int i = len - 2; i >= 0; i--)
+    // populate <host dir> [<path>]
+    char *words[2];
+    int count = split_words(args, words, 1, 2);
+    if (count < 0)
     {
-        if (i == 0)
-        {
-            path[1] = '\0';
-            break;
-        }
-        if (path[i] == '/')
+        fprintf(sh->out, "Use: populate <host dir> [<path>]\n");
+        return -1;
+    }
+    char *host = words[0], *path = words[1];
+
+    uint32_t target = sh->current_cluster;
+    if (count == 2)
+    {
+        unsigned char is_directory;
+        int err = resolve_path(sh->vol, sh->current_cluster, path, &target, &is_directory, NULL, 0);
+        if (err == FS_OK && !is_directory) err = FS_NOT_DIR;
+        if (err < 0)
         {
-            path[i] = '\0';
-            break;
+            fprintf(sh->out, "%s: %s\n", fs_error(err), path);
+            return -1;
         }
     }
+
+    struct PopulatePlan plan;
+    int err = populate(sh->vol, target, host, &plan, sh->out);
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", fs_error(err), host);
+        return -1;
+    }
+
+    fprintf(sh->out, "Imported %u directories, %u files (%llu bytes, %llu clusters)\n",
+           plan.directories, plan.files, (unsigned long long)plan.bytes, (unsigned long long)plan.clusters);
+    return 0;
 }
 
+// Options shared by tree, du and find: [-l] [-s] [-j <threads>], the rest are returned in
+// 'words' (at most 'max_words').
+struct WalkArgs
+{
+    int long_format;               // -l: sizes and cluster counts
+    int summary;                   // -s: du prints only the total
+    unsigned int threads;
+    char *words[2];
+    int word_count;
+};
 
-long get_file_size(FILE *fp)
+static int parse_walk_args(char *args, struct WalkArgs *wa, int max_words)
 {
-    long current = ftell(fp);
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, current, SEEK_SET);
-    return size;
+    memset(wa, 0, sizeof(*wa));
+    wa->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (char *arg = next_word(&args); arg; arg = next_word(&args))
+    {
+        if (strcmp(arg, "-l") == 0)
+            wa->long_format = 1;
+        else if (strcmp(arg, "-s") == 0)
+            wa->summary = 1;
+        else if (strcmp(arg, "-j") == 0 && (arg = next_word(&args)) != NULL)
+            wa->threads = strtoul(arg, NULL, 10);
+        else if (wa->word_count < max_words)
+            wa->words[wa->word_count++] = arg;
+        else
+            return -1;
+    }
+    return 0;
 }
 
-uint32_t FAT[MAX_FAT_SIZE_BYTES / sizeof(uint32_t)];
+// Resolves the directory to walk ("." if 'path' is NULL) and reads its tree.
+static struct WalkDir *walk_path(struct Shell *sh, const char *path, const struct WalkArgs *wa, int count_clusters,
+                                 char *display, size_t display_size)
+{
+    uint32_t cluster;
+    unsigned char is_directory;
+    snprintf(display, display_size, "%s", sh->path);
+    int err = resolve_path(sh->vol, sh->current_cluster, path ? path : ".", &cluster, &is_directory, display, display_size);
+    if (err == FS_OK && !is_directory) err = FS_NOT_DIR;
+    if (err < 0)
+    {
+        fprintf(sh->out, "%s: %s\n", path, fs_error(err));
+        return NULL;
+    }
+    return walk_tree(sh->vol, cluster, wa->threads, count_clusters);
+}
 
+static void print_tree(FILE *out, const struct WalkDir *dir, char *prefix, size_t prefix_length, int long_format)
+{
+    for (unsigned int i = 0; i < dir->count; i++)
+    {
+        const struct WalkEntry *entry = &dir->entries[i];
+        int last = (i + 1 == dir->count);
+        fprintf(out, "%s%s%s%s", prefix, last ? "`-- " : "|-- ", entry->name, entry->is_directory ? "/" : "");
+        if (long_format && entry->dir)
+            fprintf(out, "  (%llu bytes, %llu clusters)", entry->dir->total_size, entry->dir->total_clusters);
+        else if (long_format && !entry->is_directory)
+            fprintf(out, "  (%u bytes, %u clusters)", entry->size, entry->clusters);
+        fprintf(out, "\n");
+
+        if (entry->dir && prefix_length + 5 < 4096)
+        {
+            strcpy(prefix + prefix_length, last ? "    " : "|   ");
+            print_tree(out, entry->dir, prefix, prefix_length + 4, long_format);
+            prefix[prefix_length] = '\0';
+        }
+    }
+}
 
-int main(int argc, char *argv[])
+static int cmd_tree(struct Shell *sh, char *args)
 {
+    // tree [-l] [-j <threads>] [path]
+    struct WalkArgs wa;
+    if (parse_walk_args(args, &wa, 1) < 0 || wa.summary)
+    {
+        fprintf(sh->out, "Use: tree [-l] [-j <threads>] [path]\n");
+        return -1;
+    }
 
-    if(argc < 2 || argc > 2)
+    char display[1024];
+    struct WalkDir *root = walk_path(sh, wa.word_count ? wa.words[0] : NULL, &wa, wa.long_format, display, sizeof(display));
+    if (root == NULL) return -1;
+    walk_sum(root);
+
+    char prefix[4096] = "";
+    fprintf(sh->out, "%s\n", display);
+    print_tree(sh->out, root, prefix, 0, wa.long_format);
+    fprintf(sh->out, "%lu directories, %lu files", root->directories, root->files);
+    if (wa.long_format) fprintf(sh->out, ", %llu bytes in %llu clusters", root->total_size, root->total_clusters);
+    fprintf(sh->out, "\n");
+    walk_free(root);
+    return 0;
+}
+
+// du: subdirectories first, then the directory itself, like du(1)
+static void print_du(FILE *out, const struct WalkDir *dir, char *path, size_t path_length, size_t path_size)
+{
+    for (unsigned int i = 0; i < dir->count; i++)
     {
-        printf("Usage: %s <filedisk_FAT32>\n", argv[0]);
-        return 1;
+        const struct WalkEntry *entry = &dir->entries[i];
+        if (!entry->dir) continue;
+        int n = snprintf(path + path_length, path_size - path_length, "%s%s",
+                         path[path_length - 1] == '/' ? "" : "/", entry->name);
+        if (n > 0 && path_length + n < path_size) print_du(out, entry->dir, path, path_length + n, path_size);
+        path[path_length] = '\0';
     }
+    fprintf(out, "%14llu %10llu  %s\n", dir->total_size, dir->total_clusters, path);
+}
 
-    struct FAT32_BPB bpb;
+static int cmd_du(struct Shell *sh, char *args)
+{
+    // du [-s] [-j <threads>] [path]
+    struct WalkArgs wa;
+    if (parse_walk_args(args, &wa, 1) < 0 || wa.long_format)
+    {
+        fprintf(sh->out, "Use: du [-s] [-j <threads>] [path]\n");
+        return -1;
+    }
 
-    FILE *file = fopen(argv[1], "rb+");
+    char display[4096];
+    struct WalkDir *root = walk_path(sh, wa.word_count ? wa.words[0] : NULL, &wa, 1, display, 1024);
+    if (root == NULL) return -1;
+    walk_sum(root);
 
-    if(file == NULL)
+    fprintf(sh->out, "%14s %10s  %s\n", "bytes", "clusters", "path");
+    if (wa.summary)
+        fprintf(sh->out, "%14llu %10llu  %s\n", root->total_size, root->total_clusters, display);
+    else
+        print_du(sh->out, root, display, strlen(display), sizeof(display));
+    walk_free(root);
+    return 0;
+}
+
+static unsigned long print_found(FILE *out, const struct WalkDir *dir, const char *pattern, char *path,
+                                 size_t path_length, size_t path_size, int long_format)
+{
+    unsigned long found = 0;
+    for (unsigned int i = 0; i < dir->count; i++)
     {
-        printf("Okay, creating file (20 MB size). \n");
-        file = fopen(argv[1], "rb+");
-        fseek(file, 2 * 1024 * 1024 - 1, SEEK_SET); // 2MB - 1
-        fputc(0, file); // write byte in order to increase the file size
+        const struct WalkEntry *entry = &dir->entries[i];
+        int n = snprintf(path + path_length, path_size - path_length, "%s%s",
+                         path[path_length - 1] == '/' ? "" : "/", entry->name);
+        if (n < 0 || path_length + n >= path_size) continue;
+
+        if (fnmatch(pattern, entry->name, FNM_CASEFOLD) == 0)
+        {
+            found++;
+            fprintf(out, "%s%s", path, entry->is_directory ? "/" : "");
+            if (long_format && entry->dir)
+                fprintf(out, "  (%llu bytes, %llu clusters)", entry->dir->total_size, entry->dir->total_clusters);
+            else if (long_format && !entry->is_directory)
+                fprintf(out, "  (%u bytes, %u clusters)", entry->size, entry->clusters);
+            fprintf(out, "\n");
+        }
+        if (entry->dir) found += print_found(out, entry->dir, pattern, path, path_length + n, path_size, long_format);
+        path[path_length] = '\0';
     }
+    return found;
+}
 
-    long size_file = get_file_size(file);
-    fread(&bpb, sizeof(struct FAT32_BPB), 1, file);
+static int cmd_find(struct Shell *sh, char *args)
+{
+    // find [-l] [-j <threads>] <pattern> [path]
+    struct WalkArgs wa;
+    if (parse_walk_args(args, &wa, 2) < 0 || wa.word_count == 0 || wa.summary)
+    {
+        fprintf(sh->out, "Use: find [-l] [-j <threads>] <pattern> [path]   (pattern: *.txt, data?, [ab]*)\n");
+        return -1;
+    }
 
-    int is_not_fat32 = 0;
+    char display[4096];
+    struct WalkDir *root = walk_path(sh, wa.word_count > 1 ? wa.words[1] : NULL, &wa, wa.long_format, display, 1024);
+    if (root == NULL) return -1;
+    if (wa.long_format) walk_sum(root);
 
-    unsigned int current_cluster = 2; // '/' root
+    print_found(sh->out, root, wa.words[0], display, strlen(display), sizeof(display), wa.long_format);
+    walk_free(root);
+    return 0;
+}
 
-    if (bpb.root_cluster == 0)
+// Fragmentation report ('frag') and defragmentation ('defrag'). Both walk the tree from the
+// root one directory at a time; defrag moves every fragmented chain into one free extent,
+// as low on the volume as there is one, with a single copy per run.
+
+#define FRAG_TOP 10                // most fragmented chains listed without -v
+#define FREE_RUN_BUCKETS 32        // free runs of 1, 2-3, 4-7, ... clusters
+
+// files, directories and contiguity of a finished scan
+static void print_frag_summary(FILE *out, const struct FragScan *scan)
+{
+    unsigned long long links = scan->clusters - scan->chains;
+    unsigned long long contiguous = scan->clusters - scan->fragments;
+    fprintf(out, "%lu files (%lu fragmented), %lu directories (%lu fragmented)\n",
+           scan->files, scan->fragmented_files, scan->directories, scan->fragmented_directories);
+    fprintf(out, "%llu clusters in %llu fragments, contiguity %.1f%%\n", scan->clusters, scan->fragments,
+           links ? 100.0 * contiguous / links : 100.0);
+}
+
+// Free runs by length (bucket b: 2^b to 2^(b+1)-1 clusters); returns how many there are.
+static unsigned long count_free_runs(struct Volume *vol, unsigned long *runs, unsigned long long *run_clusters,
+                                     unsigned long *largest)
+{
+    unsigned long total_runs = 0;
+    uint32_t last = vol->total_clusters + 1;
+    *largest = 0;
+    for (int start = find_free_run(vol, 2, last, 1); start >= 0; )
     {
-        is_not_fat32 = 1;
+        unsigned int length = free_run_length(vol, start);
+        int bucket = 31 - __builtin_clz(length);
+        runs[bucket]++;
+        run_clusters[bucket] += length;
+        total_runs++;
+        if (length > *largest) *largest = length;
+        start = (start + length <= last) ? find_free_run(vol, start + length, last, 1) : -1;
     }
+    return total_runs;
+}
 
-    unsigned int cluster_size = bpb.sectors_per_cluster * bpb.bytes_per_sector;
+static int cmd_frag(struct Shell *sh, char *args)
+{
+    // frag [-v]
+    int verbose = strcmp(args, "-v") == 0;
+    if (args[0] != '\0' && !verbose)
+    {
+        fprintf(sh->out, "Use: frag [-v]\n");
+        return -1;
+    }
 
+    struct Volume *vol = sh->vol;
+    struct FragScan scan = {0};
+    frag_walk(vol, &scan);
+    print_frag_summary(sh->out, &scan);
 
-    uint32_t fat_size_bytes = bpb.fat32_size * bpb.bytes_per_sector;
+    if (scan.count > 0)
+    {
+        qsort(scan.list, scan.count, sizeof(struct FragChain), compare_fragments);
+        unsigned int shown = (verbose || scan.count <= FRAG_TOP) ? scan.count : FRAG_TOP;
+        fprintf(sh->out, "%10s %10s  %s\n", "fragments", "clusters", verbose ? "path" : "path (most fragmented)");
+        for (unsigned int i = 0; i < shown; i++)
+            fprintf(sh->out, "%10u %10u  %s%s\n", scan.list[i].fragments, scan.list[i].clusters, scan.list[i].path,
+                   scan.list[i].is_directory && strcmp(scan.list[i].path, "/") != 0 ? "/" : ""); // the root is "/"
+        if (shown < scan.count) fprintf(sh->out, "... %u more (frag -v)\n", scan.count - shown);
+    }
+    frag_free(&scan);
 
-    fseek(file, bpb.reserved_sectors * bpb.bytes_per_sector, SEEK_SET);
+    // free space: runs by length
+    unsigned long runs[FREE_RUN_BUCKETS] = {0};
+    unsigned long long run_clusters[FREE_RUN_BUCKETS] = {0};
+    unsigned long largest;
+    unsigned long total_runs = count_free_runs(vol, runs, run_clusters, &largest);
 
-    // read FAT
-    fread(FAT, fat_size_bytes, 1, file);
-    char user_input[1024];
+    fprintf(sh->out, "free: %u clusters in %lu runs, largest %lu\n", vol->fsinfo.free_count, total_runs, largest);
+    fprintf(sh->out, "%21s %10s %12s\n", "run length", "runs", "clusters");
+    for (int b = 0; b < FREE_RUN_BUCKETS; b++)
+    {
+        if (runs[b] == 0) continue;
+        char range[32];
+        if (b == 0) snprintf(range, sizeof(range), "1");
+        else snprintf(range, sizeof(range), "%lu-%lu", 1UL << b, (2UL << b) - 1);
+        fprintf(sh->out, "%21s %10lu %12llu\n", range, runs[b], run_clusters[b]);
+    }
+    return 0;
+}
 
-    char path[1024] = "/";
-    char current_folder_name[32] = "/";
+static int cmd_defrag(struct Shell *sh, char *args)
+{
+    (void)args;
+    struct Volume *vol = sh->vol;
+    struct FragScan scan = {0};
+    scan.relocate = 1;
+    frag_walk(vol, &scan);
+    frag_free(&scan);
+
+    fprintf(sh->out, "Moved %lu of %lu fragmented chains (%lu clusters)", scan.moved,
+           scan.fragmented_files + scan.fragmented_directories, scan.moved_clusters);
+    if (scan.not_placed) fprintf(sh->out, ", %lu did not fit into a free extent", scan.not_placed);
+    fprintf(sh->out, "\n");
+
+    // the current directory may have moved
+    uint32_t cluster;
+    unsigned char is_directory;
+    if (resolve_path(vol, vol->bpb.root_cluster, sh->path, &cluster, &is_directory, NULL, 0) == FS_OK && is_directory)
+        sh->current_cluster = cluster;
+    else
+    {
+        sh->current_cluster = vol->bpb.root_cluster;
+        strcpy(sh->path, "/");
+    }
+    return 0;
+}
 
-    // running the emulator
-    while(1)
+static int cmd_check(struct Shell *sh, char *args)
+{
+    // check [-r] [-j <threads>]
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int repair = 0;
+    char *saveptr;
+    for (char *arg = strtok_r(args, " \t", &saveptr); arg; arg = strtok_r(NULL, " \t", &saveptr))
     {
-        printf("%s> ", path);
-        fgets(user_input, sizeof(user_input), stdin);
-        if(strncmp(user_input, "exit", 4) == 0)
+        if (strcmp(arg, "-r") == 0)
+            repair = 1;
+        else if (strcmp(arg, "-j") == 0 && (arg = strtok_r(NULL, " \t", &saveptr)) != NULL)
+            threads = strtol(arg, NULL, 10);
+        else
         {
-            break;
+            fprintf(sh->out, "Use: check [-r] [-j <threads>]\n");
+            return -1;
         }
+    }
 
-        if(strncmp(user_input, "ls", 2) == 0)
-        {
-            if(is_not_fat32)
-            {
-                printf("Unknown disk format\n");
-                continue;
-            }
+    return check_volume(sh->vol, threads > 0 ? threads : 1, repair, sh->out) == 0 ? 0 : -1;
+}
 
-            uint8_t cluster[cluster_size];
-            uint32_t first_data_sector = bpb.reserved_sectors + (bpb.fat_amount * bpb.fat32_size);
+static void print_latency(FILE *out, const struct CommandStats *cs)
+{
+    fprintf(out, "%-8s %8lu %8lu %10.1f %10.1f %10.1f %10.1f\n", cs->name, cs->count, cs->errors,
+           latency_percentile(cs, 0.50) / 1e3, latency_percentile(cs, 0.99) / 1e3, cs->max_ns / 1e3,
+           (double)cs->io_ops / cs->count);
+}
 
-            uint32_t root_sector = first_data_sector;
+// Per-command table of 'stats'; 'total' (all commands together) is the last row if given.
+static void print_command_stats(FILE *out, const struct CommandStats *stats, const struct CommandStats *total)
+{
+    fprintf(out, "%-8s %8s %8s %10s %10s %10s %10s\n", "command", "count", "errors", "p50 us", "p99 us", "max us", "io/cmd");
+    for (int i = 0; i < MAX_COMMANDS; i++)
+    {
+        if (stats[i].name != NULL && stats[i].count > 0) print_latency(out, &stats[i]);
+    }
+    if (total != NULL && total->count > 0) print_latency(out, total);
+}
 
-            unsigned int offset_current_cluster = (root_sector * bpb.bytes_per_sector) + (current_cluster - 2) * cluster_size;
-            fseek(file,  offset_current_cluster, SEEK_SET);
+static void merge_stats(struct CommandStats *to, const struct CommandStats *from)
+{
+    to->count += from->count;
+    to->errors += from->errors;
+    to->total_ns += from->total_ns;
+    if (from->max_ns > to->max_ns) to->max_ns = from->max_ns;
+    to->io_ops += from->io_ops;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) to->buckets[b] += from->buckets[b];
+}
 
-            fread(cluster, cluster_size, 1, file);
-            struct ParsedEntry entries[128];
+static int cmd_stats(struct Shell *sh, char *args)
+{
+    if (strcmp(args, "reset") == 0)
+    {
+        memset(&sh->vol->io, 0, sizeof(sh->vol->io));
+        memset(sh->stats, 0, sizeof(sh->stats));
+        return 0;
+    }
 
+    const struct IoStats *io = &sh->vol->io;
+    fprintf(sh->out, "%-8s %10s %10s %10s %12s %12s\n", "region", "reads", "writes", "seeks", "read KiB", "written KiB");
+    for (int r = 0; r < REGION_COUNT; r++)
+    {
+        fprintf(sh->out, "%-8s %10lu %10lu %10lu %12.1f %12.1f\n", region_names[r], io->reads[r], io->writes[r],
+               io->seeks[r], io->bytes_read[r] / 1024.0, io->bytes_written[r] / 1024.0);
+    }
+    fprintf(sh->out, "flushes: %lu\n", io->flushes);
+    if (sh->vol->journal_fd >= 0)
+        fprintf(sh->out, "journal: %lu commits, %.1f KiB\n", io->journal_commits, io->journal_bytes / 1024.0);
+    if (!sh->vol->map)
+        fprintf(sh->out, "async I/O: %s, depth %u, %lu requests in %lu batches\n", aio_backend_names[sh->vol->aio.backend],
+               sh->vol->aio.depth, io->aio_requests, io->aio_batches);
+
+    print_command_stats(sh->out, sh->stats, NULL);
+    return 0;
+}
 
-            int count = parse_directory(cluster, entries, cluster_size, 128);
+// Machine-readable form of 'stats' (JSON), written on exit with --stats-json.
+void dump_stats(const struct Shell *sh, FILE *out)
+{
+    const struct IoStats *io = &sh->vol->io;
+    fprintf(out, "{\"io\":{");
+    for (int r = 0; r < REGION_COUNT; r++)
+    {
+        fprintf(out, "\"%s\":{\"reads\":%lu,\"writes\":%lu,\"seeks\":%lu,\"bytes_read\":%llu,\"bytes_written\":%llu},",
+                region_names[r], io->reads[r], io->writes[r], io->seeks[r], io->bytes_read[r], io->bytes_written[r]);
+    }
+    fprintf(out, "\"flushes\":%lu,\"journal_commits\":%lu,\"journal_bytes\":%llu,\"aio_requests\":%lu,\"aio_batches\":%lu},\"commands\":{",
+            io->flushes, io->journal_commits, io->journal_bytes, io->aio_requests, io->aio_batches);
 
+    int first = 1;
+    for (int i = 0; i < MAX_COMMANDS; i++)
+    {
+        const struct CommandStats *cs = &sh->stats[i];
+        if (cs->name == NULL || cs->count == 0) continue;
+        fprintf(out, "%s\"%s\":{\"count\":%lu,\"errors\":%lu,\"total_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,\"io_ops\":%llu}",
+                first ? "" : ",", cs->name, cs->count, cs->errors, cs->total_ns,
+                latency_percentile(cs, 0.50), latency_percentile(cs, 0.99), cs->max_ns, cs->io_ops);
+        first = 0;
+    }
+    fprintf(out, "}}\n");
+}
 
-            for(int i = 0; i < count; i++)
-            {
-                printf("%s ", entries[i].name);
-            }
-            printf("\n");
-        }
+// What a command does to the volume; in a session it decides how the command is locked.
+enum Access
+{
+    READS,                         // on the session's view, in parallel with anything but WHOLE_TREE
+    CHANGES,                       // on the volume itself, one at a time, committed at the end
+    WHOLE_TREE                     // the same, and no one may read meanwhile
+};
 
-        else if(strncmp(user_input, "mkdir ", 6) == 0)
-        {
-            if(is_not_fat32)
-            {
-                printf("Unknown disk format\n");
-                continue;
-            }
+struct Command
+{
+    const char *name;
+    int needs_fat32;               // refuses to run on an unformatted image
+    enum Access access;
+    int (*run)(struct Shell *sh, char *args);
+};
 
-            char folder_name[1024];
-            sscanf(user_input, "mkdir %s", folder_name);
+static const struct Command commands[] =
+{
+    { "ls",     1, READS,      cmd_ls },
+    { "cd",     1, READS,      cmd_cd },
+    { "mkdir",  1, CHANGES,    cmd_mkdir },
+    { "touch",  1, CHANGES,    cmd_touch },
+    { "write",  1, CHANGES,    cmd_write },
+    { "mkfile", 1, CHANGES,    cmd_mkfile },
+    { "rm",     1, CHANGES,    cmd_rm },
+    { "rmdir",  1, CHANGES,    cmd_rmdir },
+    { "cat",    1, READS,      cmd_cat },
+    { "import", 1, CHANGES,    cmd_import },
+    { "export", 1, READS,      cmd_export },
+    { "populate", 1, WHOLE_TREE, cmd_populate },
+    { "check",  1, WHOLE_TREE, cmd_check },
+    { "fsck",   1, WHOLE_TREE, cmd_check },
+    { "tree",   1, READS,      cmd_tree },
+    { "du",     1, READS,      cmd_du },
+    { "find",   1, READS,      cmd_find },
+    { "frag",   1, CHANGES,    cmd_frag },   // only reads, but through the volume's caches
+    { "defrag", 1, WHOLE_TREE, cmd_defrag },
+    { "compact", 1, CHANGES,   cmd_compact },
+    { "format", 0, WHOLE_TREE, cmd_format },
+    { "sync",   0, CHANGES,    cmd_sync },
+    { "cache",  0, READS,      cmd_cache },
+    { "stats",  0, READS,      cmd_stats },
+    { "exit",   0, READS,      cmd_exit },
+};
 
-            strtok(folder_name, " ");
-            strtok(folder_name, "\n");
-            folder_name[strlen(folder_name)] = '\0';
+// A session reads through its view and changes the served volume itself.
+static void begin_command(struct Shell *sh, enum Access access)
+{
+    if (access == READS)
+    {
+        sh->vol = sh->view;
+        begin_read(sh->view);
+    }
+    else
+    {
+        sh->vol = sh->view->shared;
+        begin_write(sh->vol, access == WHOLE_TREE);
+    }
+}
 
-            // 1. Find free cluster (yeah, we could write this information to FSinfo partion)
-            unsigned int data_sectors = bpb.total_sectors - (bpb.reserved_sectors + bpb.fat_amount * bpb.fat32_size);
+static void end_command(struct Shell *sh, enum Access access)
+{
+    if (access == READS)
+        end_read(sh->view);
+    else
+        commit_volume(sh->vol);
+}
 
-            unsigned int total_clusters = data_sectors / bpb.sectors_per_cluster;
-            unsigned int free_cluster =  find_free_cluster(FAT, total_clusters);
-            if (free_cluster == -1)
-            {
-                printf("No free clusters\n");
-                continue;
-            }
+static FILE *trace;                // --record, NULL otherwise
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long trace_start;
 
-            FAT[free_cluster] = 0x0FFFFFFF; // mark as used (EOF)
+// One line of the trace: "<us since the start> <session> <command>", in the order the
+// commands get to run (a session's command is recorded under its locks, so none is after
+// the server stopped).
+static void record_command(const struct Shell *sh, const char *name, const char *args)
+{
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace, "%llu %u %s%s%s\n", (clock_ns() - trace_start) / 1000, sh->session, name,
+            args[0] ? " " : "", args);
+    pthread_mutex_unlock(&trace_lock);
+}
 
-            // 2. ccurrent_cluster
-            uint8_t *root_cluster = calloc(1, cluster_size);
-            uint32_t first_data_sector = bpb.reserved_sectors + (bpb.fat_amount * bpb.fat32_size);
-            uint32_t current_sector = first_data_sector;
-            unsigned int offset_current_cluster = (current_sector * bpb.bytes_per_sector) + (current_cluster - 2) * cluster_size;
+// The current directory may have been removed (by this shell or another session): then
+// the shell goes back to the root instead of using clusters that are free or reused.
+static void check_current_directory(struct Shell *sh)
+{
+    struct Volume *vol = sh->vol;
+    if (!vol->is_fat32 || sh->current_cluster == vol->bpb.root_cluster) return;
 
-            fseek(file,  offset_current_cluster, SEEK_SET);
-            fread(root_cluster, 1, cluster_size, file);
+    lock_directory(vol, sh->current_cluster);
+    int exists = is_directory_start(vol, sh->current_cluster);
+    unlock_directory(vol, sh->current_cluster);
+    if (exists) return;
 
-            // 3. Create folder
-            create_folder(folder_name, root_cluster, free_cluster, bpb.bytes_per_sector * bpb.sectors_per_cluster);
+    fprintf(sh->out, "%s was removed, back to /\n", sh->path);
+    sh->current_cluster = vol->bpb.root_cluster;
+    strcpy(sh->path, "/");
+}
 
-            // 4. AND update the current cluster
-            fseek(file,  offset_current_cluster, SEEK_SET);
-            fwrite(root_cluster, cluster_size, 1, file);
-            fflush(file);
+// Runs one command ("name args"), returns 0 on success. Empty lines and '#' comments are skipped.
+int run_command(struct Shell *sh, char *line)
+{
+    while (*line == ' ' || *line == '\t') line++;
+    size_t length = strcspn(line, "\r\n");
+    while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t')) length--;
+    line[length] = '\0';
+    if (line[0] == '\0' || line[0] == '#') return 0;
+
+    char *args = line + strcspn(line, " \t");
+    if (*args != '\0')
+    {
+        *args++ = '\0';
+        while (*args == ' ' || *args == '\t') args++;
+    }
 
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++)
+    {
+        if (strcmp(line, commands[i].name) != 0) continue;
 
-            // 5. init '.' and '..'
-            uint8_t *new_folder_cluster = calloc(1, cluster_size);
-            init_root_directory(new_folder_cluster, free_cluster, bpb.root_cluster); // треба приймати і parent
+        if (sh->view) begin_command(sh, commands[i].access);
+        if (trace) record_command(sh, line, args);
+        check_current_directory(sh);
 
-            int offset_next_cluster = (first_data_sector + (free_cluster - 2) * bpb.sectors_per_cluster) * bpb.bytes_per_sector;
+        if (commands[i].needs_fat32 && !sh->vol->is_fat32)
+        {
+            fprintf(sh->out, "Unknown disk format\n");
+            if (sh->view) end_command(sh, commands[i].access);
+            return -1;
+        }
 
-            fseek(file, offset_next_cluster, SEEK_SET);
-            fwrite(new_folder_cluster, cluster_size, 1, file);
-            fflush(file);
+        unsigned long long io_before = io_total(&sh->vol->io);
+        unsigned long long start = clock_ns();
+        int result = commands[i].run(sh, args);
+        unsigned long long elapsed = clock_ns() - start;
+
+        struct CommandStats *cs = &sh->stats[i];
+        cs->name = commands[i].name;
+        cs->count++;
+        if (result < 0) cs->errors++;
+        cs->total_ns += elapsed;
+        if (elapsed > cs->max_ns) cs->max_ns = elapsed;
+        unsigned long long io_after = io_total(&sh->vol->io);
+        cs->io_ops += (io_after >= io_before) ? io_after - io_before : io_after; // 'stats reset' ran
+        cs->buckets[latency_bucket(elapsed)]++;
+
+        // group commit: the journal is written once for a batch of commands
+        // (a change made by a session is committed right away)
+        if (sh->view)
+            end_command(sh, commands[i].access);
+        else if (sh->vol->journal_fd >= 0 && ++sh->vol->journal_ops >= sh->vol->journal_batch)
+            sync_volume(sh->vol);
+        return result;
+    }
 
-            // 6. writing into FAT
-            fseek(file, bpb.reserved_sectors * bpb.bytes_per_sector, SEEK_SET);
-            fwrite(FAT, bpb.fat32_size * bpb.bytes_per_sector, 1, file);
-            fflush(file);
+    fprintf(sh->out, "Unknown command: %s\n", line);
+    return -1;
+}
 
-            free(root_cluster);
-            free(new_folder_cluster);
-            printf("Created folder: %s (cluster %d)\n", folder_name, free_cluster);
-        }
-        else if(strncmp(user_input, "format", 6) == 0)
+// Runs every ';'-separated command of the line. Returns -1 if one of them failed
+// (with 'stop_on_error' the rest of the line is not run).
+int run_line(struct Shell *sh, char *line, int stop_on_error)
+{
+    int result = 0;
+    char *saveptr;
+    for (char *cmd = strtok_r(line, ";", &saveptr); cmd && !sh->done; cmd = strtok_r(NULL, ";", &saveptr))
+    {
+        if (run_command(sh, cmd) < 0)
         {
-            printf("format\n");
+            result = -1;
+            if (stop_on_error) break;
+        }
+    }
+    return result;
+}
+
+#define DEFAULT_IMAGE_SIZE (2LL * 1024 * 1024)
+
+long get_file_size(FILE *fp)
+{
+    long current = ftell(fp);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, current, SEEK_SET);
+    return size;
+}
 
-            to_format(&bpb, size_file);
+// ---- server mode (--serve) ----
 
-            // Write FAT32 BPB
-            fseek(file, 0, SEEK_SET);
-            fwrite(&bpb, sizeof(struct FAT32_BPB), 1, file);
-            fflush(file);
+struct Session
+{
+    struct Volume *vol;
+    int fd;
+    unsigned int id;               // 1, 2, ... in the order the clients came
+};
 
-            // Write FATable
-            fat_size_bytes = bpb.fat32_size * bpb.bytes_per_sector;
-            memset(FAT, 0, fat_size_bytes);
+static volatile sig_atomic_t stopping;
 
-            FAT[0] = 0x0FFFFFF8; // FATid
-            FAT[1] = 0xFFFFFFFF; // reserved
-            FAT[2] = 0x0FFFFFFF; // rootdirectory — EOF
+static void stop_serving(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
 
-            fseek(file, bpb.reserved_sectors * bpb.bytes_per_sector, SEEK_SET);
-            fwrite(FAT, fat_size_bytes, 1, file);
-            fflush(file);
+// One client: its own shell and view, commands read line by line; the prompt tells the
+// client that the previous line is done.
+static void *run_session(void *arg)
+{
+    struct Session *session = arg;
+    struct Shell *sh = calloc(1, sizeof(struct Shell));
+    struct Volume *view = malloc(sizeof(struct Volume));
+    int out_fd = dup(session->fd);
+    FILE *in = fdopen(session->fd, "r");
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+
+    if (sh && view && in && out)
+    {
+        open_view(view, session->vol);
+        sh->vol = sh->view = view;
+        sh->out = out;
+        sh->session = session->id;
+        sh->current_cluster = 2; // '/' root
+        strcpy(sh->path, "/");
+
+        char line[1024];
+        while (!sh->done)
+        {
+            fprintf(out, "%s> ", sh->path);
+            if (fflush(out) != 0 || fgets(line, sizeof(line), in) == NULL) break;
+            run_line(sh, line, 0);
+        }
+        close_view(view);
+    }
 
-            if (bpb.fat_amount == 2)
-            {
-                fwrite(FAT, fat_size_bytes, 1, file); // Копія FAT
-            }
+    if (out) fclose(out); else if (out_fd >= 0) close(out_fd);
+    if (in) fclose(in); else close(session->fd);
+    free(view);
+    free(sh);
+    free(session);
+    return NULL;
+}
 
-            // Miss UEinfo sector
-            uint32_t first_data_sector = bpb.reserved_sectors + (bpb.fat_amount * bpb.fat32_size);
+// Serves the volume on a Unix domain socket, a thread per client, until SIGINT or SIGTERM
+// (main() blocks them, they only get through while waiting for a client). Returns once the
+// running commands are done; the sessions are left waiting.
+static int serve(struct Volume *vol, const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        printf("Socket path is too long: %s\n", path);
+        return -1;
+    }
+    if (!serve_volume(vol))
+    {
+        printf("Not enough memory to serve the volume\n");
+        return -1;
+    }
 
-            cluster_size = bpb.bytes_per_sector * bpb.sectors_per_cluster;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
 
-            uint8_t *cluster = calloc(1, cluster_size);
-            init_root_directory(cluster, 2, 0);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path); // left by a killed server
 
-            uint32_t root_sector = first_data_sector;
-            int test = root_sector * bpb.bytes_per_sector;
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 64) < 0)
+    {
+        perror(path);
+        if (listener >= 0) close(listener);
+        return -1;
+    }
 
-            fseek(file, root_sector * bpb.bytes_per_sector, SEEK_SET);
-            fwrite(cluster, cluster_size, 1, file);
-            fflush(file);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_serving; // no SA_RESTART: the wait for a client ends
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);     // a client that went away fails a write, not the server
 
-            is_not_fat32 = 0;
-            fseek(file, 0, SEEK_SET);
+    sigset_t waiting;
+    pthread_sigmask(SIG_BLOCK, NULL, &waiting);
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGTERM);
 
+    printf("Serving %s\n", path);
+    fflush(stdout);
 
-            current_cluster = bpb.root_cluster;
+    struct pollfd pfd = { .fd = listener, .events = POLLIN };
+    unsigned int clients = 0;
+    while (!stopping)
+    {
+        if (ppoll(&pfd, 1, NULL, &waiting) < 0) continue; // EINTR: 'stopping' is checked
+
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) continue;
 
+        struct Session *session = malloc(sizeof(struct Session));
+        pthread_t id;
+        if (session != NULL)
+        {
+            session->vol = vol;
+            session->fd = fd;
+            session->id = ++clients;
         }
-        else if (strncmp(user_input, "cd ", 3) == 0)
+        if (session == NULL || pthread_create(&id, NULL, run_session, session) != 0)
         {
-            if(is_not_fat32)
-            {
-                printf("Unknown disk format\n");
-                continue;
-            }
-
-            char folder_name[32];
-            sscanf(user_input, "cd %s", folder_name);
-
-            if (strcmp(folder_name, "/") == 0)
-            {
-                current_cluster = bpb.root_cluster;
-                continue;
-            }
+            close(fd);
+            free(session);
+            continue;
+        }
+        pthread_detach(id);
+    }
 
+    close(listener);
+    unlink(path);
+    begin_write(vol, 1); // waits for the commands that are running, holds off the rest
+    return 0;
+}
 
-            if (strcmp(folder_name, "..") == 0)
-            {
+// ---- trace replay (--replay) ----
 
-                uint8_t *cluster = calloc(1, cluster_size);
-                uint32_t first_data_sector = bpb.reserved_sectors + (bpb.fat_amount * bpb.fat32_size);
-                uint32_t sector = first_data_sector + (current_cluster - 2) * bpb.sectors_per_cluster;
-                uint32_t current_sector = first_data_sector;
-                unsigned int offset_current_cluster = (current_sector * bpb.bytes_per_sector) + (current_cluster - 2) * cluster_size;
+#define REPLAY_MAX_SESSIONS 4096
 
-                fseek(file, offset_current_cluster, SEEK_SET);
-                fread(cluster, 1, cluster_size, file);
+// Runs the commands of a trace (--record, fatik_workload) on the volume, each session in
+// a shell of its own, and reports throughput, latencies and the fragmentation of the image
+// afterwards. 'speed' 0 runs them back to back, otherwise at the recorded pace, 'speed'
+// times faster. Lines without a timestamp (a plain script) are commands of session 0.
+static int replay(struct Shell *sh, const char *path, double speed)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    FILE *out = fopen("/dev/null", "w"); // what the commands print is not wanted
+    struct Shell **sessions = calloc(REPLAY_MAX_SESSIONS, sizeof(struct Shell *));
+    struct CommandStats *replayed = calloc(MAX_COMMANDS, sizeof(struct CommandStats));
+    if (out == NULL || sessions == NULL || replayed == NULL)
+    {
+        printf("Can not replay %s\n", path);
+        if (out) fclose(out);
+        free(sessions);
+        free(replayed);
+        fclose(in);
+        return -1;
+    }
 
-                struct SFNentry *dotdot = (struct SFNentry *)&cluster[32]; // ".." — другий запис
-                uint32_t parent_cluster = ((uint32_t)dotdot->cluster_high << 16) | dotdot->cluster_low;
+    char line[4200];
+    unsigned int session_count = 0;
+    unsigned long line_number = 0;
+    unsigned long long start = clock_ns();
+    while (fgets(line, sizeof(line), in) != NULL)
+    {
+        line_number++;
+        unsigned long long at = 0;
+        unsigned int id = 0;
+        int skip = 0;
+        char *command = line;
+        if (sscanf(line, "%llu %u %n", &at, &id, &skip) == 2) command = line + skip;
+
+        command += strspn(command, " \t");
+        if (command[0] == '\0' || command[0] == '\n' || command[0] == '#') continue;
+        if (id >= REPLAY_MAX_SESSIONS)
+        {
+            printf("Line %lu: session %u is out of range\n", line_number, id);
+            continue;
+        }
 
-                if (current_cluster > 2)
-                    current_cluster -= 1;
+        if (sessions[id] == NULL)
+        {
+            sessions[id] = calloc(1, sizeof(struct Shell));
+            if (sessions[id] == NULL) break;
+            sessions[id]->vol = sh->vol;
+            sessions[id]->out = out;
+            sessions[id]->current_cluster = 2; // '/' root
+            strcpy(sessions[id]->path, "/");
+            sessions[id]->session = id;
+            session_count++;
+        }
+        if (sessions[id]->done) continue;
 
-                trim_to_parent(path);
-                free(cluster);
-                continue;
+        if (speed > 0)
+        {
+            unsigned long long due = start + (unsigned long long)(at * 1000 / speed), now = clock_ns();
+            if (due > now)
+            {
+                struct timespec ts = { (due - now) / 1000000000ULL, (due - now) % 1000000000ULL };
+                while (nanosleep(&ts, &ts) < 0 && errno == EINTR) { }
             }
+        }
+        run_line(sessions[id], command, 0);
+    }
+    unsigned long long elapsed = clock_ns() - start;
+    fclose(in);
 
-            // cd <name>
-            uint8_t *cluster = calloc(1, cluster_size);
-            uint32_t first_data_sector = bpb.reserved_sectors + (bpb.fat_amount * bpb.fat32_size);
-            uint32_t sector = first_data_sector + (current_cluster - 2) * bpb.sectors_per_cluster;
-
-            fseek(file, sector * bpb.bytes_per_sector, SEEK_SET);
-            fread(cluster, 1, cluster_size, file);
+    // the sessions' latencies together; --stats-json gets them too
+    struct CommandStats total = { .name = "all" };
+    for (unsigned int id = 0; id < REPLAY_MAX_SESSIONS; id++)
+    {
+        if (sessions[id] == NULL) continue;
+        for (int i = 0; i < MAX_COMMANDS; i++)
+        {
+            const struct CommandStats *cs = &sessions[id]->stats[i];
+            if (cs->name == NULL) continue;
+            replayed[i].name = sh->stats[i].name = cs->name;
+            merge_stats(&replayed[i], cs);
+            merge_stats(&sh->stats[i], cs);
+            merge_stats(&total, cs);
+        }
+        free(sessions[id]);
+    }
+    free(sessions);
+    fclose(out);
 
-            struct ParsedEntry entries[128];
-            int count = parse_directory(cluster, entries, cluster_size, 128);
+    printf("Replayed %lu commands of %u sessions in %.3f s: %.0f commands/s, %lu failed\n", total.count,
+           session_count, elapsed / 1e9, elapsed ? total.count * 1e9 / elapsed : 0.0, total.errors);
+    print_command_stats(stdout, replayed, &total);
+    free(replayed);
 
-            int found = 0;
-            for (int i = 0; i < count; i++)
-            {
-                if (strcmp(entries[i].name, folder_name) == 0 && entries[i].is_directory)
-                {
-                    current_cluster = entries[i].first_cluster;
-                    entries[i].name[strlen(entries[i].name)] = '/';
-                    strcat(path, entries[i].name);
-                    strcpy(current_folder_name, entries[i].name);
-                    found = 1;
-                    break;
-                }
-            }
+    if (sh->vol->is_fat32)
+    {
+        struct FragScan scan = {0};
+        frag_walk(sh->vol, &scan);
+        print_frag_summary(stdout, &scan);
+        frag_free(&scan);
+
+        unsigned long runs[FREE_RUN_BUCKETS] = {0};
+        unsigned long long run_clusters[FREE_RUN_BUCKETS] = {0};
+        unsigned long largest;
+        unsigned long total_runs = count_free_runs(sh->vol, runs, run_clusters, &largest);
+        printf("free: %u clusters in %lu runs, largest %lu\n", sh->vol->fsinfo.free_count, total_runs, largest);
+    }
+    return 0;
+}
 
-            if (!found)
+int main(int argc, char *argv[])
+{
+    int use_mmap = 0;
+    unsigned int cache_clusters = DEFAULT_CACHE_CLUSTERS;
+    unsigned int fat_cache_kb = DEFAULT_FAT_CACHE_KB;
+    char *image = NULL;
+    char *commands_arg = NULL;     // -c "cmd; cmd"
+    char *script = NULL;           // -f <file>, "-" is stdin
+    char *stats_json = NULL;       // --stats-json <file>, "-" is stdout
+    char *populate_dir = NULL;     // --populate <host dir>
+    char *serve_path = NULL;       // --serve <socket>
+    char *record_path = NULL;      // --record <trace>
+    char *replay_path = NULL;      // --replay <trace>
+    double replay_speed = 0;       // --replay-speed, 0: as fast as possible
+    long long image_size = DEFAULT_IMAGE_SIZE; // --size, for a new image
+    int use_journal = 0;
+    int use_discard = 0;
+    unsigned int journal_batch = DEFAULT_JOURNAL_BATCH;
+    int stop_on_error = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--mmap") == 0)
+            use_mmap = 1;
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            cache_clusters = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--fat-cache") == 0 && i + 1 < argc)
+            fat_cache_kb = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+            commands_arg = argv[++i];
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            script = argv[++i];
+        else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc)
+            stats_json = argv[++i];
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            image_size = parse_size(argv[++i]);
+            if (image_size <= 0)
             {
-                printf("Directory not found: %s\n", folder_name);
+                printf("Invalid size: %s\n", argv[i]);
+                return 1;
             }
-
-            free(cluster);
-
         }
-        else if(strncmp(user_input, "touch ", 6) == 0)
+        else if (strcmp(argv[i], "--aio") == 0 && i + 1 < argc)
         {
-            if(is_not_fat32)
+            i++;
+            if (strcmp(argv[i], "uring") == 0 || strcmp(argv[i], "io_uring") == 0) aio_backend = AIO_URING;
+            else if (strcmp(argv[i], "threads") == 0) aio_backend = AIO_THREADS;
+            else if (strcmp(argv[i], "sync") == 0) aio_backend = AIO_SYNC;
+            else
             {
-                printf("Unknown disk format\n");
-                continue;
+                printf("Unknown --aio engine: %s (uring, threads, sync)\n", argv[i]);
+                return 1;
             }
+        }
+        else if (strcmp(argv[i], "--queue-depth") == 0 && i + 1 < argc)
+            aio_queue_depth = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--journal") == 0)
+            use_journal = 1;
+        else if (strcmp(argv[i], "--discard") == 0)
+            use_discard = 1;
+        else if (strcmp(argv[i], "--journal-batch") == 0 && i + 1 < argc)
+        {
+            use_journal = 1;
+            journal_batch = strtoul(argv[++i], NULL, 10);
+            if (journal_batch == 0) journal_batch = 1;
+        }
+        else if (strcmp(argv[i], "--populate") == 0 && i + 1 < argc)
+            populate_dir = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            serve_path = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replay_path = argv[++i];
+        else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc)
+            replay_speed = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "-e") == 0)
+            stop_on_error = 1;
+        else if (image == NULL)
+            image = argv[i];
+        else
+            image = "";
+    }
 
-                char *file_name = user_input + 6;
-                file_name[strcspn(file_name, "\n")] = '\0';
+    if(image == NULL || image[0] == '\0')
+    {
+        printf("Usage: %s [--mmap] [--cache <clusters>] [--fat-cache <KiB>] [--journal] [--journal-batch <commands>] [--discard] [--aio uring|threads|sync] [--queue-depth <n>] [--stats-json <file>] [--populate <host dir>] [--serve <socket>] [--record <trace>] [--replay <trace>] [--replay-speed <x>] [--size <bytes>[K|M|G|T]] [-e] [-c <commands> | -f <script>] <filedisk_FAT32>\n", argv[0]);
+        return 1;
+    }
 
-                if (strlen(file_name) == 0)
-                {
-                    printf("Use: touch <filename>\n");
-                    continue;
-                }
+    FILE *input = stdin;
+    if (script != NULL && strcmp(script, "-") != 0)
+    {
+        input = fopen(script, "r");
+        if (input == NULL)
+        {
+            perror(script);
+            return 1;
+        }
+    }
 
+    if (use_journal && use_mmap)
+    {
+        printf("--journal can not be used with --mmap: the mapping reaches the image before it is logged\n");
+        return 1;
+    }
 
-                unsigned int data_sectors = bpb.total_sectors - (bpb.reserved_sectors + bpb.fat_amount * bpb.fat32_size);
-                uint32_t first_data_sector = bpb.reserved_sectors + (bpb.fat_amount * bpb.fat32_size);
-                uint32_t sector = first_data_sector + (current_cluster - 2) * bpb.sectors_per_cluster;
-                unsigned int total_clusters = data_sectors / bpb.sectors_per_cluster;
+    if (record_path != NULL)
+    {
+        trace = fopen(record_path, "w");
+        if (trace == NULL)
+        {
+            perror(record_path);
+            return 1;
+        }
+        fprintf(trace, "# FATik trace: <us> <session> <command>\n");
+        trace_start = clock_ns();
+    }
 
-                // 1.Search for free clusters
-                unsigned int free1 = find_free_cluster(FAT, total_clusters);
-                if (free1 == -1) { printf("No free cluster\n"); continue; }
+    FILE *file = fopen(image, "rb+");
 
-                unsigned int free2 = find_free_cluster(FAT, free1);
-                if (free2 == -1) { printf("No second free cluster\n"); continue; }
+    if(file == NULL)
+    {
+        // new image is sparse: it takes no space until something is written
+        printf("Okay, creating file (%lld bytes). \n", image_size);
+        file = fopen(image, "wb+");
+        if (file == NULL || ftruncate(fileno(file), image_size) != 0)
+        {
+            perror(image);
+            return 1;
+        }
+    }
 
-                FAT[free1] = free2;
-                FAT[free2] = 0x0FFFFFFF;
+    long size_file = get_file_size(file);
 
-                uint8_t *dir_cluster = calloc(1, cluster_size);
+    char journal_path[4200];
+    snprintf(journal_path, sizeof(journal_path), "%s.wal", image);
 
-                uint32_t current_sector = first_data_sector;
-                unsigned int offset_current_cluster = (current_sector * bpb.bytes_per_sector) + (current_cluster - 2) * cluster_size;
+    // with --serve only the wait for a client takes SIGINT/SIGTERM, no other thread
+    if (serve_path != NULL)
+    {
+        sigset_t stop_signals;
+        sigemptyset(&stop_signals);
+        sigaddset(&stop_signals, SIGINT);
+        sigaddset(&stop_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    }
 
-                fseek(file, offset_current_cluster, SEEK_SET);
-                fread(dir_cluster, 1, cluster_size, file);
+    static struct Volume vol;
+    static struct Shell sh;
+    sh.vol = &vol;
+    sh.out = stdout;
+    if (!open_volume(sh.vol, file, size_file, use_mmap, cache_clusters, fat_cache_kb, use_journal ? journal_path : NULL) &&
+        ((use_mmap && sh.vol->map == NULL) || (use_journal && sh.vol->journal_fd < 0)))
+    {
+        fclose(file);
+        return 1;
+    }
 
-                //  SFN in current directory
-                unsigned int file_entry_size = cluster_size * 2;
-                create_file_entry(file_name, dir_cluster, free1, file_entry_size, cluster_size); // 2 кластери * 4КБ
+    sh.vol->journal_batch = journal_batch;
+    sh.vol->discard = use_discard;
+    sh.current_cluster = 2; // '/' root
+    strcpy(sh.path, "/");
 
-                // 4. Записати директорію назад
-                fseek(file, offset_current_cluster, SEEK_SET);
-                fwrite(dir_cluster, cluster_size, 1, file);
-                fflush(file);
+    // prompt only for a person at the terminal; scripts get plain, fully buffered output
+    int interactive = commands_arg == NULL && script == NULL && serve_path == NULL && replay_path == NULL &&
+                      isatty(fileno(stdin));
+    if (!interactive) setvbuf(stdout, NULL, _IOFBF, 1 << 16);
 
-                // 5. 2 clustres for file data
-                uint8_t *file_data = calloc(1, cluster_size);
-                uint32_t data_start = first_data_sector * bpb.bytes_per_sector;
+    int status = 0;
+    if (populate_dir != NULL)
+    {
+        // builds the image from a host tree: formats it first if it is not FAT32 yet,
+        // then runs like "populate <dir>" in the root; without commands (or --serve, --replay) it just exits
+        if (!sh.vol->is_fat32) format_volume(sh.vol, NULL);
+
+        char line[4200];
+        snprintf(line, sizeof(line), "populate %s", populate_dir);
+        status = run_command(&sh, line);
+        if ((commands_arg == NULL && script == NULL && serve_path == NULL && replay_path == NULL) ||
+            (status < 0 && stop_on_error)) sh.done = 1;
+    }
 
-                fseek(file, data_start + (free1 - 2) * cluster_size, SEEK_SET);
-                fwrite(file_data, cluster_size, 1, file);
+    if (commands_arg != NULL)
+    {
+        char *line = strdup(commands_arg);
+        if (run_line(&sh, line, stop_on_error) < 0) status = -1;
+        free(line);
+    }
+    else if ((serve_path == NULL && replay_path == NULL) || script != NULL)
+    {
+        char user_input[1024];
+        unsigned long line_number = 0;
 
-                fseek(file, data_start + (free2 - 2) * cluster_size, SEEK_SET);
-                fwrite(file_data, cluster_size, 1, file);
-                fflush(file);
+        // running the emulator
+        while (!sh.done)
+        {
+            if (interactive)
+            {
+                printf("%s> ", sh.path);
+                fflush(stdout);
+            }
+            if (fgets(user_input, sizeof(user_input), input) == NULL) break; // EOF
 
-                // new info in FAT
-                fseek(file, bpb.reserved_sectors * bpb.bytes_per_sector, SEEK_SET);
-                fwrite(FAT, bpb.fat32_size * bpb.bytes_per_sector, 1, file);
-                fflush(file);
+            line_number++;
+            if (run_line(&sh, user_input, stop_on_error) < 0)
+            {
+                status = -1;
+                if (stop_on_error && !interactive)
+                {
+                    fflush(stdout);
+                    fprintf(stderr, "Stopped at line %lu\n", line_number);
+                    break;
+                }
+            }
+        }
+        if (interactive && !sh.done) printf("\n");
+    }
 
-                printf("Created file \"%s\" using clusters %d and %d\n", file_name, free1, free2);
-                free(file_data);
-                free(dir_cluster);
+    // the commands of -c/-f run first, then a trace is replayed
+    if (replay_path != NULL && !sh.done && replay(&sh, replay_path, replay_speed) < 0)
+    {
+        status = -1;
+        stop_on_error = 1;
+    }
 
-        }
+    // and the volume is served until a signal
+    if (serve_path != NULL && !sh.done && serve(sh.vol, serve_path) < 0)
+    {
+        status = -1;
+        stop_on_error = 1; // exit code 1: the server did not start
     }
 
-    fclose(file);
+    if (input != stdin) fclose(input);
+    close_volume(sh.vol);
+    if (trace) fclose(trace);
 
-    return 0;
+    // after close_volume(), so the final write-back is counted too
+    if (stats_json != NULL)
+    {
+        FILE *out = strcmp(stats_json, "-") == 0 ? stdout : fopen(stats_json, "w");
+        if (out == NULL)
+            perror(stats_json);
+        else
+        {
+            dump_stats(&sh, out);
+            if (out != stdout) fclose(out);
+        }
+    }
 
+    return (status < 0 && stop_on_error) ? 1 : 0;
 }
@@ -0,0 +1,5069 @@
+#define _GNU_SOURCE // copy_file_range()
+
+#include "fatvol.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+const char *fs_error(int err)
+{
+    switch (err)
+    {
+        case FS_NOT_FOUND: return "No such file or directory";
+        case FS_NOT_DIR:   return "Not a directory";
+        case FS_EXISTS:    return "Already exists";
+        case FS_NO_SPACE:  return "No free clusters";
+        case FS_DIR_FULL:  return "No free directory entries!";
+        case FS_INVALID:   return "Invalid name";
+        case FS_IS_DIR:    return "Is a directory";
+        case FS_TOO_BIG:   return "File is too big for FAT32";
+        case FS_IO:        return "I/O error";
+        case FS_NOT_EMPTY: return "Directory not empty";
+        default:           return "OK";
+    }
+}
+
+// The structs in fatvol.h are not packed, so they are never copied to/from the disk as is.
+// These accessors read and write the fields at their real on-disk offsets (little-endian).
+
+void decode_bpb(const uint8_t *sector, struct FAT32_BPB *bpb)
+{
+    memcpy(bpb->jmp, &sector[0], 3);
+    memcpy(bpb->oem, &sector[3], 8);
+    bpb->bytes_per_sector = get_le16(&sector[11]);
+    bpb->sectors_per_cluster = sector[13];
+    bpb->reserved_sectors = get_le16(&sector[14]);
+    bpb->fat_amount = sector[16];
+    bpb->root_dir_entries = get_le16(&sector[17]);
+    bpb->total_sectors_16 = get_le16(&sector[19]);
+    bpb->media_descriptor = sector[21];
+    bpb->fat16_size = get_le16(&sector[22]);
+    bpb->sectors_per_track = get_le16(&sector[24]);
+    bpb->heads = get_le16(&sector[26]);
+    bpb->hidden_sectors = get_le32(&sector[28]);
+    bpb->total_sectors = get_le32(&sector[32]);
+    bpb->fat32_size = get_le32(&sector[36]);
+    bpb->flags = get_le16(&sector[40]);
+    bpb->version = get_le16(&sector[42]);
+    bpb->root_cluster = get_le32(&sector[44]);
+    bpb->sector_FS_info = get_le16(&sector[48]);
+    bpb->sector_backup_boot = get_le16(&sector[50]);
+    memcpy(bpb->reserved, &sector[52], 12);
+    bpb->drive_number = sector[64];
+    bpb->reserved2 = sector[65];
+    bpb->boot_signature = sector[66];
+    bpb->volume_id = get_le32(&sector[67]);
+    memcpy(bpb->volume_label, &sector[71], 11);
+    memcpy(bpb->file_system, &sector[82], 8);
+    memcpy(bpb->unused, &sector[90], 420);
+    memcpy(bpb->signature, &sector[510], 2);
+}
+
+void encode_bpb(const struct FAT32_BPB *bpb, uint8_t *sector)
+{
+    memcpy(&sector[0], bpb->jmp, 3);
+    memcpy(&sector[3], bpb->oem, 8);
+    put_le16(&sector[11], bpb->bytes_per_sector);
+    sector[13] = bpb->sectors_per_cluster;
+    put_le16(&sector[14], bpb->reserved_sectors);
+    sector[16] = bpb->fat_amount;
+    put_le16(&sector[17], bpb->root_dir_entries);
+    put_le16(&sector[19], bpb->total_sectors_16);
+    sector[21] = bpb->media_descriptor;
+    put_le16(&sector[22], bpb->fat16_size);
+    put_le16(&sector[24], bpb->sectors_per_track);
+    put_le16(&sector[26], bpb->heads);
+    put_le32(&sector[28], bpb->hidden_sectors);
+    put_le32(&sector[32], bpb->total_sectors);
+    put_le32(&sector[36], bpb->fat32_size);
+    put_le16(&sector[40], bpb->flags);
+    put_le16(&sector[42], bpb->version);
+    put_le32(&sector[44], bpb->root_cluster);
+    put_le16(&sector[48], bpb->sector_FS_info);
+    put_le16(&sector[50], bpb->sector_backup_boot);
+    memcpy(&sector[52], bpb->reserved, 12);
+    sector[64] = bpb->drive_number;
+    sector[65] = bpb->reserved2;
+    sector[66] = bpb->boot_signature;
+    put_le32(&sector[67], bpb->volume_id);
+    memcpy(&sector[71], bpb->volume_label, 11);
+    memcpy(&sector[82], bpb->file_system, 8);
+    memcpy(&sector[90], bpb->unused, 420);
+    memcpy(&sector[510], bpb->signature, 2);
+}
+
+void read_sfn(const uint8_t *entry, struct SFNentry *sfn)
+{
+    memcpy(sfn->name, &entry[0], 8);
+    memcpy(sfn->ext, &entry[8], 3);
+    sfn->attributes = entry[11];
+    sfn->reserved = entry[12];
+    sfn->time_created = get_le16(&entry[14]);
+    sfn->date_created = get_le16(&entry[16]);
+    sfn->date_last_accessed = get_le16(&entry[18]);
+    sfn->cluster_high = get_le16(&entry[20]);
+    sfn->time_last_modified = get_le16(&entry[22]);
+    sfn->date_last_modified = get_le16(&entry[24]);
+    sfn->cluster_low = get_le16(&entry[26]);
+    sfn->size = get_le32(&entry[28]);
+}
+
+void write_sfn(uint8_t *entry, const struct SFNentry *sfn)
+{
+    memcpy(&entry[0], sfn->name, 8);
+    memcpy(&entry[8], sfn->ext, 3);
+    entry[11] = sfn->attributes;
+    entry[12] = sfn->reserved;
+    entry[13] = 0; // creation time, tenths of a second
+    put_le16(&entry[14], sfn->time_created);
+    put_le16(&entry[16], sfn->date_created);
+    put_le16(&entry[18], sfn->date_last_accessed);
+    put_le16(&entry[20], sfn->cluster_high);
+    put_le16(&entry[22], sfn->time_last_modified);
+    put_le16(&entry[24], sfn->date_last_modified);
+    put_le16(&entry[26], sfn->cluster_low);
+    put_le32(&entry[28], sfn->size);
+}
+
+uint32_t sfn_first_cluster(const uint8_t *entry)
+{
+    return ((uint32_t)get_le16(&entry[20]) << 16) | get_le16(&entry[26]);
+}
+
+void decode_fsinfo(const uint8_t *sector, struct FSInfo *fsinfo)
+{
+    memset(fsinfo, 0, sizeof(struct FSInfo));
+    fsinfo->lead_signature = get_le32(&sector[0]);
+    fsinfo->struct_signature = get_le32(&sector[484]);
+    fsinfo->free_count = get_le32(&sector[488]);
+    fsinfo->next_free = get_le32(&sector[492]);
+    fsinfo->trail_signature = get_le32(&sector[508]);
+}
+
+void encode_fsinfo(const struct FSInfo *fsinfo, uint8_t *sector)
+{
+    memset(sector, 0, 512);
+    put_le32(&sector[0], fsinfo->lead_signature);
+    put_le32(&sector[484], fsinfo->struct_signature);
+    put_le32(&sector[488], fsinfo->free_count);
+    put_le32(&sector[492], fsinfo->next_free);
+    put_le32(&sector[508], fsinfo->trail_signature);
+}
+
+// ---- long names ----
+
+// byte offsets of the 13 UTF-16 units of an LFN entry (5 + 6 + 2)
+static const uint8_t lfn_unit_offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+// bytes of a UTF-8 sequence by the top 5 bits of its first byte, 0 = can not start one
+static const uint8_t utf8_lengths[32] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    0, 0, 0, 0, 0, 0, 0, 0, 2, 2, 2, 2, 3, 3, 4, 0
+};
+
+// UTF-8 -> UTF-16, code points above U+FFFF as surrogate pairs; does not depend on the
+// locale. Returns the number of units in 'dst', -1 if 'src' is not valid UTF-8 (overlong
+// forms, surrogates, cut sequences) or takes more than 'max' units.
+int utf8_to_utf16(const char *src, uint16_t *dst, int max)
+{
+    static const uint32_t min_code[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    const unsigned char *s = (const unsigned char *)src;
+    int count = 0;
+
+    while (*s)
+    {
+        if (*s < 0x80)
+        {
+            if (count == max) return -1;
+            dst[count++] = *s++;
+            continue;
+        }
+
+        int length = utf8_lengths[*s >> 3];
+        if (length == 0) return -1;
+        uint32_t code = *s & (0x7F >> length);
+        for (int i = 1; i < length; i++)
+        {
+            if ((s[i] & 0xC0) != 0x80) return -1; // the terminating NUL stops here too
+            code = (code << 6) | (s[i] & 0x3F);
+        }
+        if (code < min_code[length] || code > 0x10FFFF || (code >= 0xD800 && code <= 0xDFFF)) return -1;
+        s += length;
+
+        if (code >= 0x10000)
+        {
+            if (count + 2 > max) return -1;
+            code -= 0x10000;
+            dst[count++] = 0xD800 | (code >> 10);
+            dst[count++] = 0xDC00 | (code & 0x3FF);
+        }
+        else
+        {
+            if (count == max) return -1;
+            dst[count++] = code;
+        }
+    }
+    return count;
+}
+
+// UTF-16 -> UTF-8 of 'count' units into 'dst' of 'size' bytes, NUL-terminated; an unpaired
+// surrogate becomes U+FFFD. Stops before a character that does not fit, returns the length.
+int utf16_to_utf8(const uint16_t *src, int count, char *dst, int size)
+{
+    static const uint8_t lead[5] = { 0, 0, 0xC0, 0xE0, 0xF0 };
+    unsigned char *d = (unsigned char *)dst;
+    int length = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t code = src[i];
+        if (code < 0x80)
+        {
+            if (length + 1 >= size) break;
+            d[length++] = code;
+            continue;
+        }
+        if (code >= 0xD800 && code <= 0xDFFF)
+        {
+            if (code < 0xDC00 && i + 1 < count && src[i + 1] >= 0xDC00 && src[i + 1] <= 0xDFFF)
+                code = 0x10000 + ((code - 0xD800) << 10) + (src[++i] - 0xDC00);
+            else
+                code = 0xFFFD;
+        }
+
+        int n = code < 0x800 ? 2 : code < 0x10000 ? 3 : 4;
+        if (length + n >= size) break;
+        for (int k = n - 1; k > 0; k--)
+        {
+            d[length + k] = 0x80 | (code & 0x3F);
+            code >>= 6;
+        }
+        d[length] = lead[n] | code;
+        length += n;
+    }
+    d[length] = '\0';
+    return length;
+}
+
+// FAT does not allow control characters and " * / : < > ? \ | in a long name, nor a name
+// that ends in a dot or a space (Windows drops those). All of them are ASCII, so the UTF-8
+// bytes can be looked at one by one.
+int name_is_legal(const char *name)
+{
+    size_t length = strlen(name);
+    if (length == 0 || name[length - 1] == '.' || name[length - 1] == ' ') return 0;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        if (*p < 0x20 || strchr("\"*/:<>?\\|", *p)) return 0;
+    }
+    return 1;
+}
+
+// Lower -> upper case of the letters that volumes written by Windows and Linux fold in
+// names (Latin-1, Latin Extended-A and Additional, Greek, Cyrillic, Armenian, full-width
+// Latin); 'step' 2: only every other code point of the range, the pairs of upper and lower.
+static const struct { uint16_t first, last; int16_t delta; uint8_t step; } upcase_ranges[] = {
+    { 0x0061, 0x007A, -32, 1 }, { 0x00E0, 0x00F6, -32, 1 }, { 0x00F8, 0x00FE, -32, 1 }, { 0x00FF, 0x00FF, 121, 1 },
+    { 0x0101, 0x012F, -1, 2 },  { 0x0133, 0x0137, -1, 2 },  { 0x013A, 0x0148, -1, 2 },  { 0x014B, 0x0177, -1, 2 },
+    { 0x017A, 0x017E, -1, 2 },  { 0x03AC, 0x03AC, -38, 1 }, { 0x03AD, 0x03AF, -37, 1 }, { 0x03B1, 0x03C1, -32, 1 },
+    { 0x03C2, 0x03C2, -31, 1 }, { 0x03C3, 0x03CB, -32, 1 }, { 0x03CC, 0x03CC, -64, 1 }, { 0x03CD, 0x03CE, -63, 1 },
+    { 0x0430, 0x044F, -32, 1 }, { 0x0450, 0x045F, -80, 1 }, { 0x0461, 0x0481, -1, 2 },  { 0x048B, 0x04BF, -1, 2 },
+    { 0x04C2, 0x04CE, -1, 2 },  { 0x04CF, 0x04CF, -15, 1 }, { 0x04D1, 0x052F, -1, 2 },  { 0x0561, 0x0586, -48, 1 },
+    { 0x1E01, 0x1E95, -1, 2 },  { 0x1EA1, 0x1EFF, -1, 2 },  { 0xFF41, 0xFF5A, -32, 1 },
+};
+
+// Upper case of a code point, for comparing names; the same whatever the C locale is.
+uint32_t upcase_code(uint32_t code)
+{
+    for (size_t i = 0; i < sizeof(upcase_ranges) / sizeof(upcase_ranges[0]) && code >= upcase_ranges[i].first; i++)
+    {
+        if (code <= upcase_ranges[i].last && (code - upcase_ranges[i].first) % upcase_ranges[i].step == 0)
+            return code + upcase_ranges[i].delta;
+    }
+    return code;
+}
+
+unsigned char sfn_checksum(const unsigned char *sfn)
+{
+    unsigned char sum = 0;
+    for (int i = 0; i < 11; i++)
+    {
+        sum = ((sum & 1) ? 0x80 : 0) + (sum >> 1) + sfn[i];
+    }
+    return sum;
+}
+
+// Short (8.3) basis name of 'name' as it is stored: upper case, space padded, the extension
+// after the last dot, spaces and other dots dropped, characters a short name can not hold
+// (and every non-ASCII one) as '_'. Returns 1 if the short name keeps the name as it is,
+// '*case_bits' then are the NT lower-case flags of entry byte 12 (0x08 base, 0x10 extension);
+// 0 if the name needs LFN entries and a "~N" tail.
+int sfn_basis(const char *name, unsigned char sfn[11], uint8_t *case_bits)
+{
+    const unsigned char *s = (const unsigned char *)name;
+    const unsigned char *ext = (const unsigned char *)strrchr(name, '.');
+    int exact = 1;
+    int lower[2] = { 0, 0 }, upper[2] = { 0, 0 };
+
+    memset(sfn, ' ', 11);
+    while (*s == '.') s++, exact = 0;
+    if (ext != NULL && (ext < s || ext[1] == '\0')) ext = NULL, exact = 0;
+
+    int part = 0, length = 0; // 0 = base (8 characters), 1 = extension (3)
+    for (; *s; s++)
+    {
+        if (s == ext)
+        {
+            part = 1;
+            length = 0;
+            continue;
+        }
+        unsigned char c = *s;
+        if (c >= 0x80)
+        {
+            if ((c & 0xC0) == 0x80) continue; // rest of a UTF-8 sequence
+            c = '_';
+            exact = 0;
+        }
+        else if (c >= 'a' && c <= 'z') c -= 'a' - 'A', lower[part] = 1;
+        else if (c >= 'A' && c <= 'Z') upper[part] = 1;
+        else if (c == ' ' || c == '.')
+        {
+            exact = 0;
+            continue;
+        }
+        else if (!(c >= '0' && c <= '9') && strchr("!#$%&'()-@^_`{}~", c) == NULL)
+        {
+            c = '_';
+            exact = 0;
+        }
+
+        if (length == (part ? 3 : 8))
+        {
+            exact = 0;
+            continue;
+        }
+        sfn[part * 8 + length++] = c;
+    }
+
+    if (sfn[0] == ' ')
+    {
+        sfn[0] = '_';
+        exact = 0;
+    }
+    if ((lower[0] && upper[0]) || (lower[1] && upper[1])) exact = 0;
+    *case_bits = (lower[0] ? 0x08 : 0) | (lower[1] ? 0x10 : 0);
+    return exact;
+}
+
+static uint32_t sfn_hash(const unsigned char *sfn)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 11; i++) hash = (hash ^ sfn[i]) * 16777619u;
+    return hash ? hash : 1;
+}
+
+int sfn_set_has(const struct SfnSet *set, const unsigned char *sfn)
+{
+    if (set == NULL || set->slots == NULL) return 0;
+    uint32_t hash = sfn_hash(sfn);
+    for (unsigned int i = hash & set->mask; set->slots[i] != 0; i = (i + 1) & set->mask)
+    {
+        if (set->slots[i] == hash) return 1;
+    }
+    return 0;
+}
+
+// returns 0 if there is no memory for it
+int sfn_set_add(struct SfnSet *set, const unsigned char *sfn)
+{
+    if (set->slots == NULL || (set->count + 1) * 2 > set->mask + 1)
+    {
+        unsigned int capacity = set->slots ? (set->mask + 1) * 2 : 64;
+        uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+        if (slots == NULL) return 0;
+        for (unsigned int i = 0; set->slots && i <= set->mask; i++)
+        {
+            if (set->slots[i] == 0) continue;
+            unsigned int j = set->slots[i] & (capacity - 1);
+            while (slots[j] != 0) j = (j + 1) & (capacity - 1);
+            slots[j] = set->slots[i];
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->mask = capacity - 1;
+    }
+
+    uint32_t hash = sfn_hash(sfn);
+    unsigned int i = hash & set->mask;
+    while (set->slots[i] != 0 && set->slots[i] != hash) i = (i + 1) & set->mask;
+    if (set->slots[i] == 0) set->count++;
+    set->slots[i] = hash;
+    return 1;
+}
+
+void sfn_set_free(struct SfnSet *set)
+{
+    free(set->slots);
+    memset(set, 0, sizeof(*set));
+}
+
+// 'basis' with the tail "~n", its base cut to leave room for it
+static void sfn_tail(unsigned char sfn[11], const unsigned char basis[11], unsigned int n)
+{
+    char tail[12];
+    int tail_length = snprintf(tail, sizeof(tail), "~%u", n);
+    int base_length = 8;
+    while (base_length > 1 && basis[base_length - 1] == ' ') base_length--;
+    if (base_length > 8 - tail_length) base_length = 8 - tail_length;
+
+    memcpy(sfn, basis, 11);
+    memset(sfn + base_length, ' ', 8 - base_length);
+    memcpy(sfn + base_length, tail, tail_length);
+}
+
+// Fills 'entries' with the directory entries of 'name': the SFN entry alone if it is a
+// short name, otherwise its LFN run (highest part first) followed by the SFN entry with a
+// "~N" tail that is not in 'taken' ("NAME~1".."NAME~4", then 2 characters and a hash of
+// the long name, as Windows does). Returns the number of slots, FS_INVALID if the name is
+// not UTF-8, longer than 255 UTF-16 units or not legal (name_is_legal()).
+int build_name_entries(const char *name, const struct SfnSet *taken, uint8_t attributes,
+                       uint32_t first_cluster, uint32_t size, uint8_t *entries)
+{
+    uint16_t units[MAX_LFN_UNITS];
+    int count = utf8_to_utf16(name, units, MAX_LFN_UNITS);
+    if (count <= 0 || !name_is_legal(name)) return FS_INVALID;
+
+    unsigned char basis[11], short_name[11];
+    uint8_t case_bits;
+    int parts = 0;
+
+    if (sfn_basis(name, basis, &case_bits) && !sfn_set_has(taken, basis))
+    {
+        memcpy(short_name, basis, 11);
+    }
+    else
+    {
+        parts = (count + 12) / 13;
+        case_bits = 0;
+        for (unsigned int n = 1; ; n++)
+        {
+            if (n == 5)
+            {
+                uint32_t hash = 2166136261u;
+                for (int i = 0; i < count; i++) hash = (hash ^ units[i]) * 16777619u;
+                int keep = basis[1] == ' ' ? 1 : 2;
+                char hex[5];
+                snprintf(hex, sizeof(hex), "%04X", (unsigned int)(hash & 0xFFFF));
+                memset(basis + keep, ' ', 8 - keep);
+                memcpy(basis + keep, hex, 4);
+            }
+            sfn_tail(short_name, basis, n < 5 ? n : n - 4);
+            if (!sfn_set_has(taken, short_name)) break;
+        }
+    }
+
+    unsigned char checksum = sfn_checksum(short_name);
+    for (int i = 0; i < parts; i++)
+    {
+        uint8_t *entry = &entries[i * DIR_ENTRY_SIZE];
+        int sequence = parts - i;
+        int first_unit = (sequence - 1) * 13;
+
+        memset(entry, 0, DIR_ENTRY_SIZE);
+        entry[0] = sequence | (i == 0 ? 0x40 : 0); // the last part goes first
+        entry[11] = 0x0F;
+        entry[13] = checksum;
+        // the name ends with 0x0000 (unless it fills the part), the rest is 0xFFFF
+        for (int k = 0; k < 13; k++)
+        {
+            int unit = first_unit + k;
+            put_le16(&entry[lfn_unit_offsets[k]], unit < count ? units[unit] : unit == count ? 0x0000 : 0xFFFF);
+        }
+    }
+
+    struct SFNentry sfn = {0};
+    memcpy(sfn.name, short_name, 8);
+    memcpy(sfn.ext, short_name + 8, 3);
+    sfn.attributes = attributes;
+    sfn.reserved = case_bits;
+    sfn.cluster_high = (first_cluster >> 16) & 0xFFFF;
+    sfn.cluster_low = first_cluster & 0xFFFF;
+    sfn.size = size;
+    write_sfn(&entries[parts * DIR_ENTRY_SIZE], &sfn);
+    return parts + 1;
+}
+
+// Fills 'entries' with the directory entries (LFN run + SFN) for a new folder
+// and returns how many 32-byte slots they take (or an error).
+int create_folder(const char *name, const struct SfnSet *taken, uint8_t *entries, uint32_t id_cluster)
+{
+    return build_name_entries(name, taken, 0x10, id_cluster, 0, entries);
+}
+
+// The same for a new file.
+int create_file_entry(const char *name, const struct SfnSet *taken, uint8_t *entries,
+                      uint32_t start_cluster, uint32_t size_bytes)
+{
+    return build_name_entries(name, taken, 0x20, start_cluster, size_bytes, entries); // archive (файл)
+}
+// Cluster size for a volume of 'size' bytes: 4 KB up to 8 GB, then 8, 16 and 32 KB, so the
+// FAT stays small. If the files are known to be about 'file_size' bytes, a cluster is 1/16 of
+// that (512 B to 64 KB): little slack for small files, a small FAT and long runs for big ones.
+// Never so small that the volume has more clusters than FAT32 can number.
+static unsigned int pick_cluster_size(long size, uint64_t file_size)
+{
+    unsigned int cluster = 4096;
+    if (file_size > 0)
+    {
+        cluster = 512;
+        while (cluster < 65536 && (uint64_t)cluster * 2 * 16 <= file_size) cluster *= 2;
+    }
+    else if (size > 32LL << 30) cluster = 32768;
+    else if (size > 16LL << 30) cluster = 16384;
+    else if (size > 8LL << 30) cluster = 8192;
+
+    while (cluster < 65536 && (uint64_t)size / cluster > FAT32_MAX_CLUSTERS) cluster *= 2;
+    return cluster;
+}
+
+// Fills the BPB for a volume of 'size_file' bytes; 'opt' may be NULL (all defaults). Returns 0
+// if the volume is too small for the geometry (or too big for the cluster size).
+int to_format(struct FAT32_BPB* bpb, long size_file, const struct FormatOptions *opt)
+{
+    static const struct FormatOptions defaults = {0};
+    if (opt == NULL) opt = &defaults;
+    unsigned int cluster_size = opt->cluster_size ? opt->cluster_size : pick_cluster_size(size_file, opt->file_size);
+    unsigned int align = opt->align ? opt->align : cluster_size;
+
+    memset(bpb, 0, sizeof(struct FAT32_BPB));
+    bpb->jmp[0] = 0xEB;
+    bpb->jmp[1] = 0x3C;
+    bpb->jmp[2] = 0x90;
+
+    bpb->oem[0] = 'F';
+    bpb->oem[1] = 'A';
+
+    bpb->bytes_per_sector = 512;
+    bpb->sectors_per_cluster = cluster_size / 512;
+    bpb->reserved_sectors = opt->reserved_sectors ? opt->reserved_sectors : 32;
+    bpb->fat_amount = opt->fat_count ? opt->fat_count : 2;
+    bpb->root_dir_entries = 0;
+    bpb->total_sectors_16 = 0;
+    bpb->media_descriptor = 0xF8;
+    bpb->fat16_size = 0;
+    bpb->sectors_per_track = 63;
+    bpb->heads = 255;
+    bpb->hidden_sectors = 0;
+    bpb->total_sectors = (size_file / 512 > 0xFFFFFFFFL) ? 0xFFFFFFFF : size_file / 512;
+
+    // size of FAT32 table, closed form: FAT must hold an entry for every data cluster plus
+    // the 2 reserved ones, and every FAT sector taken away from the data region takes
+    // 1/sectors_per_cluster of a cluster with it:
+    //   fat32_size * entries_per_sector >= (data sectors - fat_amount * fat32_size) / spc + 2
+    uint64_t entries_per_sector = bpb->bytes_per_sector / 4;
+    uint64_t meta = (uint64_t)bpb->total_sectors - bpb->reserved_sectors + 2 * bpb->sectors_per_cluster;
+    uint64_t per_fat_sector = entries_per_sector * bpb->sectors_per_cluster + bpb->fat_amount;
+    bpb->fat32_size = (bpb->total_sectors > bpb->reserved_sectors) ? (meta + per_fat_sector - 1) / per_fat_sector : 1;
+
+    // the reserved region is padded so that the data region starts on an 'align' boundary
+    // (the FAT computed above stays big enough: the padding only takes data sectors away)
+    uint64_t align_sectors = align / bpb->bytes_per_sector;
+    uint64_t data_start = bpb->reserved_sectors + (uint64_t)bpb->fat_amount * bpb->fat32_size;
+    uint64_t reserved = bpb->reserved_sectors + (align_sectors - data_start % align_sectors) % align_sectors;
+    if (reserved > 0xFFFF) return 0;
+    bpb->reserved_sectors = reserved;
+
+    bpb->flags =  0x0000;
+    bpb->version =  0x0000;
+    bpb->root_cluster = 2;
+    bpb->sector_FS_info = 1;
+    bpb->sector_backup_boot = 6;
+    bpb->drive_number = 0x80;
+    bpb->boot_signature = 0x29;
+    bpb->volume_id = opt->volume_id ? opt->volume_id : 0x12345678;
+
+    if (opt->label[0] != '\0')
+    {
+        // space padded, as FAT keeps it
+        size_t length = strlen(opt->label);
+        memset(bpb->volume_label, ' ', sizeof(bpb->volume_label));
+        memcpy(bpb->volume_label, opt->label, length < sizeof(bpb->volume_label) ? length : sizeof(bpb->volume_label));
+    }
+    else
+    {
+        memcpy(bpb->volume_label, "FAT32IMG", 8);
+    }
+    bpb->file_system[0] = 'F';
+    bpb->file_system[1] = 'A';
+    bpb->file_system[2] = 'T';
+    bpb->file_system[3] = '3';
+    bpb->file_system[4] = '2';
+
+    bpb->signature[0] = 0x55;
+    bpb->signature[1] = 0xAA;
+
+    uint64_t meta_sectors = bpb->reserved_sectors + (uint64_t)bpb->fat_amount * bpb->fat32_size;
+    if (meta_sectors + bpb->sectors_per_cluster > bpb->total_sectors) return 0; // not even the root fits
+    return count_clusters(bpb) <= FAT32_MAX_CLUSTERS;
+}
+
+// '..' gets 'parent_cluster' as it is: see dotdot_cluster() for a directory in the root.
+void init_root_directory(uint8_t *cluster_data, uint32_t self_cluster, uint32_t parent_cluster)
+{
+    struct SFNentry dot = {0};
+    struct SFNentry dotdot = {0};
+
+    // "."
+    memset(dot.name, ' ', 8);
+    dot.name[0] = '.';
+    memset(dot.ext, ' ', 3);
+    dot.attributes = 0x10; // directory
+    dot.cluster_low = self_cluster & 0xFFFF;
+    dot.cluster_high = (self_cluster >> 16) & 0xFFFF;
+
+    //  ".."
+    memset(dotdot.name, ' ', 8);
+    dotdot.name[0] = '.';
+    dotdot.name[1] = '.';
+    memset(dotdot.ext, ' ', 3);
+    dotdot.attributes = 0x10;
+    dotdot.cluster_low = parent_cluster & 0xFFFF;
+    dotdot.cluster_high = (parent_cluster >> 16) & 0xFFFF;
+    write_sfn(&cluster_data[0], &dot);
+    write_sfn(&cluster_data[32], &dotdot);
+}
+
+// FAT32 stores 0 in '..' when the parent is the root, whatever cluster the root is in.
+uint32_t dotdot_cluster(const struct Volume *vol, uint32_t parent_cluster)
+{
+    return parent_cluster == vol->bpb.root_cluster ? 0 : parent_cluster;
+}
+
+// data clusters are numbered 2 .. total_clusters + 1
+unsigned int count_clusters(const struct FAT32_BPB *bpb)
+{
+    unsigned int data_sectors = bpb->total_sectors - (bpb->reserved_sectors + bpb->fat_amount * bpb->fat32_size);
+    return data_sectors / bpb->sectors_per_cluster;
+}
+
+const char *region_names[REGION_COUNT] = { "bpb", "fat", "data" };
+
+const char *aio_backend_names[] = { "auto", "io_uring", "threads", "sync" };
+
+// requested with --aio / --queue-depth, used by open_volume()
+enum AioBackend aio_backend = AIO_AUTO;
+unsigned int aio_queue_depth = DEFAULT_QUEUE_DEPTH;
+
+static size_t aio_length(const struct AioRequest *req)
+{
+    size_t length = 0;
+    for (int i = 0; i < req->iovcnt; i++) length += req->iov[i].iov_len;
+    return length;
+}
+
+// Runs a request (or what is left of it after a short transfer) in the calling thread.
+// Reading past the end of the image gives zeros, like read_bytes().
+static void aio_complete_sync(struct AioRequest *req, size_t done)
+{
+    size_t length = aio_length(req);
+    for (int i = 0; i < req->iovcnt && done < length; i++)
+    {
+        size_t skip = 0;
+        for (int j = 0; j < i; j++) skip += req->iov[j].iov_len;
+        if (done >= skip + req->iov[i].iov_len) continue;
+
+        uint8_t *p = (uint8_t *)req->iov[i].iov_base + (done - skip);
+        size_t left = skip + req->iov[i].iov_len - done;
+        while (left > 0)
+        {
+            ssize_t n = req->write ? pwrite(req->fd, p, left, req->offset + done) : pread(req->fd, p, left, req->offset + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0)
+            {
+                req->result = -errno;
+                return;
+            }
+            if (n == 0)
+            {
+                if (req->write)
+                {
+                    req->result = -EIO;
+                    return;
+                }
+                memset(p, 0, left);
+                n = left;
+            }
+            p += n;
+            left -= n;
+            done += n;
+        }
+    }
+    req->result = done;
+}
+
+static void *aio_worker(void *arg)
+{
+    struct AioEngine *aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    for (;;)
+    {
+        while (!aio->stop && aio->next >= aio->count) pthread_cond_wait(&aio->work, &aio->lock);
+        if (aio->stop) break;
+        struct AioRequest *req = &aio->batch[aio->next++];
+        pthread_mutex_unlock(&aio->lock);
+
+        aio_complete_sync(req, 0);
+
+        pthread_mutex_lock(&aio->lock);
+        if (++aio->done == aio->count) pthread_cond_signal(&aio->finished);
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+static int uring_init(struct AioEngine *aio)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, aio->depth, &params);
+    if (fd < 0) return 0;
+
+    aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (aio->cq_ring_size > aio->sq_ring_size) aio->sq_ring_size = aio->cq_ring_size;
+        aio->cq_ring_size = aio->sq_ring_size;
+    }
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    aio->sq_ring = mmap(NULL, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    aio->cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? aio->sq_ring :
+        mmap(NULL, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (aio->sq_ring == MAP_FAILED || aio->cq_ring == MAP_FAILED || aio->sqes == MAP_FAILED)
+    {
+        close(fd);
+        return 0;
+    }
+
+    uint8_t *sq = aio->sq_ring, *cq = aio->cq_ring;
+    aio->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    aio->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    aio->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    aio->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    aio->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    aio->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    aio->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    if (aio->depth > params.sq_entries) aio->depth = params.sq_entries;
+    aio->ring_fd = fd;
+    return 1;
+}
+
+// 'backend' AIO_AUTO takes io_uring if the kernel (and seccomp) allow it.
+void aio_init(struct AioEngine *aio, enum AioBackend backend, unsigned int depth)
+{
+    memset(aio, 0, sizeof(struct AioEngine));
+    aio->ring_fd = -1;
+    aio->depth = depth ? depth : 1;
+
+    if ((backend == AIO_AUTO || backend == AIO_URING) && uring_init(aio))
+    {
+        aio->backend = AIO_URING;
+        return;
+    }
+    if (backend == AIO_SYNC || aio->depth == 1)
+    {
+        aio->backend = AIO_SYNC;
+        return;
+    }
+
+    aio->backend = AIO_THREADS;
+    aio->thread_count = aio->depth < MAX_AIO_THREADS ? aio->depth : MAX_AIO_THREADS;
+    pthread_mutex_init(&aio->lock, NULL);
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->finished, NULL);
+    for (unsigned int i = 0; i < aio->thread_count; i++)
+    {
+        if (pthread_create(&aio->threads[i], NULL, aio_worker, aio) != 0)
+        {
+            aio->thread_count = i;
+            break;
+        }
+    }
+    if (aio->thread_count == 0) aio->backend = AIO_SYNC;
+}
+
+void aio_free(struct AioEngine *aio)
+{
+    if (aio->backend == AIO_URING)
+    {
+        munmap(aio->sqes, aio->sqes_size);
+        if (aio->cq_ring != aio->sq_ring) munmap(aio->cq_ring, aio->cq_ring_size);
+        munmap(aio->sq_ring, aio->sq_ring_size);
+        close(aio->ring_fd);
+    }
+    else if (aio->backend == AIO_THREADS)
+    {
+        pthread_mutex_lock(&aio->lock);
+        aio->stop = 1;
+        pthread_cond_broadcast(&aio->work);
+        pthread_mutex_unlock(&aio->lock);
+        for (unsigned int i = 0; i < aio->thread_count; i++) pthread_join(aio->threads[i], NULL);
+        pthread_mutex_destroy(&aio->lock);
+        pthread_cond_destroy(&aio->work);
+        pthread_cond_destroy(&aio->finished);
+    }
+    memset(aio, 0, sizeof(struct AioEngine));
+}
+
+static void uring_run(struct AioEngine *aio, struct AioRequest *reqs, unsigned int count)
+{
+    unsigned int next = 0, in_flight = 0, done = 0;
+
+    while (done < count)
+    {
+        unsigned int tail = *aio->sq_tail, mask = *aio->sq_mask, queued = 0;
+        while (next < count && in_flight < aio->depth)
+        {
+            struct AioRequest *req = &reqs[next];
+            unsigned int index = tail & mask;
+            struct io_uring_sqe *sqe = &aio->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = req->fd;
+            sqe->addr = (uintptr_t)req->iov;
+            sqe->len = req->iovcnt;
+            sqe->off = req->offset;
+            sqe->user_data = next;
+            aio->sq_array[index] = index;
+            tail++;
+            next++;
+            in_flight++;
+            queued++;
+        }
+        __atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, aio->ring_fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+        {
+            // the ring is unusable: the rest is done here, what is in flight is waited for below
+            for (unsigned int i = next; i < count; i++) aio_complete_sync(&reqs[i], 0);
+            done += count - next;
+            next = count;
+            if (in_flight == 0) break;
+        }
+
+        unsigned int head = *aio->cq_head;
+        while (head != __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+            struct AioRequest *req = &reqs[cqe->user_data];
+            req->result = cqe->res;
+            // short transfer (end of file, signal) or error: finished or retried in this thread
+            if (req->result < 0 || (size_t)req->result != aio_length(req))
+                aio_complete_sync(req, req->result < 0 ? 0 : (size_t)req->result);
+            head++;
+            in_flight--;
+            done++;
+        }
+        __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Runs every request of the batch, returns the number of failed ones ('result' < 0).
+int aio_run(struct AioEngine *aio, struct AioRequest *reqs, unsigned int count)
+{
+    if (count == 0) return 0;
+
+    if (aio->backend == AIO_URING)
+    {
+        uring_run(aio, reqs, count);
+    }
+    else if (aio->backend == AIO_THREADS && count > 1)
+    {
+        pthread_mutex_lock(&aio->lock);
+        aio->batch = reqs;
+        aio->count = count;
+        aio->next = aio->done = 0;
+        pthread_cond_broadcast(&aio->work);
+        while (aio->done < count) pthread_cond_wait(&aio->finished, &aio->lock);
+        aio->batch = NULL;
+        aio->count = aio->next = aio->done = 0;
+        pthread_mutex_unlock(&aio->lock);
+    }
+    else
+    {
+        for (unsigned int i = 0; i < count; i++) aio_complete_sync(&reqs[i], 0);
+    }
+
+    int failed = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (reqs[i].result < 0) failed++;
+    }
+    return failed;
+}
+
+static enum IoRegion io_region(const struct Volume *vol, long offset)
+{
+    long fat_begin = (long)vol->bpb.reserved_sectors * vol->bpb.bytes_per_sector;
+    long data_begin = (long)vol->first_data_sector * vol->bpb.bytes_per_sector;
+
+    if (offset < fat_begin || data_begin == 0) return REGION_BPB;
+    return offset < data_begin ? REGION_FAT : REGION_DATA;
+}
+
+static void io_seek(struct Volume *vol, long offset)
+{
+    vol->io.seeks[io_region(vol, offset)]++;
+    fseek(vol->file, offset, SEEK_SET);
+}
+
+static inline void count_read(struct Volume *vol, long offset, size_t length)
+{
+    enum IoRegion region = io_region(vol, offset);
+    vol->io.reads[region]++;
+    vol->io.bytes_read[region] += length;
+}
+
+static inline void count_write(struct Volume *vol, long offset, size_t length)
+{
+    enum IoRegion region = io_region(vol, offset);
+    vol->io.writes[region]++;
+    vol->io.bytes_written[region] += length;
+}
+
+void mark_dirty(struct Volume *vol, long offset, long length)
+{
+    if (vol->dirty_end == 0 || offset < vol->dirty_begin) vol->dirty_begin = offset;
+    if (offset + length > vol->dirty_end) vol->dirty_end = offset + length;
+}
+
+static int read_at(int fd, void *buf, size_t length, off_t offset)
+{
+    for (size_t done = 0; done < length; )
+    {
+        ssize_t n = pread(fd, (uint8_t *)buf + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        done += n;
+    }
+    return 1;
+}
+
+void read_bytes(struct Volume *vol, long offset, void *buf, size_t length)
+{
+    count_read(vol, offset, length);
+
+    // a view does not read the FAT or FSInfo while a commit writes them back
+    int locked = vol->shared && io_region(vol, offset) != REGION_DATA;
+    if (locked) pthread_rwlock_rdlock(&vol->locks->fat);
+
+    if (vol->map)
+    {
+        memcpy(buf, vol->map + offset, length);
+    }
+    else if (vol->shared)
+    {
+        // no file position of its own
+        if (!read_at(fileno(vol->file), buf, length, offset)) memset(buf, 0, length);
+    }
+    else
+    {
+        io_seek(vol, offset);
+        if (fread(buf, 1, length, vol->file) != length)
+            memset(buf, 0, length);
+    }
+
+    if (locked) pthread_rwlock_unlock(&vol->locks->fat);
+}
+
+void write_bytes(struct Volume *vol, long offset, const void *buf, size_t length)
+{
+    count_write(vol, offset, length);
+    if (vol->map)
+    {
+        if (vol->map + offset != buf) memcpy(vol->map + offset, buf, length);
+        mark_dirty(vol, offset, length);
+        return;
+    }
+    io_seek(vol, offset);
+    fwrite(buf, 1, length, vol->file);
+}
+
+// Runs a batch of requests on the image. The stdio buffer is written out and dropped
+// first, so neither side sees stale data of the other.
+static int image_aio(struct Volume *vol, struct AioRequest *reqs, unsigned int count)
+{
+    if (!vol->shared) fflush(vol->file);
+    vol->io.aio_batches++;
+    vol->io.aio_requests += count;
+    return aio_run(&vol->aio, reqs, count);
+}
+
+long cluster_offset(const struct Volume *vol, uint32_t cluster)
+{
+    return ((long)vol->first_data_sector * vol->bpb.bytes_per_sector) + (long)(cluster - 2) * vol->cluster_size;
+}
+
+void cache_free(struct BlockCache *cache)
+{
+    for (unsigned int i = 0; i < cache->capacity; i++)
+        free(cache->slots[i].data);
+    free(cache->slots);
+    free(cache->buckets);
+    memset(cache, 0, sizeof(struct BlockCache));
+}
+
+// Drops everything that is cached (without writing it) and sets the cache up for blocks
+// of 'block_size' bytes starting at 'base'.
+void cache_init(struct BlockCache *cache, unsigned int capacity, unsigned int block_size,
+                long base, unsigned int copies, long copy_stride)
+{
+    cache_free(cache);
+    if (capacity < MIN_CACHE_BLOCKS) capacity = MIN_CACHE_BLOCKS;
+
+    unsigned int bucket_count = 1;
+    while (bucket_count < capacity * 2) bucket_count <<= 1;
+
+    cache->capacity = capacity;
+    cache->bucket_mask = bucket_count - 1;
+    cache->slots = calloc(capacity, sizeof(struct CacheSlot));
+    cache->buckets = malloc(bucket_count * sizeof(int));
+    for (unsigned int i = 0; i < bucket_count; i++) cache->buckets[i] = -1;
+    for (unsigned int i = 0; i < capacity; i++) cache->slots[i].data = malloc(block_size);
+    cache->head = cache->tail = -1;
+
+    cache->base = base;
+    cache->block_size = block_size;
+    cache->copies = copies;
+    cache->copy_stride = copy_stride;
+}
+
+static inline unsigned int cache_bucket(const struct BlockCache *cache, uint32_t block)
+{
+    return (block * 2654435761u) & cache->bucket_mask;
+}
+
+static int cache_lookup(struct BlockCache *cache, uint32_t block)
+{
+    for (int i = cache->buckets[cache_bucket(cache, block)]; i >= 0; i = cache->slots[i].hash_next)
+    {
+        if (cache->slots[i].block == block) return i;
+    }
+    return -1;
+}
+
+static void lru_unlink(struct BlockCache *cache, int i)
+{
+    struct CacheSlot *slot = &cache->slots[i];
+    if (slot->prev >= 0) cache->slots[slot->prev].next = slot->next; else cache->head = slot->next;
+    if (slot->next >= 0) cache->slots[slot->next].prev = slot->prev; else cache->tail = slot->prev;
+}
+
+static void lru_push_front(struct BlockCache *cache, int i)
+{
+    struct CacheSlot *slot = &cache->slots[i];
+    slot->prev = -1;
+    slot->next = cache->head;
+    if (cache->head >= 0) cache->slots[cache->head].prev = i; else cache->tail = i;
+    cache->head = i;
+}
+
+static void hash_remove(struct BlockCache *cache, int i)
+{
+    int *link = &cache->buckets[cache_bucket(cache, cache->slots[i].block)];
+    while (*link != i) link = &cache->slots[*link].hash_next;
+    *link = cache->slots[i].hash_next;
+}
+
+static inline long block_offset(const struct BlockCache *cache, uint32_t block)
+{
+    return cache->base + (long)block * cache->block_size;
+}
+
+// Doubles the number of slots; blocks that are cached stay where they are.
+static void cache_grow(struct BlockCache *cache)
+{
+    unsigned int capacity = cache->capacity * 2;
+    unsigned int bucket_count = (cache->bucket_mask + 1) * 2;
+
+    cache->slots = realloc(cache->slots, capacity * sizeof(struct CacheSlot));
+    memset(cache->slots + cache->capacity, 0, (capacity - cache->capacity) * sizeof(struct CacheSlot));
+    for (unsigned int i = cache->capacity; i < capacity; i++) cache->slots[i].data = malloc(cache->block_size);
+    cache->capacity = capacity;
+
+    free(cache->buckets);
+    cache->buckets = malloc(bucket_count * sizeof(int));
+    cache->bucket_mask = bucket_count - 1;
+    for (unsigned int i = 0; i < bucket_count; i++) cache->buckets[i] = -1;
+    for (unsigned int i = 0; i < cache->used; i++)
+    {
+        if (cache->slots[i].block == CACHE_EMPTY) continue;
+        unsigned int bucket = cache_bucket(cache, cache->slots[i].block);
+        cache->slots[i].hash_next = cache->buckets[bucket];
+        cache->buckets[bucket] = i;
+    }
+}
+
+// With the journal a dirty block must not reach the image before it is logged, so the
+// least recently used clean block is reused instead, and if every block is dirty the
+// cache grows until the next commit.
+static int journal_victim(struct BlockCache *cache)
+{
+    for (int i = cache->tail; i >= 0; i = cache->slots[i].prev)
+    {
+        if (!cache->slots[i].dirty) return i;
+    }
+    cache_grow(cache);
+    return -1;
+}
+
+// Free slot for 'block', taken from the end of the LRU list if the cache is full.
+static int cache_take_slot(struct Volume *vol, struct BlockCache *cache, uint32_t block)
+{
+    int i = cache->tail;
+
+    if (cache->used == cache->capacity && vol->journal_fd >= 0)
+        i = journal_victim(cache);
+
+    if (cache->used < cache->capacity)
+    {
+        i = cache->used++;
+    }
+    else
+    {
+        struct CacheSlot *victim = &cache->slots[i];
+        lru_unlink(cache, i);
+        if (victim->block != CACHE_EMPTY)
+        {
+            if (victim->dirty)
+            {
+                for (unsigned int copy = 0; copy < cache->copies; copy++)
+                    write_bytes(vol, block_offset(cache, victim->block) + copy * cache->copy_stride, victim->data, cache->block_size);
+                cache->writebacks++;
+            }
+            hash_remove(cache, i);
+            cache->evictions++;
+        }
+    }
+
+    struct CacheSlot *slot = &cache->slots[i];
+    slot->block = block;
+    slot->dirty = 0;
+    unsigned int bucket = cache_bucket(cache, block);
+    slot->hash_next = cache->buckets[bucket];
+    cache->buckets[bucket] = i;
+    lru_push_front(cache, i);
+    return i;
+}
+
+// Slot holding 'block'; on a miss it is read from the image, or zeroed if 'read' is 0.
+static int cache_get(struct Volume *vol, struct BlockCache *cache, uint32_t block, int read)
+{
+    int i = cache_lookup(cache, block);
+    if (i >= 0)
+    {
+        if (read) cache->hits++;
+        lru_unlink(cache, i);
+        lru_push_front(cache, i);
+        return i;
+    }
+
+    i = cache_take_slot(vol, cache, block);
+    if (read)
+    {
+        cache->misses++;
+        read_bytes(vol, block_offset(cache, block), cache->slots[i].data, cache->block_size);
+    }
+    else
+    {
+        memset(cache->slots[i].data, 0, cache->block_size);
+    }
+    return i;
+}
+
+static int compare_slot_block(const void *a, const void *b)
+{
+    uint32_t x = (*(struct CacheSlot * const *)a)->block;
+    uint32_t y = (*(struct CacheSlot * const *)b)->block;
+    return (x > y) - (x < y);
+}
+
+// Writes every dirty block (to every copy) in one asynchronous batch: neighbouring blocks
+// are one request, and all requests are in flight together.
+void cache_flush(struct Volume *vol, struct BlockCache *cache)
+{
+    struct CacheSlot **dirty = malloc(cache->used * sizeof(struct CacheSlot *) + 1);
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < cache->used; i++)
+    {
+        if (cache->slots[i].dirty) dirty[count++] = &cache->slots[i];
+    }
+    if (count == 0)
+    {
+        free(dirty);
+        return;
+    }
+    qsort(dirty, count, sizeof(struct CacheSlot *), compare_slot_block);
+
+    struct AioRequest *reqs = malloc(count * cache->copies * sizeof(struct AioRequest));
+    unsigned int n = 0;
+    for (unsigned int copy = 0; copy < cache->copies; copy++)
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            long offset = block_offset(cache, dirty[i]->block) + copy * cache->copy_stride;
+            count_write(vol, offset, cache->block_size);
+
+            struct AioRequest *req = n > 0 ? &reqs[n - 1] : NULL;
+            if (i == 0 || dirty[i]->block != dirty[i - 1]->block + 1 || req->iovcnt == AIO_MAX_IOV)
+            {
+                req = &reqs[n++];
+                req->write = 1;
+                req->fd = fileno(vol->file);
+                req->offset = offset;
+                req->iovcnt = 0;
+            }
+            req->iov[req->iovcnt].iov_base = dirty[i]->data;
+            req->iov[req->iovcnt++].iov_len = cache->block_size;
+        }
+    }
+    if (image_aio(vol, reqs, n) > 0) printf("Error writing the image\n");
+    free(reqs);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        dirty[i]->dirty = 0;
+        cache->writebacks++;
+    }
+    free(dirty);
+}
+
+// For transfers that bypass the cache: blocks [first, first + count) that are cached are
+// written back (if dirty) and, with 'discard', dropped, so the image and the cache agree.
+void cache_sync_range(struct Volume *vol, struct BlockCache *cache, uint32_t first, uint32_t count, int discard)
+{
+    for (unsigned int i = 0; i < cache->used; i++)
+    {
+        struct CacheSlot *slot = &cache->slots[i];
+        if (slot->block == CACHE_EMPTY || slot->block - first >= count) continue;
+
+        if (slot->dirty && !discard)
+        {
+            write_bytes(vol, block_offset(cache, slot->block), slot->data, cache->block_size);
+            cache->writebacks++;
+        }
+        slot->dirty = 0;
+        if (!discard) continue;
+
+        // goes to the end of the LRU list, it is the next one to be reused
+        hash_remove(cache, i);
+        slot->block = CACHE_EMPTY;
+        lru_unlink(cache, i);
+        slot->prev = cache->tail;
+        slot->next = -1;
+        if (cache->tail >= 0) cache->slots[cache->tail].next = i; else cache->head = i;
+        cache->tail = i;
+    }
+}
+
+// Returns the cluster contents: straight from the mapping, or from the cluster cache.
+// The pointer stays valid until a few more clusters are requested.
+uint8_t *get_cluster(struct Volume *vol, uint32_t cluster)
+{
+    if (vol->map)
+    {
+        count_read(vol, cluster_offset(vol, cluster), vol->cluster_size);
+        return vol->map + cluster_offset(vol, cluster);
+    }
+
+    int i = cache_get(vol, &vol->cache, cluster, 1); // may grow (move) the slots
+    return vol->cache.slots[i].data;
+}
+
+// Same as get_cluster(), but the contents are zeroed instead of read.
+uint8_t *new_cluster(struct Volume *vol, uint32_t cluster)
+{
+    if (vol->map)
+    {
+        uint8_t *data = vol->map + cluster_offset(vol, cluster);
+        memset(data, 0, vol->cluster_size);
+        return data;
+    }
+
+    int i = cache_get(vol, &vol->cache, cluster, 0);
+    memset(vol->cache.slots[i].data, 0, vol->cluster_size);
+    return vol->cache.slots[i].data;
+}
+
+// Marks a cluster as changed. With the cache it is written on eviction or sync.
+void put_cluster(struct Volume *vol, uint32_t cluster, const uint8_t *data)
+{
+    if (vol->map)
+    {
+        write_bytes(vol, cluster_offset(vol, cluster), data, vol->cluster_size);
+        return;
+    }
+
+    int i = cache_lookup(&vol->cache, cluster);
+    if (i < 0) i = cache_take_slot(vol, &vol->cache, cluster);
+
+    struct CacheSlot *slot = &vol->cache.slots[i];
+    if (slot->data != data) memcpy(slot->data, data, vol->cluster_size);
+    slot->dirty = 1;
+}
+
+uint32_t next_cluster(struct Volume *vol, uint32_t cluster);
+
+#define READAHEAD_CLUSTERS 16
+
+// Loads the clusters of a chain from 'cluster' on (READAHEAD_CLUSTERS, at most a quarter
+// of the cache) that are not cached yet, as one asynchronous batch.
+void readahead_chain(struct Volume *vol, uint32_t cluster)
+{
+    struct BlockCache *cache = &vol->cache;
+    struct AioRequest reqs[READAHEAD_CLUSTERS];
+    unsigned int limit = cache->capacity / 4, n = 0;
+    uint32_t previous = 0;
+
+    if (vol->map) return;
+    if (limit > READAHEAD_CLUSTERS) limit = READAHEAD_CLUSTERS;
+    if (limit == 0) limit = 1;
+
+    for (unsigned int k = 0; k < limit && cluster != 0; k++, cluster = next_cluster(vol, cluster))
+    {
+        if (cache_lookup(cache, cluster) >= 0) continue;
+
+        int i = cache_take_slot(vol, cache, cluster);
+        cache->misses++;
+        long offset = cluster_offset(vol, cluster);
+        count_read(vol, offset, vol->cluster_size);
+
+        struct AioRequest *req = n > 0 ? &reqs[n - 1] : NULL;
+        if (req == NULL || cluster != previous + 1)
+        {
+            req = &reqs[n++];
+            req->write = 0;
+            req->fd = fileno(vol->file);
+            req->offset = offset;
+            req->iovcnt = 0;
+        }
+        req->iov[req->iovcnt].iov_base = cache->slots[i].data;
+        req->iov[req->iovcnt++].iov_len = vol->cluster_size;
+        previous = cluster;
+    }
+
+    image_aio(vol, reqs, n);
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (reqs[i].result >= 0) continue;
+        for (int j = 0; j < reqs[i].iovcnt; j++) memset(reqs[i].iov[j].iov_base, 0, reqs[i].iov[j].iov_len);
+    }
+}
+
+// FAT sector 'page', loaded on demand
+static inline uint8_t *fat_page(struct Volume *vol, uint32_t page)
+{
+    int i = cache_get(vol, &vol->fat_cache, page, 1); // may grow (move) the slots
+    return vol->fat_cache.slots[i].data;
+}
+
+uint32_t get_fat_entry(struct Volume *vol, uint32_t cluster)
+{
+    if (vol->map) return get_le32(vol->fat + (long)cluster * 4);
+
+    uint32_t entries = vol->fat_entries_per_page;
+    return get_le32(fat_page(vol, cluster / entries) + (cluster % entries) * 4);
+}
+
+static void build_bitmap_page(struct Volume *vol, uint32_t page)
+{
+    uint32_t first = page * vol->fat_entries_per_page;
+    uint32_t last = first + vol->fat_entries_per_page - 1;
+    if (last > vol->total_clusters + 1) last = vol->total_clusters + 1;
+
+    const uint8_t *data = vol->map ? vol->fat + (long)first * 4 : fat_page(vol, page);
+    for (uint32_t i = first; i <= last; i++)
+    {
+        uint64_t bit = 1ULL << (i & 63);
+        if (i >= 2 && get_le32(data + (i - first) * 4) == 0)
+            vol->free_bitmap[i >> 6] |= bit;
+        else
+            vol->free_bitmap[i >> 6] &= ~bit;
+    }
+    vol->bitmap_built[page >> 6] |= 1ULL << (page & 63);
+}
+
+// makes sure the bitmap word of 'cluster' is built (a FAT sector covers whole words)
+static inline void ensure_bitmap(struct Volume *vol, uint32_t cluster)
+{
+    uint32_t page = cluster / vol->fat_entries_per_page;
+    if (!((vol->bitmap_built[page >> 6] >> (page & 63)) & 1)) build_bitmap_page(vol, page);
+}
+
+// Sizes the bitmap for the volume; 'all_free' marks it built from a freshly zeroed FAT.
+int init_free_bitmap(struct Volume *vol, int all_free)
+{
+    uint32_t words = (vol->total_clusters + 2 + 63) / 64;
+    uint32_t pages = (vol->total_clusters + 2 + vol->fat_entries_per_page - 1) / vol->fat_entries_per_page;
+
+    free(vol->free_bitmap);
+    free(vol->bitmap_built);
+    vol->free_bitmap = calloc(words, sizeof(uint64_t));
+    vol->bitmap_built = calloc((pages + 63) / 64, sizeof(uint64_t));
+    vol->held_count = 0;
+    if (vol->free_bitmap == NULL || vol->bitmap_built == NULL) return 0;
+
+    if (all_free)
+    {
+        memset(vol->free_bitmap, 0xFF, words * sizeof(uint64_t));
+        vol->free_bitmap[0] &= ~3ULL; // clusters 0 and 1 do not exist
+        uint32_t end = vol->total_clusters + 2;
+        if (end & 63) vol->free_bitmap[words - 1] &= (1ULL << (end & 63)) - 1;
+        memset(vol->bitmap_built, 0xFF, ((pages + 63) / 64) * sizeof(uint64_t));
+    }
+    return 1;
+}
+
+// every FAT change goes through here, so the bitmap never lags behind
+void set_fat_entry(struct Volume *vol, uint32_t cluster, uint32_t value)
+{
+    if (vol->map)
+    {
+        // FAT1 and its copies are all changed in place
+        for (int copy = 0; copy < vol->bpb.fat_amount; copy++)
+        {
+            uint8_t *entry = vol->fat + copy * vol->fat_size_bytes + (long)cluster * 4;
+            put_le32(entry, value);
+            mark_dirty(vol, entry - vol->map, 4);
+            count_write(vol, entry - vol->map, 4);
+        }
+    }
+    else
+    {
+        uint32_t entries = vol->fat_entries_per_page;
+        int i = cache_get(vol, &vol->fat_cache, cluster / entries, 1);
+        put_le32(vol->fat_cache.slots[i].data + (cluster % entries) * 4, value);
+        vol->fat_cache.slots[i].dirty = 1;
+    }
+
+    if (value == 0)
+        vol->free_bitmap[cluster >> 6] |= 1ULL << (cluster & 63);
+    else
+        vol->free_bitmap[cluster >> 6] &= ~(1ULL << (cluster & 63));
+}
+
+// first run of 'count' free clusters inside [from, to], -1 if there is none
+int find_free_run(struct Volume *vol, uint32_t from, uint32_t to, unsigned int count)
+{
+    uint32_t run_start = 0;
+    unsigned int run_len = 0;
+    uint32_t i = from;
+
+    while (i <= to)
+    {
+        unsigned int bit = i & 63;
+        unsigned int span = 64 - bit;
+        if (span > to - i + 1) span = to - i + 1;
+
+        ensure_bitmap(vol, i);
+        uint64_t word = vol->free_bitmap[i >> 6] >> bit;
+        if (span < 64) word &= (1ULL << span) - 1;
+
+        if (run_len == 0)
+        {
+            if (word == 0) { i += span; continue; } // 64 used clusters at once
+
+            unsigned int skip = __builtin_ctzll(word);
+            i += skip;
+            span -= skip;
+            word >>= skip;
+            run_start = i;
+        }
+
+        // free clusters at the beginning of the word continue the run
+        unsigned int ones = (~word == 0) ? 64 : (unsigned int)__builtin_ctzll(~word);
+        run_len += ones;
+        i += ones;
+
+        if (run_len >= count) return run_start;
+        if (ones < span) run_len = 0; // run is broken by a used cluster
+    }
+    return -1;
+}
+
+// Contiguous run of 'count' free clusters. Search starts at 'start' and wraps around to cluster 2.
+int find_free_extent(struct Volume *vol, uint32_t start, unsigned int count)
+{
+    uint32_t last = vol->total_clusters + 1;
+    if (start < 2 || start > last) start = 2;
+    if (count == 0 || count > vol->total_clusters) return -1;
+
+    int cluster = find_free_run(vol, start, last, count);
+    if (cluster >= 0 || start == 2) return cluster;
+
+    uint32_t wrap_end = start + count - 2; // a run may end after 'start', but must begin before it
+    if (wrap_end > last) wrap_end = last;
+    return find_free_run(vol, 2, wrap_end, count);
+}
+
+int find_free_cluster(struct Volume *vol, uint32_t start)
+{
+    return find_free_extent(vol, start, 1);
+}
+
+// needs the whole FAT, so it is only used when FSInfo can not be trusted
+unsigned int count_free_clusters(struct Volume *vol)
+{
+    unsigned int free_count = 0;
+    uint32_t words = (vol->total_clusters + 2 + 63) / 64;
+    for (uint32_t i = 0; i < words; i++)
+    {
+        ensure_bitmap(vol, i * 64);
+        free_count += __builtin_popcountll(vol->free_bitmap[i]);
+    }
+    return free_count;
+}
+
+void init_fsinfo(struct FSInfo *fsinfo, uint32_t free_count, uint32_t next_free)
+{
+    memset(fsinfo, 0, sizeof(struct FSInfo));
+    fsinfo->lead_signature = FSINFO_LEAD_SIGNATURE;
+    fsinfo->struct_signature = FSINFO_STRUCT_SIGNATURE;
+    fsinfo->trail_signature = FSINFO_TRAIL_SIGNATURE;
+    fsinfo->free_count = free_count;
+    fsinfo->next_free = next_free;
+}
+
+int fsinfo_is_valid(const struct FSInfo *fsinfo, unsigned int total_clusters)
+{
+    if (fsinfo->lead_signature != FSINFO_LEAD_SIGNATURE ||
+        fsinfo->struct_signature != FSINFO_STRUCT_SIGNATURE ||
+        fsinfo->trail_signature != FSINFO_TRAIL_SIGNATURE)
+        return 0;
+
+    // both fields are only hints, but they must be in range to be used
+    if (fsinfo->free_count == FSINFO_UNKNOWN || fsinfo->free_count > total_clusters)
+        return 0;
+    if (fsinfo->next_free == FSINFO_UNKNOWN || fsinfo->next_free < 2 || fsinfo->next_free > total_clusters + 1)
+        return 0;
+
+    return 1;
+}
+
+// Links the free clusters [first, first + count) into one chain.
+void claim_extent(struct Volume *vol, struct FSInfo *fsinfo, uint32_t first, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        uint32_t cluster = first + i;
+        set_fat_entry(vol, cluster, (i + 1 == count) ? FAT_EOC : cluster + 1);
+    }
+    fsinfo->free_count -= count;
+}
+
+// Takes 'count' contiguous free clusters starting from the FSInfo hint and links them
+// into one chain (last one is EOF). Returns the first cluster of the chain.
+// Most of the time the hint points right at free space, so no scan is needed.
+int allocate_extent(struct Volume *vol, struct FSInfo *fsinfo, unsigned int count)
+{
+    if (fsinfo->free_count < count) return -1;
+
+    int first = find_free_extent(vol, fsinfo->next_free, count);
+    if (first < 0) return -1;
+
+    claim_extent(vol, fsinfo, first, count);
+
+    uint32_t next = first + count;
+    fsinfo->next_free = (next > vol->total_clusters + 1) ? 2 : next;
+    return first;
+}
+
+int allocate_cluster(struct Volume *vol, struct FSInfo *fsinfo)
+{
+    return allocate_extent(vol, fsinfo, 1);
+}
+
+// Appends a run of clusters to a list, joining it to the last run if they touch.
+// Returns 0 if there is no memory for it.
+static int add_run(struct ClusterRun **runs, unsigned int *count, unsigned int *capacity, uint32_t first, uint32_t length)
+{
+    if (*count > 0)
+    {
+        struct ClusterRun *last = &(*runs)[*count - 1];
+        if (last->first + last->count == first)
+        {
+            last->count += length;
+            return 1;
+        }
+    }
+    if (*count == *capacity)
+    {
+        unsigned int grown = *capacity ? *capacity * 2 : 64;
+        struct ClusterRun *more = realloc(*runs, grown * sizeof(struct ClusterRun));
+        if (more == NULL) return 0;
+        *runs = more;
+        *capacity = grown;
+    }
+    (*runs)[*count].first = first;
+    (*runs)[*count].count = length;
+    (*count)++;
+    return 1;
+}
+
+// With --journal a freed cluster is not allocated again before the commit that makes its
+// release durable: file data goes past the journal, and a crash before the commit brings
+// back the entry that still uses the cluster. It stays used in the free bitmap (free in
+// the FAT and the free count) until release_held(); if it can not be noted, until the
+// image is opened again.
+static void hold_cluster(struct Volume *vol, struct FSInfo *fsinfo, uint32_t cluster)
+{
+    if (vol->journal_fd < 0)
+    {
+        if (cluster < fsinfo->next_free) fsinfo->next_free = cluster;
+        return;
+    }
+    ensure_bitmap(vol, cluster);
+    vol->free_bitmap[cluster >> 6] &= ~(1ULL << (cluster & 63));
+    add_run(&vol->held, &vol->held_count, &vol->held_capacity, cluster, 1);
+}
+
+// after a journal commit: the held clusters can be allocated again
+static void release_held(struct Volume *vol)
+{
+    for (unsigned int i = 0; i < vol->held_count; i++)
+    {
+        const struct ClusterRun *run = &vol->held[i];
+        for (uint32_t c = run->first; c < run->first + run->count; c++)
+        {
+            if (get_fat_entry(vol, c) != 0) continue;
+            vol->free_bitmap[c >> 6] |= 1ULL << (c & 63);
+            if (c < vol->fsinfo.next_free) vol->fsinfo.next_free = c;
+        }
+    }
+    vol->held_count = 0;
+}
+
+void release_cluster(struct Volume *vol, struct FSInfo *fsinfo, uint32_t cluster)
+{
+    if (get_fat_entry(vol, cluster) == 0) return;
+
+    set_fat_entry(vol, cluster, 0);
+    fsinfo->free_count++;
+    hold_cluster(vol, fsinfo, cluster);
+}
+
+unsigned int free_chain(struct Volume *vol, struct FSInfo *fsinfo, uint32_t first);
+
+// Chain of 'count' clusters made of as few extents as possible: the whole run if there
+// is one, otherwise the biggest halves that fit. Returns the first cluster or -1.
+int allocate_chain(struct Volume *vol, struct FSInfo *fsinfo, unsigned int count)
+{
+    if (count == 0 || fsinfo->free_count < count) return -1;
+
+    int first = -1;
+    uint32_t last = 0;
+    unsigned int piece = count;
+    while (count > 0)
+    {
+        if (piece > count) piece = count;
+        int start = allocate_extent(vol, fsinfo, piece);
+        if (start < 0)
+        {
+            if (piece == 1) break; // clusters held until the journal commit, or FSInfo was wrong
+            piece /= 2;
+            continue;
+        }
+
+        if (first < 0) first = start; else set_fat_entry(vol, last, start);
+        last = start + piece - 1;
+        count -= piece;
+    }
+
+    if (count > 0 && first >= 0)
+    {
+        free_chain(vol, fsinfo, first);
+        return -1;
+    }
+    return first;
+}
+
+// Writes the changed FAT sectors into every FAT copy, neighbouring sectors at once.
+// With --mmap the copies are already changed in place.
+void flush_fat(struct Volume *vol)
+{
+    if (!vol->map) cache_flush(vol, &vol->fat_cache);
+}
+
+void write_fsinfo(struct Volume *vol, const struct FSInfo *fsinfo)
+{
+    uint8_t sector[512];
+    encode_fsinfo(fsinfo, sector);
+    write_bytes(vol, (long)vol->bpb.sector_FS_info * vol->bpb.bytes_per_sector, sector, sizeof(sector));
+}
+
+// Metadata journal (--journal): a sidecar file next to the image that holds at most one
+// transaction, all metadata changed since the previous sync point:
+//
+//   header   "FATikWAL", sequence (8), block count (4), 0 (4), payload bytes (8)
+//   block    image offset (8), length (4), copies (4), copy stride (8), data   (repeated)
+//   trailer  "FATikEND", sequence (8), FNV-1a 64 of header and payload (8)
+//
+// A commit makes the image durable (file data written past the caches, the previous
+// checkpoint), replaces the record and fdatasync's the journal; only then the same blocks
+// are written in place. A crash before the journal is durable leaves the image as it was
+// at the previous sync point, after it the record is replayed on the next open. Replaying
+// a record that already is in the image changes nothing.
+#define JOURNAL_HEADER 32
+#define JOURNAL_BLOCK 24
+#define JOURNAL_TRAILER 24
+
+struct JournalRecord
+{
+    uint8_t *data;
+    size_t size, capacity;
+    uint32_t blocks;
+};
+
+static inline void put_le64(uint8_t *p, uint64_t value)
+{
+    put_le32(p, (uint32_t)value);
+    put_le32(p + 4, (uint32_t)(value >> 32));
+}
+
+static inline uint64_t get_le64(const uint8_t *p)
+{
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static uint64_t journal_checksum(const uint8_t *data, size_t length)
+{
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static uint8_t *journal_reserve(struct JournalRecord *rec, size_t length)
+{
+    if (rec->size + length > rec->capacity)
+    {
+        while (rec->size + length > rec->capacity) rec->capacity = rec->capacity ? rec->capacity * 2 : 64 * 1024;
+        rec->data = realloc(rec->data, rec->capacity);
+    }
+    uint8_t *p = rec->data + rec->size;
+    rec->size += length;
+    return p;
+}
+
+static void journal_add(struct JournalRecord *rec, long offset, const void *data, uint32_t length,
+                        uint32_t copies, long copy_stride)
+{
+    uint8_t *p = journal_reserve(rec, JOURNAL_BLOCK + length);
+    put_le64(p, offset);
+    put_le32(p + 8, length);
+    put_le32(p + 12, copies);
+    put_le64(p + 16, copy_stride);
+    memcpy(p + JOURNAL_BLOCK, data, length);
+    rec->blocks++;
+}
+
+static void journal_add_cache(struct JournalRecord *rec, const struct BlockCache *cache)
+{
+    for (unsigned int i = 0; i < cache->used; i++)
+    {
+        const struct CacheSlot *slot = &cache->slots[i];
+        if (slot->dirty)
+            journal_add(rec, block_offset(cache, slot->block), slot->data, cache->block_size, cache->copies, cache->copy_stride);
+    }
+}
+
+// Logs everything that the following checkpoint is going to write (dirty clusters, dirty FAT
+// sectors of every copy, FSInfo) as one transaction: two fdatasync's however many commands
+// were grouped into it.
+static void journal_commit(struct Volume *vol)
+{
+    vol->journal_ops = 0;
+
+    fflush(vol->file);
+    fdatasync(fileno(vol->file));
+    vol->io.flushes++;
+
+    struct JournalRecord rec = {0};
+    journal_reserve(&rec, JOURNAL_HEADER);
+    journal_add_cache(&rec, &vol->cache);
+    journal_add_cache(&rec, &vol->fat_cache);
+    if (rec.blocks == 0)
+    {
+        free(rec.data);
+        release_held(vol);
+        return;                    // nothing changed, FSInfo neither
+    }
+
+    uint8_t sector[512];
+    encode_fsinfo(&vol->fsinfo, sector);
+    journal_add(&rec, (long)vol->bpb.sector_FS_info * vol->bpb.bytes_per_sector, sector, sizeof(sector), 1, 0);
+
+    uint64_t sequence = ++vol->journal_sequence;
+    memcpy(rec.data, "FATikWAL", 8);
+    put_le64(rec.data + 8, sequence);
+    put_le32(rec.data + 16, rec.blocks);
+    put_le32(rec.data + 20, 0);
+    put_le64(rec.data + 24, rec.size - JOURNAL_HEADER);
+    uint64_t checksum = journal_checksum(rec.data, rec.size);
+
+    uint8_t *trailer = journal_reserve(&rec, JOURNAL_TRAILER);
+    memcpy(trailer, "FATikEND", 8);
+    put_le64(trailer + 8, sequence);
+    put_le64(trailer + 16, checksum);
+
+    // the previous record is in the image now (the fdatasync above)
+    int logged = ftruncate(vol->journal_fd, 0) == 0 && pwrite(vol->journal_fd, rec.data, rec.size, 0) == (ssize_t)rec.size;
+    if (!logged) perror(vol->journal_path);
+    fdatasync(vol->journal_fd);
+    vol->io.flushes++;
+    vol->io.journal_commits++;
+    vol->io.journal_bytes += rec.size;
+    free(rec.data);
+
+    // the frees are durable now
+    if (logged) release_held(vol);
+}
+
+// Writes the committed transactions of a journal left by a crash into the image and empties
+// the journal. Returns the number of transactions; an incomplete or damaged one and
+// everything after it is dropped.
+int journal_replay(int journal_fd, int image_fd)
+{
+    struct stat st;
+    if (fstat(journal_fd, &st) != 0 || st.st_size == 0) return 0;
+
+    uint8_t *data = malloc(st.st_size);
+    size_t size = pread(journal_fd, data, st.st_size, 0) == st.st_size ? (size_t)st.st_size : 0;
+    size_t pos = 0;
+    int replayed = 0;
+
+    while (pos + JOURNAL_HEADER + JOURNAL_TRAILER <= size)
+    {
+        const uint8_t *header = data + pos;
+        uint64_t payload = get_le64(header + 24);
+        if (memcmp(header, "FATikWAL", 8) != 0 || payload > size - pos - JOURNAL_HEADER - JOURNAL_TRAILER) break;
+
+        const uint8_t *trailer = header + JOURNAL_HEADER + payload;
+        if (memcmp(trailer, "FATikEND", 8) != 0 || get_le64(trailer + 8) != get_le64(header + 8) ||
+            get_le64(trailer + 16) != journal_checksum(header, JOURNAL_HEADER + payload)) break;
+
+        // the checksum matched, so the blocks are as they were written
+        const uint8_t *p = header + JOURNAL_HEADER;
+        for (uint32_t i = get_le32(header + 16); i > 0 && p + JOURNAL_BLOCK <= trailer; i--)
+        {
+            uint32_t length = get_le32(p + 8);
+            for (uint32_t copy = 0; copy < get_le32(p + 12); copy++)
+            {
+                off_t offset = get_le64(p) + copy * get_le64(p + 16);
+                if (pwrite(image_fd, p + JOURNAL_BLOCK, length, offset) != (ssize_t)length) perror("journal replay");
+            }
+            p += JOURNAL_BLOCK + length;
+        }
+        replayed++;
+        pos += JOURNAL_HEADER + payload + JOURNAL_TRAILER;
+    }
+
+    if (replayed > 0) fdatasync(image_fd);
+    if (ftruncate(journal_fd, 0) == 0) fdatasync(journal_fd);
+    free(data);
+    return replayed;
+}
+
+// Punches the freed runs noted since the last sync out of the image, but for the clusters
+// that are in use again.
+static void punch_discards(struct Volume *vol)
+{
+    for (unsigned int i = 0; i < vol->discard_count; i++)
+    {
+        const struct ClusterRun *run = &vol->discards[i];
+        uint32_t end = run->first + run->count;
+        for (uint32_t c = run->first; c < end; )
+        {
+            if (c > vol->total_clusters + 1) break; // noted before a format
+            uint32_t free_end = c;
+            while (free_end < end && free_end <= vol->total_clusters + 1 && get_fat_entry(vol, free_end) == 0) free_end++;
+            if (free_end > c) punch_hole(vol, cluster_offset(vol, c), (long)(free_end - c) * vol->cluster_size);
+            c = free_end + 1;
+        }
+    }
+    vol->discard_count = 0;
+}
+
+// Sync point ('sync' command and exit): cached clusters, changed FAT sectors and FSInfo
+// go to the image (through the journal if there is one), then the stdio buffer is
+// flushed or the changed part of the mapping is msync'ed.
+void sync_volume(struct Volume *vol)
+{
+    if (vol->shared) return; // a view has nothing to write
+
+    if (vol->is_fat32)
+    {
+        if (vol->journal_fd >= 0) journal_commit(vol);
+        if (!vol->map) cache_flush(vol, &vol->cache);
+        flush_fat(vol);
+        write_fsinfo(vol, &vol->fsinfo);
+    }
+
+    if (!vol->map)
+    {
+        fflush(vol->file);
+        vol->io.flushes++;
+    }
+    else
+    {
+        if (vol->dirty_end > vol->dirty_begin)
+        {
+            long page = sysconf(_SC_PAGESIZE);
+            long begin = vol->dirty_begin & ~(page - 1);
+            msync(vol->map + begin, vol->dirty_end - begin, MS_SYNC);
+            vol->io.flushes++;
+        }
+        vol->dirty_begin = vol->dirty_end = 0;
+    }
+
+    // only now that the FAT saying they are free is in place (and nothing cached of them is
+    // written later); a cluster allocated again since then keeps its data
+    if (vol->discard_count > 0) punch_discards(vol);
+}
+
+static void index_add_hole(struct DirIndex *index, uint32_t cluster, unsigned int offset);
+
+// next cluster of a chain, 0 at its end (or if the link is broken)
+uint32_t next_cluster(struct Volume *vol, uint32_t cluster)
+{
+    uint32_t next = get_fat_entry(vol, cluster) & 0x0FFFFFFF;
+    if (next < 2 || next >= FAT_EOC_MIN || next > vol->total_clusters + 1) return 0;
+    return next;
+}
+
+// With --discard, remembers a run of freed clusters for the next sync to punch out
+// (without memory for it the clusters just stay allocated in the image file).
+static void note_discard(struct Volume *vol, uint32_t first, uint32_t count)
+{
+    add_run(&vol->discards, &vol->discard_count, &vol->discard_capacity, first, count);
+}
+
+// Releases every cluster of a chain in one pass, each FAT entry read once (loops can not
+// happen: a released cluster reads as 0). Returns how many clusters were released.
+unsigned int free_chain(struct Volume *vol, struct FSInfo *fsinfo, uint32_t first)
+{
+    unsigned int freed = 0;
+    uint32_t cluster = first, run_first = first, run_count = 0;
+    while (cluster >= 2 && cluster <= vol->total_clusters + 1)
+    {
+        uint32_t next = get_fat_entry(vol, cluster);
+        if (next == 0) break;
+
+        set_fat_entry(vol, cluster, 0);
+        hold_cluster(vol, fsinfo, cluster);
+        freed++;
+
+        if (vol->discard)
+        {
+            if (run_count > 0 && cluster != run_first + run_count)
+            {
+                note_discard(vol, run_first, run_count);
+                run_count = 0;
+            }
+            if (run_count == 0) run_first = cluster;
+            run_count++;
+        }
+        cluster = next & 0x0FFFFFFF; // the end of chain mark is out of range
+    }
+    if (run_count > 0) note_discard(vol, run_first, run_count);
+    fsinfo->free_count += freed;
+    return freed;
+}
+
+// Length of the contiguous run that starts at 'cluster' (at most 'limit' clusters);
+// '*next' gets the cluster after the run, 0 at the end of the chain.
+unsigned int chain_run(struct Volume *vol, uint32_t cluster, unsigned int limit, uint32_t *next)
+{
+    unsigned int length = 1;
+    uint32_t c = next_cluster(vol, cluster);
+    while (c == cluster + length && length < limit)
+    {
+        length++;
+        c = next_cluster(vol, c);
+    }
+    *next = c;
+    return length;
+}
+
+void dir_open(struct DirIterator *it, struct Volume *vol, uint32_t first_cluster)
+{
+    it->vol = vol;
+    it->cluster = first_cluster;
+    it->offset = 0;
+    it->clusters_left = vol->total_clusters;
+    it->done = (first_cluster < 2);
+    it->lfn_expect = -1;
+    it->index = NULL;
+    it->end.cluster = first_cluster;
+    it->end.offset = 0;
+}
+
+// One 32-byte entry at 'offset' of directory cluster 'cluster': returns 1 with 'pe' filled
+// for a live entry, 0 for LFN parts, deleted and invalid entries, -1 at the end (0x00).
+// The LFN parts collect in the iterator until their SFN entry comes.
+static int dir_parse(struct DirIterator *it, const uint8_t *entry, uint32_t cluster, unsigned int offset,
+                     struct ParsedEntry *pe)
+{
+    // Empty (0x00)
+    if (entry[0] == 0x00) return -1;
+
+    // Deleted (0xE5)
+    if (entry[0] == 0xE5)
+    {
+        if (it->index) index_add_hole(it->index, cluster, offset);
+        it->lfn_expect = -1;
+        return 0;
+    }
+
+    uint8_t attr = entry[11];
+    if (attr == 0x0F)
+    {
+        // LFN: the parts come highest first and carry the checksum of their SFN entry;
+        // a part out of order drops the whole run
+        int seq = entry[0] & 0x1F;
+        if (entry[0] & 0x40)
+        {
+            it->lfn_expect = seq;
+            it->lfn_length = seq * 13;
+            it->lfn_checksum = entry[13];
+        }
+        if (seq == 0 || seq > MAX_LFN_ENTRIES || seq != it->lfn_expect || entry[13] != it->lfn_checksum)
+        {
+            it->lfn_expect = -1;
+            return 0;
+        }
+
+        uint16_t *units = &it->lfn_units[(seq - 1) * 13];
+        for (int i = 0; i < 13; i++) units[i] = get_le16(&entry[lfn_unit_offsets[i]]);
+        if (entry[0] & 0x40)
+        {
+            for (int i = 0; i < 13; i++)
+            {
+                if (units[i] == 0)
+                {
+                    it->lfn_length = (seq - 1) * 13 + i;
+                    break;
+                }
+            }
+        }
+        it->lfn_expect = seq - 1;
+        return 0;
+    }
+
+    // SFN
+    struct SFNentry sfn;
+    read_sfn(entry, &sfn);
+    memset(pe, 0, sizeof(*pe));
+    memcpy(pe->sfn, entry, 11);
+
+    if (it->lfn_expect == 0 && it->lfn_length > 0 && it->lfn_checksum == sfn_checksum(entry))
+    {
+        utf16_to_utf8(it->lfn_units, it->lfn_length, pe->name, sizeof(pe->name));
+    }
+    else
+    {
+        // SFN, lower case as the NT flags of byte 12 say
+        char name[9] = {0}, ext[4] = {0};
+        memcpy(name, sfn.name, 8);
+        memcpy(ext, sfn.ext, 3);
+
+        // Видалити пробіли
+        for (int i = 7; i >= 0 && name[i] == ' '; i--) name[i] = '\0';
+        for (int i = 2; i >= 0 && ext[i] == ' '; i--) ext[i] = '\0';
+        for (int i = 0; name[i] && (sfn.reserved & 0x08); i++)
+            if (name[i] >= 'A' && name[i] <= 'Z') name[i] += 'a' - 'A';
+        for (int i = 0; ext[i] && (sfn.reserved & 0x10); i++)
+            if (ext[i] >= 'A' && ext[i] <= 'Z') ext[i] += 'a' - 'A';
+
+        if (ext[0])
+            snprintf(pe->name, sizeof(pe->name), "%s.%s", name, ext);
+        else
+            snprintf(pe->name, sizeof(pe->name), "%s", name);
+    }
+    it->lfn_expect = -1;
+
+    pe->first_cluster = ((uint32_t)sfn.cluster_high << 16) | sfn.cluster_low;
+    pe->is_directory = (sfn.attributes & 0x10) ? 1 : 0;
+    pe->size = sfn.size;
+    pe->cluster = cluster;
+    pe->offset = offset;
+    return 1;
+}
+
+// Fills 'pe' with the next live entry, returns 0 when the directory ends.
+int dir_next(struct DirIterator *it, struct ParsedEntry *pe)
+{
+    struct Volume *vol = it->vol;
+
+    while (!it->done)
+    {
+        if (it->offset >= vol->cluster_size)
+        {
+            uint32_t next = next_cluster(vol, it->cluster);
+            if (next == 0 || --it->clusters_left == 0)
+            {
+                it->end.cluster = it->cluster;
+                it->end.offset = vol->cluster_size;
+                break;
+            }
+            it->cluster = next;
+            it->offset = 0;
+        }
+
+        // entering a cluster that is not cached: the next ones of the chain come with it
+        if (it->offset == 0 && !vol->map && cache_lookup(&vol->cache, it->cluster) < 0)
+            readahead_chain(vol, it->cluster);
+
+        // the cluster is looked up again every time: it may have left the cache in between
+        uint8_t *entry = get_cluster(vol, it->cluster) + it->offset;
+        unsigned int offset = it->offset;
+        it->offset += DIR_ENTRY_SIZE;
+
+        int parsed = dir_parse(it, entry, it->cluster, offset, pe);
+        if (parsed > 0) return 1;
+        if (parsed < 0)
+        {
+            it->end.cluster = it->cluster;
+            it->end.offset = offset;
+            break;
+        }
+    }
+
+    it->done = 1;
+    return 0;
+}
+
+// Adds a new, zeroed cluster to the end of a directory chain.
+uint32_t extend_directory(struct Volume *vol, uint32_t last_cluster)
+{
+    int cluster = allocate_cluster(vol, &vol->fsinfo);
+    if (cluster < 0) return 0;
+
+    uint8_t *data = new_cluster(vol, cluster);
+    put_cluster(vol, cluster, data);
+    set_fat_entry(vol, last_cluster, cluster);
+    return cluster;
+}
+
+// FAT names are case-insensitive: every character is folded by upcase_code(), so "Über"
+// and "über" are the same name. ASCII is folded inline; a byte that does not start a valid
+// UTF-8 sequence stands for itself (above any code point), so any string can be looked up.
+static uint32_t folded_multibyte(const unsigned char **p)
+{
+    const unsigned char *s = *p;
+    int length = utf8_lengths[*s >> 3];
+    uint32_t code = *s & (0x7F >> length);
+    for (int i = 1; i < length; i++)
+    {
+        if ((s[i] & 0xC0) != 0x80)
+        {
+            length = 0;
+            break;
+        }
+        code = (code << 6) | (s[i] & 0x3F);
+    }
+    if (length == 0)
+    {
+        (*p)++;
+        return 0x110000 + *s;
+    }
+    *p += length;
+    return upcase_code(code);
+}
+
+static inline uint32_t folded_code(const unsigned char **p)
+{
+    unsigned char c = **p;
+    if (c >= 0x80) return folded_multibyte(p);
+    (*p)++;
+    return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
+
+uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)name; *p; )
+    {
+        hash ^= folded_code(&p);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int name_equal(const char *a, const char *b)
+{
+    const unsigned char *p = (const unsigned char *)a, *q = (const unsigned char *)b;
+    while (*p && *q)
+    {
+        if (folded_code(&p) != folded_code(&q)) return 0;
+    }
+    return *p == *q;
+}
+
+void dir_index_free(struct DirIndex *index)
+{
+    for (unsigned int i = 0; i < index->count; i++)
+        free(index->names[i].name);
+    free(index->names);
+    free(index->buckets);
+    free(index->holes);
+    sfn_set_free(&index->sfns);
+    memset(index, 0, sizeof(struct DirIndex));
+}
+
+// Forgets every index (after format, cluster numbers mean something else).
+void drop_dir_indexes(struct Volume *vol)
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+        dir_index_free(&vol->dir_index[i]);
+}
+
+static void index_add_hole(struct DirIndex *index, uint32_t cluster, unsigned int offset)
+{
+    if (index->hole_count == index->hole_capacity)
+    {
+        unsigned int capacity = index->hole_capacity ? index->hole_capacity * 2 : 16;
+        struct SlotPos *holes = realloc(index->holes, capacity * sizeof(struct SlotPos));
+        if (holes == NULL)
+        {
+            index->error = 1;
+            return;
+        }
+        index->holes = holes;
+        index->hole_capacity = capacity;
+    }
+    index->holes[index->hole_count].cluster = cluster;
+    index->holes[index->hole_count].offset = offset;
+    index->hole_count++;
+}
+
+static void index_rehash(struct DirIndex *index, unsigned int bucket_count)
+{
+    int *buckets = malloc(bucket_count * sizeof(int));
+    if (buckets == NULL) return; // keep the old (longer) chains
+
+    for (unsigned int i = 0; i < bucket_count; i++) buckets[i] = -1;
+    for (unsigned int i = 0; i < index->count; i++)
+    {
+        unsigned int bucket = index->names[i].hash & (bucket_count - 1);
+        index->names[i].hash_next = buckets[bucket];
+        buckets[bucket] = i;
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_mask = bucket_count - 1;
+}
+
+static void index_add_name(struct DirIndex *index, const char *name, uint32_t first_cluster,
+                           unsigned char is_directory, uint32_t cluster, unsigned int offset)
+{
+    if (index->count == index->capacity)
+    {
+        unsigned int capacity = index->capacity ? index->capacity * 2 : 64;
+        struct NameIndexEntry *names = realloc(index->names, capacity * sizeof(struct NameIndexEntry));
+        if (names == NULL)
+        {
+            index->error = 1;
+            return;
+        }
+        index->names = names;
+        index->capacity = capacity;
+    }
+    if (index->count >= index->bucket_mask + 1)
+        index_rehash(index, (index->bucket_mask + 1) * 2);
+
+    struct NameIndexEntry *entry = &index->names[index->count];
+    entry->name = strdup(name);
+    if (entry->name == NULL)
+    {
+        index->error = 1;
+        return;
+    }
+    entry->hash = name_hash(name);
+    entry->first_cluster = first_cluster;
+    entry->is_directory = is_directory;
+    entry->pos.cluster = cluster;
+    entry->pos.offset = offset;
+
+    unsigned int bucket = entry->hash & index->bucket_mask;
+    entry->hash_next = index->buckets[bucket];
+    index->buckets[bucket] = index->count;
+    index->count++;
+}
+
+// Index of the directory starting at 'dir_cluster', built with one pass over it if needed.
+struct DirIndex *get_dir_index(struct Volume *vol, uint32_t dir_cluster)
+{
+    struct DirIndex *index = NULL;
+    vol->index_tick++;
+
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+    {
+        if (vol->dir_index[i].dir_cluster == dir_cluster)
+        {
+            vol->dir_index[i].last_used = vol->index_tick;
+            return &vol->dir_index[i];
+        }
+        // empty slot, otherwise the least recently used one
+        if (index == NULL || (index->dir_cluster != 0 &&
+            (vol->dir_index[i].dir_cluster == 0 || vol->dir_index[i].last_used < index->last_used)))
+            index = &vol->dir_index[i];
+    }
+
+    dir_index_free(index);
+    index->bucket_mask = 63;
+    index->buckets = malloc(64 * sizeof(int));
+    if (index->buckets == NULL) return NULL;
+    for (int i = 0; i < 64; i++) index->buckets[i] = -1;
+
+    struct DirIterator it;
+    struct ParsedEntry entry;
+
+    dir_open(&it, vol, dir_cluster);
+    it.index = index;
+    while (dir_next(&it, &entry))
+    {
+        index_add_name(index, entry.name, entry.first_cluster, entry.is_directory, entry.cluster, entry.offset);
+        if (!sfn_set_add(&index->sfns, entry.sfn)) index->error = 1;
+    }
+
+    if (index->error)
+    {
+        dir_index_free(index);
+        return NULL;
+    }
+    index->end = it.end;
+    index->dir_cluster = dir_cluster;
+    index->last_used = vol->index_tick;
+    return index;
+}
+
+const struct NameIndexEntry *index_find(const struct DirIndex *index, const char *name)
+{
+    uint32_t hash = name_hash(name);
+    for (int i = index->buckets[hash & index->bucket_mask]; i >= 0; i = index->names[i].hash_next)
+    {
+        if (index->names[i].hash == hash && name_equal(index->names[i].name, name))
+            return &index->names[i];
+    }
+    return NULL;
+}
+
+// Looks 'name' up in a directory (case-insensitive), NULL if it is not there.
+const struct NameIndexEntry *dir_lookup(struct Volume *vol, uint32_t dir_cluster, const char *name)
+{
+    struct DirIndex *index = get_dir_index(vol, dir_cluster);
+    if (index) return index_find(index, name);
+
+    // no memory for the index: plain scan
+    static __thread struct NameIndexEntry found;
+    struct DirIterator it;
+    struct ParsedEntry entry;
+
+    dir_open(&it, vol, dir_cluster);
+    while (dir_next(&it, &entry))
+    {
+        if (name_equal(entry.name, name))
+        {
+            found.name = NULL;
+            found.first_cluster = entry.first_cluster;
+            found.is_directory = entry.is_directory;
+            found.pos.cluster = entry.cluster;
+            found.pos.offset = entry.offset;
+            return &found;
+        }
+    }
+    return NULL;
+}
+
+static int slots_adjacent(struct Volume *vol, const struct SlotPos *a, const struct SlotPos *b)
+{
+    if (a->cluster == b->cluster) return b->offset == a->offset + DIR_ENTRY_SIZE;
+    return a->offset + DIR_ENTRY_SIZE == vol->cluster_size && b->offset == 0 && next_cluster(vol, a->cluster) == b->cluster;
+}
+
+// first 'count' deleted slots in a row, -1 if there are none
+static int find_hole_run(struct Volume *vol, const struct DirIndex *index, unsigned int count)
+{
+    unsigned int run = 0;
+    for (unsigned int i = 0; i < index->hole_count; i++)
+    {
+        if (run > 0 && !slots_adjacent(vol, &index->holes[i - 1], &index->holes[i])) run = 0;
+        if (++run == count) return i + 1 - count;
+    }
+    return -1;
+}
+
+// Writes 'count' entries (LFN run + SFN) for 'name' into a run of deleted slots of the
+// directory, or after its last entry (the run may cross a cluster border). The directory
+// grows by a cluster when it is full. The name index is updated, not rebuilt.
+// Returns 1 and the position of the SFN entry, 0 if there is no space left.
+int dir_add_entries(struct Volume *vol, uint32_t dir_cluster, const char *name, const uint8_t *entries,
+                    unsigned int count, uint32_t *entry_cluster, unsigned int *entry_offset)
+{
+    claim_directory(vol, dir_cluster);
+    struct DirIndex *index = get_dir_index(vol, dir_cluster);
+    if (index == NULL) return 0;
+
+    struct SlotPos pos;
+    int hole = find_hole_run(vol, index, count);
+
+    if (hole >= 0)
+    {
+        pos = index->holes[hole];
+    }
+    else
+    {
+        // after the last entry: make sure the chain is long enough first
+        pos = index->end;
+        uint32_t cluster = pos.cluster;
+        unsigned int offset = pos.offset;
+
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (offset >= vol->cluster_size)
+            {
+                uint32_t next = next_cluster(vol, cluster);
+                if (next == 0) next = extend_directory(vol, cluster);
+                if (next == 0) return 0;
+                if (i == 0) pos.cluster = next, pos.offset = 0;
+                cluster = next;
+                offset = 0;
+            }
+            offset += DIR_ENTRY_SIZE;
+        }
+        index->end.cluster = cluster;
+        index->end.offset = offset;
+    }
+
+    uint32_t cluster = pos.cluster;
+    unsigned int offset = pos.offset;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (offset >= vol->cluster_size)
+        {
+            cluster = next_cluster(vol, cluster);
+            offset = 0;
+        }
+        uint8_t *data = get_cluster(vol, cluster);
+        memcpy(&data[offset], &entries[i * DIR_ENTRY_SIZE], DIR_ENTRY_SIZE);
+        put_cluster(vol, cluster, data);
+
+        *entry_cluster = cluster;
+        *entry_offset = offset;
+        offset += DIR_ENTRY_SIZE;
+    }
+
+    if (hole >= 0)
+    {
+        index->hole_count -= count;
+        memmove(&index->holes[hole], &index->holes[hole + count], (index->hole_count - hole) * sizeof(struct SlotPos));
+    }
+
+    const uint8_t *sfn = &entries[(count - 1) * DIR_ENTRY_SIZE];
+    index_add_name(index, name, sfn_first_cluster(sfn), (sfn[11] & 0x10) ? 1 : 0, *entry_cluster, *entry_offset);
+    if (!sfn_set_add(&index->sfns, sfn)) index->error = 1;
+    if (index->error) dir_index_free(index); // rebuilt on the next use
+    return 1;
+}
+
+// "/a/b/" -> "/a/", "/a/" -> "/"
+void trim_to_parent(char *path)
+{
+    int len = strlen(path);
+    for (int i = len - 2; i >= 0; i--)
+    {
+        if (i == 0)
+        {
+            path[1] = '\0';
+            break;
+        }
+        if (path[i] == '/')
+        {
+            path[i + 1] = '\0';
+            break;
+        }
+    }
+}
+
+void drop_dentries(struct Volume *vol)
+{
+    if (vol->dentries == NULL) vol->dentries = malloc(DENTRY_CACHE_SIZE * sizeof(struct Dentry));
+    if (vol->dentries == NULL) return;
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++) vol->dentries[i].parent = 0;
+}
+
+static inline struct Dentry *dentry_slot(struct Volume *vol, uint32_t dir, uint32_t hash)
+{
+    if (vol->dentries == NULL) return NULL;
+    return &vol->dentries[(hash ^ (dir * 2654435761u)) & (DENTRY_CACHE_SIZE - 1)];
+}
+
+// One path component in a directory: dentry cache first, then the directory's name index.
+// '..' is read from the real '..' entry (0 there means the root).
+static int find_entry(struct Volume *vol, uint32_t dir, const char *name, uint32_t *cluster,
+                      unsigned char *is_directory, const char **stored_name)
+{
+    uint32_t hash = name_hash(name);
+    struct Dentry *dentry = dentry_slot(vol, dir, hash);
+    if (dentry)
+    {
+        if (dentry->parent == dir && dentry->hash == hash && name_equal(dentry->name, name))
+        {
+            *cluster = dentry->cluster;
+            *is_directory = dentry->is_directory;
+            if (stored_name) *stored_name = dentry->name;
+            return FS_OK;
+        }
+    }
+
+    const struct NameIndexEntry *entry = dir_lookup(vol, dir, name);
+    if (entry == NULL) return FS_NOT_FOUND;
+
+    *cluster = entry->first_cluster;
+    *is_directory = entry->is_directory;
+    if (*cluster == 0 && entry->is_directory) *cluster = vol->bpb.root_cluster; // '..' of a top-level folder
+
+    if (dentry)
+    {
+        dentry->parent = dir;
+        dentry->hash = hash;
+        dentry->cluster = *cluster;
+        dentry->is_directory = *is_directory;
+        snprintf(dentry->name, sizeof(dentry->name), "%s", entry->name ? entry->name : name);
+    }
+    if (stored_name) *stored_name = dentry ? dentry->name : name;
+    return FS_OK;
+}
+
+int lookup_entry(struct Volume *vol, uint32_t dir, const char *name, uint32_t *cluster,
+                 unsigned char *is_directory, const char **stored_name)
+{
+    if (strcmp(name, ".") == 0)
+    {
+        *cluster = dir;
+        *is_directory = 1;
+        if (stored_name) *stored_name = ".";
+        return FS_OK;
+    }
+
+    lock_directory(vol, dir);
+    int err = find_entry(vol, dir, name, cluster, is_directory, stored_name);
+    unlock_directory(vol, dir);
+    return err;
+}
+
+// Resolves an absolute or relative (to 'cwd') path with any number of components.
+// If 'display' is given it holds the current path as shown in the prompt and is
+// changed along the way ('..' drops a component).
+int resolve_path(struct Volume *vol, uint32_t cwd, const char *path, uint32_t *cluster,
+                 unsigned char *is_directory, char *display, size_t display_size)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", path);
+
+    uint32_t current = cwd;
+    unsigned char current_is_dir = 1;
+    if (buf[0] == '/')
+    {
+        current = vol->bpb.root_cluster;
+        if (display) snprintf(display, display_size, "/");
+    }
+
+    char *saveptr;
+    for (char *name = strtok_r(buf, "/", &saveptr); name; name = strtok_r(NULL, "/", &saveptr))
+    {
+        if (!current_is_dir) return FS_NOT_DIR;
+
+        const char *stored_name;
+        int err = lookup_entry(vol, current, name, &current, &current_is_dir, &stored_name);
+        if (err < 0) return err;
+
+        if (display && strcmp(name, ".") != 0)
+        {
+            if (strcmp(name, "..") == 0)
+                trim_to_parent(display);
+            else if (strlen(display) + strlen(stored_name) + 2 <= display_size)
+                strcat(strcat(display, stored_name), "/");
+        }
+    }
+
+    *cluster = current;
+    *is_directory = current_is_dir;
+    return FS_OK;
+}
+
+// Splits "a/b/name" into the directory it is in ('parent' cluster) and 'name'.
+int resolve_parent(struct Volume *vol, uint32_t cwd, const char *path, uint32_t *parent, char *name, size_t name_size)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", path);
+
+    size_t len = strlen(buf);
+    while (len > 1 && buf[len - 1] == '/') buf[--len] = '\0';
+
+    char *slash = strrchr(buf, '/');
+    const char *last = slash ? slash + 1 : buf;
+    uint16_t units[MAX_LFN_UNITS];
+    if (last[0] == '\0' || strcmp(last, ".") == 0 || strcmp(last, "..") == 0 || strlen(last) >= name_size ||
+        utf8_to_utf16(last, units, MAX_LFN_UNITS) < 0)
+        return FS_INVALID;
+    snprintf(name, name_size, "%s", last);
+
+    if (slash == NULL)
+    {
+        *parent = cwd;
+        return FS_OK;
+    }
+
+    *(slash + 1) = '\0'; // keep the leading '/' of "/name"
+    unsigned char is_directory;
+    int err = resolve_path(vol, cwd, buf, parent, &is_directory, NULL, 0);
+    if (err < 0) return err;
+    return is_directory ? FS_OK : FS_NOT_DIR;
+}
+
+// Creates folder 'name' in the directory 'parent', returns its cluster or an error.
+int make_directory(struct Volume *vol, uint32_t parent, char *name)
+{
+    if (dir_lookup(vol, parent, name)) return FS_EXISTS;
+
+    // 1. Take free cluster, starting from the FSInfo hint (marked as EOF)
+    int free_cluster = allocate_cluster(vol, &vol->fsinfo);
+    if (free_cluster < 0) return FS_NO_SPACE;
+
+    // 2. Create folder entries, the short name unique in the parent
+    struct DirIndex *index = get_dir_index(vol, parent);
+    uint8_t entries[MAX_NAME_ENTRIES * DIR_ENTRY_SIZE];
+    int slots = create_folder(name, index ? &index->sfns : NULL, entries, free_cluster);
+    if (slots < 0)
+    {
+        release_cluster(vol, &vol->fsinfo, free_cluster);
+        return slots;
+    }
+
+    // 3. AND add them to the parent directory (it grows if it is full)
+    uint32_t entry_cluster;
+    unsigned int entry_offset;
+    if (!dir_add_entries(vol, parent, name, entries, slots, &entry_cluster, &entry_offset))
+    {
+        release_cluster(vol, &vol->fsinfo, free_cluster);
+        return FS_DIR_FULL;
+    }
+
+    // 4. init '.' and '..'
+    uint8_t *new_folder_cluster = new_cluster(vol, free_cluster);
+    init_root_directory(new_folder_cluster, free_cluster, dotdot_cluster(vol, parent));
+    put_cluster(vol, free_cluster, new_folder_cluster);
+
+    return free_cluster;
+}
+
+// mkdir [-p]: with 'parents' missing folders on the way are created, and an existing
+// folder at the end is not an error. Returns the cluster of the last folder.
+int make_directories(struct Volume *vol, uint32_t cwd, const char *path, int parents)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s", path);
+
+    uint32_t current = (buf[0] == '/') ? vol->bpb.root_cluster : cwd;
+    int created = 0;
+
+    char *saveptr;
+    char *name = strtok_r(buf, "/", &saveptr);
+    if (name == NULL) return FS_INVALID;
+
+    while (name)
+    {
+        char *next = strtok_r(NULL, "/", &saveptr);
+
+        uint32_t cluster;
+        unsigned char is_directory;
+        int err = lookup_entry(vol, current, name, &cluster, &is_directory, NULL);
+
+        if (err == FS_OK)
+        {
+            if (!is_directory) return FS_NOT_DIR;
+            if (next == NULL && !parents) return FS_EXISTS;
+            current = cluster;
+        }
+        else if (next == NULL || parents)
+        {
+            int new_dir = make_directory(vol, current, name);
+            if (new_dir < 0) return new_dir;
+            current = new_dir;
+            created = 1;
+        }
+        else
+        {
+            return err;
+        }
+        name = next;
+    }
+    return created || parents ? (int)current : FS_EXISTS;
+}
+
+// Creates the empty file 'name': size 0 and no chain (first cluster 0), as populate and
+// store_file() make empty files. Returns FS_OK or an error.
+int create_file(struct Volume *vol, uint32_t parent, char *name)
+{
+    if (dir_lookup(vol, parent, name)) return FS_EXISTS;
+
+    struct DirIndex *index = get_dir_index(vol, parent);
+    uint8_t entries[MAX_NAME_ENTRIES * DIR_ENTRY_SIZE];
+    int slots = create_file_entry(name, index ? &index->sfns : NULL, entries, 0, 0);
+    if (slots < 0) return slots;
+
+    uint32_t entry_cluster;
+    unsigned int entry_offset;
+    if (!dir_add_entries(vol, parent, name, entries, slots, &entry_cluster, &entry_offset)) return FS_DIR_FULL;
+    return FS_OK;
+}
+
+static int find_file_entry(struct Volume *vol, struct FileRef *file)
+{
+    const struct NameIndexEntry *entry = dir_lookup(vol, file->parent, file->name);
+    if (entry == NULL) return FS_NOT_FOUND;
+    if (entry->is_directory) return FS_IS_DIR;
+
+    file->first_cluster = entry->first_cluster;
+    file->pos = entry->pos;
+    file->size = get_le32(get_cluster(vol, entry->pos.cluster) + entry->pos.offset + 28);
+    return FS_OK;
+}
+
+int lookup_file(struct Volume *vol, struct FileRef *file)
+{
+    lock_directory(vol, file->parent);
+    int err = find_file_entry(vol, file);
+    unlock_directory(vol, file->parent);
+    return err;
+}
+
+int find_file(struct Volume *vol, uint32_t cwd, const char *path, struct FileRef *file)
+{
+    int err = resolve_parent(vol, cwd, path, &file->parent, file->name, sizeof(file->name));
+    return (err < 0) ? err : lookup_file(vol, file);
+}
+
+// Points the SFN entry of 'file' to new contents; the name index and dentry cache follow.
+static void set_file_data(struct Volume *vol, struct FileRef *file, uint32_t first_cluster, uint32_t size)
+{
+    claim_directory(vol, file->parent);
+    uint8_t *data = get_cluster(vol, file->pos.cluster);
+    uint8_t *entry = data + file->pos.offset;
+    put_le16(entry + 20, (first_cluster >> 16) & 0xFFFF);
+    put_le16(entry + 26, first_cluster & 0xFFFF);
+    put_le32(entry + 28, size);
+    put_cluster(vol, file->pos.cluster, data);
+
+    struct NameIndexEntry *indexed = (struct NameIndexEntry *)dir_lookup(vol, file->parent, file->name);
+    if (indexed) indexed->first_cluster = first_cluster;
+
+    struct Dentry *dentry = dentry_slot(vol, file->parent, name_hash(file->name));
+    if (dentry && dentry->parent == file->parent && name_equal(dentry->name, file->name))
+        dentry->cluster = first_cluster;
+
+    file->first_cluster = first_cluster;
+    file->size = size;
+}
+
+#define TRANSFER_CHUNK (1 << 20)
+
+// Moves 'length' bytes between a host descriptor and the image at 'offset' (host -> image
+// if 'to_image'), past the cluster cache. 'fd_offset' is the position in the host file and
+// moves along; NULL for pipes and terminals. In the kernel where possible: copy_file_range()
+// between regular files, then sendfile(), then plain reads and writes.
+static int transfer(struct Volume *vol, int fd, loff_t *fd_offset, long offset, size_t length, int to_image)
+{
+    if (to_image) count_write(vol, offset, length); else count_read(vol, offset, length);
+
+    if (vol->map)
+    {
+        // the mapping is the buffer: one read() or write() per run
+        uint8_t *p = vol->map + offset;
+        if (to_image) mark_dirty(vol, offset, length);
+        while (length > 0)
+        {
+            ssize_t n;
+            if (to_image)
+                n = fd_offset ? pread(fd, p, length, *fd_offset) : read(fd, p, length);
+            else
+                n = fd_offset ? pwrite(fd, p, length, *fd_offset) : write(fd, p, length);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return FS_IO;
+            p += n;
+            length -= n;
+            if (fd_offset) *fd_offset += n;
+        }
+        return FS_OK;
+    }
+
+    // stdio may hold buffered data of the same range: written out and dropped here
+    int image_fd = fileno(vol->file);
+    if (!vol->shared) fflush(vol->file);
+    loff_t image_offset = offset;
+
+    while (length > 0 && fd_offset)
+    {
+        ssize_t n = to_image ? copy_file_range(fd, fd_offset, image_fd, &image_offset, length, 0)
+                             : copy_file_range(image_fd, &image_offset, fd, fd_offset, length, 0);
+        if (n <= 0) break; // not supported here (other file system, pipe...), try the next way
+        length -= n;
+    }
+
+    while (length > 0)
+    {
+        ssize_t n;
+        if (to_image)
+        {
+            // sendfile() writes at the current position of the image
+            if (lseek(image_fd, image_offset, SEEK_SET) < 0) break;
+            n = sendfile(image_fd, fd, fd_offset, length);
+        }
+        else
+        {
+            if (fd_offset && lseek(fd, *fd_offset, SEEK_SET) < 0) break;
+            n = sendfile(fd, image_fd, &image_offset, length);
+            if (n > 0 && fd_offset) *fd_offset += n;
+        }
+        if (n <= 0) break;
+        if (to_image) image_offset += n;
+        length -= n;
+    }
+
+    if (length == 0) return FS_OK;
+
+    uint8_t *buffer = malloc(TRANSFER_CHUNK);
+    if (buffer == NULL) return FS_IO;
+    int err = FS_OK;
+    while (length > 0 && err == FS_OK)
+    {
+        size_t chunk = length < TRANSFER_CHUNK ? length : TRANSFER_CHUNK;
+        int in_fd = to_image ? fd : image_fd, out_fd = to_image ? image_fd : fd;
+        loff_t *in_offset = to_image ? fd_offset : &image_offset;
+        loff_t *out_offset = to_image ? &image_offset : fd_offset;
+
+        ssize_t n = in_offset ? pread(in_fd, buffer, chunk, *in_offset) : read(in_fd, buffer, chunk);
+        if (n <= 0)
+        {
+            err = FS_IO;
+            break;
+        }
+        for (ssize_t done = 0; done < n; )
+        {
+            ssize_t w = out_offset ? pwrite(out_fd, buffer + done, n - done, *out_offset + done)
+                                   : write(out_fd, buffer + done, n - done);
+            if (w <= 0)
+            {
+                err = FS_IO;
+                break;
+            }
+            done += w;
+        }
+        if (in_offset) *in_offset += n;
+        if (out_offset) *out_offset += n;
+        length -= n;
+    }
+    free(buffer);
+    return err;
+}
+
+// Writes 'size' bytes (from 'buf', or from the host descriptor if 'buf' is NULL) into the
+// chain starting at 'first', one transfer per contiguous run. The rest of the last
+// cluster is zeroed.
+static int write_chain(struct Volume *vol, uint32_t first, int fd, loff_t *fd_offset, const uint8_t *buf, uint64_t size)
+{
+    uint32_t cluster = first;
+    uint64_t done = 0;
+
+    while (done < size)
+    {
+        if (cluster == 0) return FS_IO; // chain is shorter than the data
+
+        uint32_t next;
+        unsigned int run = chain_run(vol, cluster, (size - done + vol->cluster_size - 1) / vol->cluster_size, &next);
+        uint64_t run_bytes = (uint64_t)run * vol->cluster_size;
+        uint64_t length = (size - done < run_bytes) ? size - done : run_bytes;
+        long offset = cluster_offset(vol, cluster);
+
+        if (!vol->map) cache_sync_range(vol, &vol->cache, cluster, run, 1);
+        if (buf)
+            write_bytes(vol, offset, buf + done, length);
+        else if (transfer(vol, fd, fd_offset, offset, length, 1) < 0)
+            return FS_IO;
+
+        if (length < run_bytes)
+        {
+            uint8_t *zero = calloc(1, run_bytes - length);
+            write_bytes(vol, offset + length, zero, run_bytes - length);
+            free(zero);
+        }
+
+        done += length;
+        cluster = next;
+    }
+    return FS_OK;
+}
+
+#define AIO_CHUNK (256 * 1024)
+#define AIO_WINDOW 16              // chunks read by one batch
+
+// read_file() of a fragmented file: its runs are cut into chunks and read by batches of
+// AIO_WINDOW chunks in flight at once, while the chunks of the previous batch are written to
+// the host (in the same batch if 'fd' is seekable).
+static int read_file_async(struct Volume *vol, const struct FileRef *file, int fd, loff_t *fd_offset)
+{
+    unsigned int window = vol->aio.depth < AIO_WINDOW ? vol->aio.depth : AIO_WINDOW;
+    uint8_t *buffers = malloc((size_t)2 * window * AIO_CHUNK);
+    struct AioRequest *reqs = malloc(2 * window * sizeof(struct AioRequest));
+    size_t lengths[2][AIO_WINDOW];
+    unsigned int set = 0, pending = 0;
+    uint32_t cluster = file->first_cluster;
+    uint64_t planned = 0, run_left = 0;
+    long run_offset = 0;
+    int err = (buffers && reqs) ? FS_OK : FS_IO;
+
+    while (err == FS_OK)
+    {
+        unsigned int n = 0, reads = 0;
+
+        // what the previous batch has read
+        for (unsigned int j = 0; j < pending && fd_offset; j++)
+        {
+            struct AioRequest *req = &reqs[n++];
+            req->write = 1;
+            req->fd = fd;
+            req->offset = *fd_offset;
+            req->iov[0].iov_base = buffers + ((size_t)(set ^ 1) * window + j) * AIO_CHUNK;
+            req->iov[0].iov_len = lengths[set ^ 1][j];
+            req->iovcnt = 1;
+            *fd_offset += lengths[set ^ 1][j];
+        }
+
+        for (; reads < window && planned < file->size; reads++)
+        {
+            if (run_left == 0)
+            {
+                if (cluster < 2 || cluster > vol->total_clusters + 1)
+                {
+                    err = FS_IO;
+                    break;
+                }
+                uint32_t next;
+                unsigned int run = chain_run(vol, cluster, (file->size - planned + vol->cluster_size - 1) / vol->cluster_size, &next);
+                uint64_t run_bytes = (uint64_t)run * vol->cluster_size;
+                cache_sync_range(vol, &vol->cache, cluster, run, 0);
+                run_offset = cluster_offset(vol, cluster);
+                run_left = (file->size - planned < run_bytes) ? file->size - planned : run_bytes;
+                cluster = next;
+            }
+
+            size_t length = run_left < AIO_CHUNK ? run_left : AIO_CHUNK;
+            struct AioRequest *req = &reqs[n++];
+            req->write = 0;
+            req->fd = fileno(vol->file);
+            req->offset = run_offset;
+            req->iov[0].iov_base = buffers + ((size_t)set * window + reads) * AIO_CHUNK;
+            req->iov[0].iov_len = length;
+            req->iovcnt = 1;
+            count_read(vol, run_offset, length);
+            lengths[set][reads] = length;
+            run_offset += length;
+            run_left -= length;
+            planned += length;
+        }
+
+        if (err != FS_OK || (n == 0 && pending == 0)) break;
+        if (image_aio(vol, reqs, n) > 0) err = FS_IO;
+
+        // pipes and terminals: in order, after the batch
+        for (unsigned int j = 0; j < pending && !fd_offset && err == FS_OK; j++)
+        {
+            uint8_t *p = buffers + ((size_t)(set ^ 1) * window + j) * AIO_CHUNK;
+            for (size_t done = 0; done < lengths[set ^ 1][j]; )
+            {
+                ssize_t w = write(fd, p + done, lengths[set ^ 1][j] - done);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0)
+                {
+                    err = FS_IO;
+                    break;
+                }
+                done += w;
+            }
+        }
+
+        pending = reads;
+        set ^= 1;
+    }
+
+    free(buffers);
+    free(reqs);
+    return err;
+}
+
+// Copies the contents of 'file' to a host descriptor, one transfer per contiguous run;
+// without --mmap a fragmented file goes through the asynchronous reader.
+static int read_contents(struct Volume *vol, const struct FileRef *file, int fd, loff_t *fd_offset)
+{
+    uint32_t cluster = file->first_cluster;
+    uint64_t done = 0;
+
+    if (!vol->map && file->size > 0 && cluster >= 2 && cluster <= vol->total_clusters + 1)
+    {
+        uint32_t next;
+        unsigned int clusters = (file->size + vol->cluster_size - 1) / vol->cluster_size;
+        if (chain_run(vol, cluster, clusters, &next) < clusters) return read_file_async(vol, file, fd, fd_offset);
+    }
+
+    while (done < file->size)
+    {
+        if (cluster < 2 || cluster > vol->total_clusters + 1) return FS_IO;
+
+        uint32_t next;
+        unsigned int run = chain_run(vol, cluster, (file->size - done + vol->cluster_size - 1) / vol->cluster_size, &next);
+        uint64_t run_bytes = (uint64_t)run * vol->cluster_size;
+        uint64_t length = (file->size - done < run_bytes) ? file->size - done : run_bytes;
+
+        if (!vol->map) cache_sync_range(vol, &vol->cache, cluster, run, 0);
+        if (transfer(vol, fd, fd_offset, cluster_offset(vol, cluster), length, 0) < 0) return FS_IO;
+
+        done += length;
+        cluster = next;
+    }
+    return FS_OK;
+}
+
+int read_file(struct Volume *vol, const struct FileRef *file, int fd, loff_t *fd_offset)
+{
+    if (vol->shared == NULL) return read_contents(vol, file, fd, fd_offset);
+
+    // a view reads under the lock of the directory, and the file may have been replaced
+    // since 'file' was looked up: its entry is read again
+    struct FileRef current = *file;
+    lock_directory(vol, file->parent);
+    int err = find_file_entry(vol, &current);
+    if (err == FS_OK) err = read_contents(vol, &current, fd, fd_offset);
+    unlock_directory(vol, file->parent);
+    return err;
+}
+
+// Creates or replaces the file 'path' with 'size' bytes from 'buf' or, if 'buf' is NULL,
+// from the host descriptor. The data gets a new chain of as few extents as possible; an
+// old chain is released only after the new contents are in place.
+int store_file(struct Volume *vol, uint32_t cwd, const char *path, int fd, loff_t *fd_offset,
+               const uint8_t *buf, uint64_t size)
+{
+    struct FileRef file;
+    int err = resolve_parent(vol, cwd, path, &file.parent, file.name, sizeof(file.name));
+    if (err < 0) return err;
+
+    err = lookup_file(vol, &file);
+    if (err < 0 && err != FS_NOT_FOUND) return err;
+    int exists = (err == FS_OK);
+
+    if (size > 0xFFFFFFFFULL) return FS_TOO_BIG;
+    unsigned int clusters = (size + vol->cluster_size - 1) / vol->cluster_size;
+
+    int first = 0;
+    if (clusters > 0)
+    {
+        first = allocate_chain(vol, &vol->fsinfo, clusters);
+        if (first < 0) return FS_NO_SPACE;
+
+        err = write_chain(vol, first, fd, fd_offset, buf, size);
+        if (err < 0)
+        {
+            free_chain(vol, &vol->fsinfo, first);
+            return err;
+        }
+    }
+
+    if (exists)
+    {
+        uint32_t old = file.first_cluster;
+        set_file_data(vol, &file, first, size);
+        if (old) free_chain(vol, &vol->fsinfo, old);
+        return FS_OK;
+    }
+
+    struct DirIndex *index = get_dir_index(vol, file.parent);
+    uint8_t entries[MAX_NAME_ENTRIES * DIR_ENTRY_SIZE];
+    int slots = create_file_entry(file.name, index ? &index->sfns : NULL, entries, first, size);
+    if (slots < 0)
+    {
+        if (first) free_chain(vol, &vol->fsinfo, first);
+        return slots;
+    }
+
+    uint32_t entry_cluster;
+    unsigned int entry_offset;
+    if (!dir_add_entries(vol, file.parent, file.name, entries, slots, &entry_cluster, &entry_offset))
+    {
+        if (first) free_chain(vol, &vol->fsinfo, first);
+        return FS_DIR_FULL;
+    }
+    return FS_OK;
+}
+
+// ---- removing files and directories ----
+
+#define REMOVE_MAX_DEPTH 512       // deeper than a 1024-byte path goes: a directory loop
+
+// The slot before 'pos' in the directory chain that starts at 'dir'; 0 at its start.
+static int previous_slot(struct Volume *vol, uint32_t dir, struct SlotPos *pos)
+{
+    if (pos->offset > 0)
+    {
+        pos->offset -= DIR_ENTRY_SIZE;
+        return 1;
+    }
+    uint32_t cluster = dir;
+    for (unsigned int left = vol->total_clusters; cluster != 0 && left > 0; left--)
+    {
+        uint32_t next = next_cluster(vol, cluster);
+        if (next == pos->cluster)
+        {
+            pos->cluster = cluster;
+            pos->offset = vol->cluster_size - DIR_ENTRY_SIZE;
+            return 1;
+        }
+        cluster = next;
+    }
+    return 0;
+}
+
+// Marks the entry whose SFN is at 'sfn_pos' deleted (0xE5), with the LFN parts right
+// before it that belong to it (sequence 1, 2, ... up to the last one, same checksum).
+// The freed slots go to the directory's index as holes.
+static void delete_entry(struct Volume *vol, uint32_t dir, struct SlotPos sfn_pos)
+{
+    struct SlotPos slots[MAX_NAME_ENTRIES];
+    unsigned int count = 0;
+    uint8_t *data = get_cluster(vol, sfn_pos.cluster);
+    unsigned char checksum = sfn_checksum(&data[sfn_pos.offset]);
+
+    slots[count++] = sfn_pos;
+    struct SlotPos pos = sfn_pos;
+    while (count <= MAX_LFN_ENTRIES && previous_slot(vol, dir, &pos))
+    {
+        const uint8_t *entry = get_cluster(vol, pos.cluster) + pos.offset;
+        if (entry[11] != 0x0F || entry[13] != checksum || (entry[0] & 0x1F) != count) break;
+        slots[count++] = pos;
+        if (entry[0] & 0x40) break;
+    }
+
+    struct DirIndex *index = NULL;
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+        if (vol->dir_index[i].dir_cluster == dir) index = &vol->dir_index[i];
+
+    // in chain order, as the holes of the index are
+    for (unsigned int i = count; i-- > 0; )
+    {
+        data = get_cluster(vol, slots[i].cluster);
+        data[slots[i].offset] = 0xE5;
+        put_cluster(vol, slots[i].cluster, data);
+        if (index) index_add_hole(index, slots[i].cluster, slots[i].offset);
+    }
+    if (index && index->error) dir_index_free(index);
+}
+
+// Takes 'name' out of the index of 'dir' (if there is one); the last name moves into its place.
+static void unindex_name(struct Volume *vol, uint32_t dir, const char *name)
+{
+    struct DirIndex *index = NULL;
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+        if (vol->dir_index[i].dir_cluster == dir) index = &vol->dir_index[i];
+    if (index == NULL) return;
+
+    uint32_t hash = name_hash(name);
+    int *link = &index->buckets[hash & index->bucket_mask];
+    while (*link >= 0 && !(index->names[*link].hash == hash && name_equal(index->names[*link].name, name)))
+        link = &index->names[*link].hash_next;
+    if (*link < 0) return;
+
+    int i = *link;
+    *link = index->names[i].hash_next;
+    free(index->names[i].name);
+
+    int last = --index->count;
+    if (i != last)
+    {
+        index->names[i] = index->names[last];
+        link = &index->buckets[index->names[i].hash & index->bucket_mask];
+        while (*link != last) link = &index->names[*link].hash_next;
+        *link = i;
+    }
+    // the short name stays in 'sfns': a new alias just skips it
+}
+
+// Forgets the index of a directory that is gone; its cluster may be a new directory soon.
+static void drop_dir_index(struct Volume *vol, uint32_t dir)
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++)
+        if (vol->dir_index[i].dir_cluster == dir) dir_index_free(&vol->dir_index[i]);
+}
+
+// Is 'cluster' the start of a directory: a live chain whose first entry is its '.'.
+int is_directory_start(struct Volume *vol, uint32_t cluster)
+{
+    if (cluster < 2 || cluster > vol->total_clusters + 1 || get_fat_entry(vol, cluster) == 0) return 0;
+    const uint8_t *entry = get_cluster(vol, cluster);
+    return entry[0] == '.' && entry[1] == ' ' && (entry[11] & 0x10) && sfn_first_cluster(entry) == cluster;
+}
+
+// Frees everything below directory 'dir' (not its own chain). The entries in it are not
+// touched, the directory goes as a whole.
+static int remove_contents(struct Volume *vol, uint32_t dir, struct RemoveCount *removed, unsigned int depth)
+{
+    if (depth > REMOVE_MAX_DEPTH) return FS_INVALID;
+    claim_directory(vol, dir);
+    drop_dir_index(vol, dir);
+
+    struct DirIterator it;
+    struct ParsedEntry pe;
+    dir_open(&it, vol, dir);
+    while (dir_next(&it, &pe))
+    {
+        if (pe.sfn[0] == '.') continue; // '.' and '..'
+        if (pe.is_directory)
+        {
+            if (!is_directory_start(vol, pe.first_cluster) || pe.first_cluster == dir) continue;
+            int err = remove_contents(vol, pe.first_cluster, removed, depth + 1);
+            if (err < 0) return err;
+            removed->directories++;
+        }
+        else
+        {
+            removed->files++;
+        }
+        if (pe.first_cluster >= 2) removed->clusters += free_chain(vol, &vol->fsinfo, pe.first_cluster);
+    }
+    return FS_OK;
+}
+
+// rm, rm -r and rmdir: removes the entry 'path' (its LFN run and SFN become 0xE5) and frees
+// its chain. A directory goes only with REMOVE_DIR (if it is empty) or REMOVE_TREE (with
+// everything in it). 'removed' (may be NULL) adds up what was freed.
+int remove_path(struct Volume *vol, uint32_t cwd, const char *path, enum RemoveMode mode, struct RemoveCount *removed)
+{
+    struct RemoveCount count = {0};
+    uint32_t parent;
+    char name[MAX_NAME_BYTES];
+    int err = resolve_parent(vol, cwd, path, &parent, name, sizeof(name));
+    if (err < 0) return err;
+
+    claim_directory(vol, parent);
+    const struct NameIndexEntry *entry = dir_lookup(vol, parent, name);
+    if (entry == NULL) return FS_NOT_FOUND;
+
+    uint32_t first = entry->first_cluster;
+    struct SlotPos pos = entry->pos;
+    char stored[MAX_NAME_BYTES];
+    snprintf(stored, sizeof(stored), "%s", entry->name ? entry->name : name);
+
+    if (entry->is_directory)
+    {
+        if (mode == REMOVE_FILE) return FS_IS_DIR;
+        if (first < 2 || first == vol->bpb.root_cluster) return FS_INVALID;
+
+        if (mode == REMOVE_DIR)
+        {
+            struct DirIterator it;
+            struct ParsedEntry pe;
+            dir_open(&it, vol, first);
+            while (dir_next(&it, &pe))
+                if (pe.sfn[0] != '.') return FS_NOT_EMPTY;
+            claim_directory(vol, first);
+            drop_dir_index(vol, first);
+        }
+        else
+        {
+            err = remove_contents(vol, first, &count, 0);
+            if (err < 0) return err;
+        }
+        count.directories++;
+        drop_dentries(vol); // names below it must not be found any more
+    }
+    else
+    {
+        if (mode == REMOVE_DIR) return FS_NOT_DIR;
+        count.files++;
+
+        struct Dentry *dentry = dentry_slot(vol, parent, name_hash(name));
+        if (dentry && dentry->parent == parent && name_equal(dentry->name, name)) dentry->parent = 0;
+    }
+
+    delete_entry(vol, parent, pos);
+    unindex_name(vol, parent, stored);
+    if (first >= 2) count.clusters += free_chain(vol, &vol->fsinfo, first);
+
+    if (removed)
+    {
+        removed->files += count.files;
+        removed->directories += count.directories;
+        removed->clusters += count.clusters;
+    }
+    return FS_OK;
+}
+
+// Punches every free cluster run out of the image, so the host file takes space only for
+// what is in use. Returns the number of clusters; 'runs' gets the number of runs.
+unsigned long compact_volume(struct Volume *vol, unsigned long *runs)
+{
+    sync_volume(vol); // nothing cached may be written into a hole later
+    unsigned long clusters = 0;
+    *runs = 0;
+    uint32_t last = vol->total_clusters + 1;
+    for (int start = find_free_run(vol, 2, last, 1); start >= 0; )
+    {
+        unsigned int length = free_run_length(vol, start);
+        if (!punch_hole(vol, cluster_offset(vol, start), (long)length * vol->cluster_size)) break;
+        clusters += length;
+        (*runs)++;
+        start = (start + length <= last) ? find_free_run(vol, start + length, last, 1) : -1;
+    }
+    vol->discard_count = 0;
+    return clusters;
+}
+
+#define POPULATE_BATCH (8 << 20)   // small files are gathered and written this much at once
+#define POPULATE_SMALL (1 << 20)   // bigger files go to the image on their own
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int plan_add(struct PopulatePlan *plan, const char *host_path, const char *name, int parent)
+{
+    if (plan->count == plan->capacity)
+    {
+        unsigned int capacity = plan->capacity ? plan->capacity * 2 : 256;
+        struct PopulateNode *nodes = realloc(plan->nodes, capacity * sizeof(struct PopulateNode));
+        if (nodes == NULL) return -1;
+        plan->nodes = nodes;
+        plan->capacity = capacity;
+    }
+
+    struct PopulateNode *node = &plan->nodes[plan->count];
+    memset(node, 0, sizeof(*node));
+    node->host_path = strdup(host_path);
+    snprintf(node->name, sizeof(node->name), "%s", name);
+    node->parent = parent;
+    return plan->count++;
+}
+
+// Adds the contents of 'host_dir' (sorted by name, so the image does not depend on the
+// order readdir() gives) with 'parent' as their directory. Only regular files and
+// directories are taken, symlinks and devices are skipped, and so are names FAT can not
+// hold (see below).
+static int plan_scan(struct PopulatePlan *plan, const char *host_dir, int parent, FILE *out)
+{
+    DIR *dir = opendir(host_dir);
+    if (dir == NULL)
+    {
+        perror(host_dir);
+        return FS_IO;
+    }
+
+    char **names = NULL;
+    unsigned int count = 0, capacity = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            names = realloc(names, capacity * sizeof(char *));
+        }
+        names[count++] = strdup(de->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), compare_names);
+
+    // names taken in this directory, compared the way dir_lookup() does: open addressing
+    // over indexes into 'names' (-1 free)
+    unsigned int table_size = 16;
+    while (table_size < count * 2) table_size *= 2;
+    int *taken = malloc(table_size * sizeof(int));
+    for (unsigned int i = 0; taken && i < table_size; i++) taken[i] = -1;
+
+    int err = taken ? FS_OK : FS_NO_SPACE;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        char path[4096];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", host_dir, names[i]);
+        if (err < 0 || lstat(path, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) continue;
+
+        // a name FAT can not hold, or one that is the same as an earlier one but for the
+        // case, is reported and skipped; the rest of the tree is still imported
+        uint16_t units[MAX_LFN_UNITS];
+        if (utf8_to_utf16(names[i], units, MAX_LFN_UNITS) < 0 || !name_is_legal(names[i]))
+        {
+            fprintf(out, "%s: %s (skipped)\n", fs_error(FS_INVALID), path);
+            continue;
+        }
+        unsigned int slot = name_hash(names[i]) & (table_size - 1);
+        while (taken[slot] >= 0 && !name_equal(names[taken[slot]], names[i])) slot = (slot + 1) & (table_size - 1);
+        if (taken[slot] >= 0)
+        {
+            fprintf(out, "%s: %s, as %s (skipped)\n", fs_error(FS_EXISTS), path, names[taken[slot]]);
+            continue;
+        }
+
+        if (S_ISREG(st.st_mode) && (uint64_t)st.st_size > 0xFFFFFFFFULL)
+        {
+            err = FS_TOO_BIG;
+            fprintf(out, "%s: %s\n", fs_error(err), path);
+            continue;
+        }
+        taken[slot] = i;
+
+        int index = plan_add(plan, path, names[i], parent);
+        if (index < 0)
+        {
+            err = FS_NO_SPACE;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            plan->nodes[index].is_directory = 1;
+            plan->directories++;
+            err = plan_scan(plan, path, index, out);
+        }
+        else
+        {
+            plan->nodes[index].size = st.st_size;
+            plan->files++;
+            plan->bytes += st.st_size;
+        }
+    }
+
+    for (unsigned int i = 0; i < count; i++) free(names[i]);
+    free(names);
+    free(taken);
+    return err;
+}
+
+// directory entries (LFN run + SFN) of a node, written into 'entries'
+static int node_entries(struct PopulateNode *node, const struct SfnSet *taken, uint8_t *entries)
+{
+    if (node->is_directory) return create_folder(node->name, taken, entries, node->first_cluster);
+    return create_file_entry(node->name, taken, entries, node->first_cluster, node->size);
+}
+
+// Entries of the children of directory node 'dir', one after another into 'data' (only
+// counted if it is NULL), the short names unique among them. Returns the slots they take.
+static unsigned int node_dir_entries(struct PopulatePlan *plan, unsigned int dir, uint8_t *data)
+{
+    struct SfnSet taken = {0};
+    uint8_t entries[MAX_NAME_ENTRIES * DIR_ENTRY_SIZE];
+    unsigned int slots = 0;
+
+    for (unsigned int j = dir + 1; j < plan->count; j++)
+    {
+        if (plan->nodes[j].parent != (int)dir) continue;
+        uint8_t *out = data ? data + (size_t)slots * DIR_ENTRY_SIZE : entries;
+        int n = node_entries(&plan->nodes[j], &taken, out);
+        if (n <= 0) continue; // names are checked by plan_scan()
+        sfn_set_add(&taken, &out[(n - 1) * DIR_ENTRY_SIZE]);
+        slots += n;
+    }
+    sfn_set_free(&taken);
+    return slots;
+}
+
+struct PopulateBatch
+{
+    uint8_t *buffer;
+    uint32_t first_cluster;
+    size_t used;                   // whole clusters
+};
+
+static void batch_flush(struct Volume *vol, struct PopulateBatch *batch)
+{
+    if (batch->used == 0) return;
+    uint32_t clusters = batch->used / vol->cluster_size;
+    if (!vol->map) cache_sync_range(vol, &vol->cache, batch->first_cluster, clusters, 1);
+    write_bytes(vol, cluster_offset(vol, batch->first_cluster), batch->buffer, batch->used);
+    batch->used = 0;
+}
+
+// Data of one file. Small files whose clusters follow the previous ones are read into the
+// batch, everything else is transferred on its own.
+static int populate_file(struct Volume *vol, struct PopulateBatch *batch, struct PopulateNode *node)
+{
+    if (node->size == 0) return FS_OK;
+
+    int fd = open(node->host_path, O_RDONLY);
+    if (fd < 0)
+    {
+        perror(node->host_path);
+        return FS_IO;
+    }
+
+    int err = FS_OK;
+    size_t bytes = (size_t)node->clusters * vol->cluster_size;
+    uint32_t next;
+    int contiguous = chain_run(vol, node->first_cluster, node->clusters, &next) == node->clusters;
+
+    if (contiguous && node->size <= POPULATE_SMALL)
+    {
+        if (batch->used > 0 && (batch->used + bytes > POPULATE_BATCH ||
+                                node->first_cluster != batch->first_cluster + batch->used / vol->cluster_size))
+            batch_flush(vol, batch);
+        if (batch->used == 0) batch->first_cluster = node->first_cluster;
+
+        uint8_t *dest = batch->buffer + batch->used;
+        size_t done = 0;
+        while (done < node->size)
+        {
+            ssize_t n = pread(fd, dest + done, node->size - done, done);
+            if (n <= 0) break;
+            done += n;
+        }
+        if (done < node->size) err = FS_IO;
+        memset(dest + done, 0, bytes - done);
+        batch->used += bytes;
+    }
+    else
+    {
+        batch_flush(vol, batch);
+        loff_t offset = 0;
+        err = write_chain(vol, node->first_cluster, fd, &offset, NULL, node->size);
+    }
+
+    close(fd);
+    return err;
+}
+
+// Bulk import of the host tree 'host_dir' into the directory 'target'. The tree is scanned
+// and checked first, then every directory and file gets its clusters (directories first,
+// then the data in tree order, so both end up contiguous on a fresh image), the data is
+// written in large sequential batches, every directory is built in memory and written
+// once, and the FAT and FSInfo are committed by one sync at the end.
+int populate(struct Volume *vol, uint32_t target, const char *host_dir, struct PopulatePlan *plan, FILE *out)
+{
+    memset(plan, 0, sizeof(*plan));
+    int err = plan_scan(plan, host_dir, -1, out);
+
+    uint8_t entries[MAX_NAME_ENTRIES * DIR_ENTRY_SIZE];
+
+    // 1. sizes: clusters of every file and directory, and no name may exist in the target
+    for (unsigned int i = 0; i < plan->count && err == FS_OK; i++)
+    {
+        struct PopulateNode *node = &plan->nodes[i];
+        if (node->parent < 0 && dir_lookup(vol, target, node->name))
+        {
+            fprintf(out, "%s: %s\n", fs_error(FS_EXISTS), node->name);
+            err = FS_EXISTS;
+        }
+    }
+    for (unsigned int i = 0; i < plan->count && err == FS_OK; i++)
+    {
+        struct PopulateNode *node = &plan->nodes[i];
+        if (node->is_directory) node->size = (uint64_t)(2 + node_dir_entries(plan, i, NULL)) * DIR_ENTRY_SIZE; // with '.' and '..'
+        node->clusters = (node->size + vol->cluster_size - 1) / vol->cluster_size;
+        plan->clusters += node->clusters;
+    }
+    if (err == FS_OK && plan->clusters > vol->fsinfo.free_count) err = FS_NO_SPACE;
+
+    // the FAT of the whole import stays in the cache and is written once, at the end
+    unsigned int fat_pages = vol->fat_cache.capacity;
+    if (err == FS_OK && !vol->map)
+    {
+        uint64_t needed = plan->clusters / vol->fat_entries_per_page + 8;
+        uint64_t fat_sectors = vol->fat_size_bytes / vol->bpb.bytes_per_sector;
+        if (needed > fat_sectors) needed = fat_sectors;
+        if (needed > fat_pages)
+        {
+            flush_fat(vol);
+            cache_init(&vol->fat_cache, needed, vol->bpb.bytes_per_sector, vol->fat_cache.base,
+                       vol->fat_cache.copies, vol->fat_cache.copy_stride);
+        }
+    }
+
+    // 2. clusters: directories first, then the data
+    for (int pass = 1; pass >= 0 && err == FS_OK; pass--)
+    {
+        for (unsigned int i = 0; i < plan->count; i++)
+        {
+            struct PopulateNode *node = &plan->nodes[i];
+            if (node->is_directory != pass || node->clusters == 0) continue;
+
+            int first = allocate_chain(vol, &vol->fsinfo, node->clusters);
+            if (first < 0)
+            {
+                err = FS_NO_SPACE;
+                break;
+            }
+            node->first_cluster = first;
+        }
+    }
+
+    // 3. data, in large sequential batches
+    struct PopulateBatch batch = { NULL, 0, 0 };
+    if (err == FS_OK) batch.buffer = malloc(POPULATE_BATCH);
+    if (err == FS_OK && batch.buffer == NULL) err = FS_NO_SPACE;
+    for (unsigned int i = 0; i < plan->count && err == FS_OK; i++)
+    {
+        if (!plan->nodes[i].is_directory) err = populate_file(vol, &batch, &plan->nodes[i]);
+    }
+    if (err == FS_OK) batch_flush(vol, &batch);
+    free(batch.buffer);
+
+    // 4. directories, each built in memory and written at once
+    for (unsigned int i = 0; i < plan->count && err == FS_OK; i++)
+    {
+        struct PopulateNode *dir = &plan->nodes[i];
+        if (!dir->is_directory) continue;
+
+        size_t bytes = (size_t)dir->clusters * vol->cluster_size;
+        uint8_t *data = calloc(1, bytes + 2);
+        uint32_t parent = dir->parent < 0 ? target : plan->nodes[dir->parent].first_cluster;
+        init_root_directory(data, dir->first_cluster, dotdot_cluster(vol, parent));
+
+        node_dir_entries(plan, i, data + 2 * DIR_ENTRY_SIZE);
+        err = write_chain(vol, dir->first_cluster, -1, NULL, data, bytes);
+        free(data);
+    }
+
+    // 5. top-level entries go into the target directory
+    for (unsigned int i = 0; i < plan->count && err == FS_OK; i++)
+    {
+        struct PopulateNode *node = &plan->nodes[i];
+        if (node->parent >= 0) continue;
+
+        struct DirIndex *index = get_dir_index(vol, target);
+        int slots = node_entries(node, index ? &index->sfns : NULL, entries);
+        uint32_t entry_cluster;
+        unsigned int entry_offset;
+        if (!dir_add_entries(vol, target, node->name, entries, slots, &entry_cluster, &entry_offset))
+            err = FS_DIR_FULL;
+    }
+
+    // nothing is linked into the tree on failure, so the clusters just go back
+    if (err < 0)
+    {
+        for (unsigned int i = 0; i < plan->count; i++)
+        {
+            struct PopulateNode *node = &plan->nodes[i];
+            if (node->first_cluster && (node->parent >= 0 || dir_lookup(vol, target, node->name) == NULL))
+                free_chain(vol, &vol->fsinfo, node->first_cluster);
+        }
+    }
+
+    sync_volume(vol);
+    if (!vol->map && vol->fat_cache.capacity != fat_pages)
+    {
+        cache_init(&vol->fat_cache, fat_pages, vol->bpb.bytes_per_sector, vol->fat_cache.base,
+                   vol->fat_cache.copies, vol->fat_cache.copy_stride);
+    }
+
+    for (unsigned int i = 0; i < plan->count; i++) free(plan->nodes[i].host_path);
+    free(plan->nodes);
+    plan->nodes = NULL;
+    return err;
+}
+
+// ---- consistency check (check / fsck) ----
+
+
+struct CheckDir
+{
+    uint32_t cluster;
+    uint32_t parent;               // 0 for the root
+};
+
+struct CheckDiff
+{
+    uint32_t sector;               // in the FAT
+    unsigned int copy;             // 1 = second FAT
+};
+
+// What a check found; filled by all threads at once (atomic adds), repaired afterwards by one.
+struct Check
+{
+    struct Volume *vol;
+    int fd;
+    unsigned int threads;
+    uint8_t *fat;                  // FAT1 as it is on disk
+    uint32_t last;                 // last data cluster
+
+    uint64_t *used;                // FAT entry is not 0
+    uint64_t *owned;               // reached from the directory tree
+    uint64_t *has_pred;            // some FAT entry points to it
+
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    struct CheckDir *queue;
+    unsigned int queued, queue_capacity;
+    unsigned int busy;             // threads working on a directory
+
+    // FAT sectors of the other copies that differ from FAT1
+    struct CheckDiff *diffs;
+    unsigned int diff_count, diff_capacity;
+    unsigned long diff_entries;
+
+    // links to fix: chain ends at 'cluster' (bad next), '.'/'..' of 'dir'
+    uint32_t *bad_links;
+    unsigned int bad_link_count, bad_link_capacity;
+    struct CheckDir *bad_dots;
+    unsigned int bad_dot_count, bad_dot_capacity;
+
+    unsigned long directories, files, clusters_used, free_clusters;
+    unsigned long out_of_range, free_in_chain, cross_linked, bad_start, size_mismatch, bad_names;
+    unsigned long lost, lost_chains;
+};
+
+static inline uint32_t check_entry(const struct Check *ck, uint32_t cluster)
+{
+    return get_le32(ck->fat + (size_t)cluster * 4) & 0x0FFFFFFF;
+}
+
+static inline int test_and_set(uint64_t *bitmap, uint32_t bit)
+{
+    uint64_t mask = 1ULL << (bit & 63);
+    return (__atomic_fetch_or(&bitmap[bit >> 6], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static inline void count_add(unsigned long *counter, unsigned long value)
+{
+    if (value) __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+// appends to one of the lists of the check, under its lock
+static void check_push(struct Check *ck, void **list, unsigned int *count, unsigned int *capacity,
+                       size_t item_size, const void *item)
+{
+    pthread_mutex_lock(&ck->lock);
+    if (*count == *capacity)
+    {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        *list = realloc(*list, *capacity * item_size);
+    }
+    memcpy((uint8_t *)*list + (size_t)*count * item_size, item, item_size);
+    (*count)++;
+    pthread_mutex_unlock(&ck->lock);
+}
+
+struct CheckTask
+{
+    struct Check *ck;
+    unsigned int index;            // thread number
+};
+
+// Phase 1, one slice of the FAT per thread: load FAT1, compare it with the other copies
+// and check every entry: a link must point to a data cluster, an end of chain or nothing.
+static void *check_fat_slice(void *arg)
+{
+    struct CheckTask *task = arg;
+    struct Check *ck = task->ck;
+    struct Volume *vol = ck->vol;
+
+    // slices are whole sectors, so the copies can be compared and repaired by sector
+    uint32_t bps = vol->bpb.bytes_per_sector;
+    uint64_t sectors = ((uint64_t)(ck->last + 1) * 4 + bps - 1) / bps;
+    uint64_t first_sector = sectors * task->index / ck->threads;
+    uint64_t end_sector = sectors * (task->index + 1) / ck->threads;
+    long fat_offset = (long)vol->bpb.reserved_sectors * bps;
+    size_t length = (end_sector - first_sector) * bps;
+    if (length == 0) return NULL;
+
+    uint8_t *slice = ck->fat + first_sector * bps;
+    if (!read_at(ck->fd, slice, length, fat_offset + first_sector * bps)) memset(slice, 0, length);
+
+    // copies: memcmp per sector, entries are counted only where a sector differs
+    uint8_t *copy = malloc(length);
+    unsigned long diff_entries = 0;
+    for (unsigned int c = 1; copy && c < vol->bpb.fat_amount; c++)
+    {
+        if (!read_at(ck->fd, copy, length, fat_offset + c * vol->fat_size_bytes + first_sector * bps)) continue;
+        for (uint64_t s = 0; s < end_sector - first_sector; s++)
+        {
+            if (memcmp(slice + s * bps, copy + s * bps, bps) == 0) continue;
+
+            const uint32_t *a = (const uint32_t *)(slice + s * bps), *b = (const uint32_t *)(copy + s * bps);
+            for (uint32_t i = 0; i < bps / 4; i++) diff_entries += a[i] != b[i];
+
+            struct CheckDiff diff = { first_sector + s, c };
+            check_push(ck, (void **)&ck->diffs, &ck->diff_count, &ck->diff_capacity, sizeof(diff), &diff);
+        }
+    }
+    free(copy);
+    count_add(&ck->diff_entries, diff_entries);
+
+    uint64_t from = first_sector * (bps / 4), to = end_sector * (bps / 4);
+    if (from < 2) from = 2;
+    if (to > (uint64_t)ck->last + 1) to = (uint64_t)ck->last + 1;
+
+    unsigned long used = 0, out_of_range = 0;
+    for (uint64_t c = from; c < to; c++)
+    {
+        uint32_t next = check_entry(ck, c);
+        if (next == 0) continue;
+
+        used++;
+        test_and_set(ck->used, c);
+        if (next >= 2 && next <= ck->last)
+            test_and_set(ck->has_pred, next);
+        else if (next < 0x0FFFFFF7)
+        {
+            out_of_range++;
+            uint32_t cluster = c;
+            check_push(ck, (void **)&ck->bad_links, &ck->bad_link_count, &ck->bad_link_capacity, sizeof(uint32_t), &cluster);
+        }
+    }
+    count_add(&ck->clusters_used, used);
+    count_add(&ck->out_of_range, out_of_range);
+    count_add(&ck->free_clusters, (to > from ? to - from : 0) - used);
+    return NULL;
+}
+
+// Claims every cluster of a chain for the tree; returns the number of clusters.
+// A cluster that is already claimed is cross-linked (or the chain loops): the walk stops.
+static unsigned long check_chain(struct Check *ck, uint32_t first)
+{
+    unsigned long length = 0;
+    for (uint32_t c = first; ; )
+    {
+        if (test_and_set(ck->owned, c))
+        {
+            count_add(&ck->cross_linked, 1);
+            break;
+        }
+        length++;
+
+        uint32_t next = check_entry(ck, c);
+        if (next >= FAT_EOC_MIN || next == 0x0FFFFFF7) break;
+        if (next == 0)
+        {
+            // chain runs into a free cluster: it ends here
+            count_add(&ck->free_in_chain, 1);
+            check_push(ck, (void **)&ck->bad_links, &ck->bad_link_count, &ck->bad_link_capacity, sizeof(uint32_t), &c);
+            break;
+        }
+        if (next < 2 || next > ck->last) break; // counted in phase 1
+        c = next;
+    }
+    return length;
+}
+
+static void check_queue_dir(struct Check *ck, uint32_t cluster, uint32_t parent)
+{
+    struct CheckDir dir = { cluster, parent };
+    pthread_mutex_lock(&ck->lock);
+    if (ck->queued == ck->queue_capacity)
+    {
+        ck->queue_capacity = ck->queue_capacity ? ck->queue_capacity * 2 : 256;
+        ck->queue = realloc(ck->queue, ck->queue_capacity * sizeof(struct CheckDir));
+    }
+    ck->queue[ck->queued++] = dir;
+    pthread_cond_signal(&ck->more);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+// One directory: its own chain, '.' and '..', and every entry in it. Files are checked
+// right away, subdirectories go to the queue.
+static void check_directory(struct Check *ck, const struct CheckDir *dir, uint8_t *buffer)
+{
+    struct Volume *vol = ck->vol;
+    uint32_t root = vol->bpb.root_cluster;
+    int is_root = (dir->cluster == root);
+    count_add(&ck->directories, 1);
+
+    unsigned long position = 0;
+    int dots_ok = 1;
+    struct DirIterator it;
+    struct ParsedEntry pe;
+    memset(&it, 0, sizeof(it));
+    for (uint32_t c = dir->cluster; c != 0; )
+    {
+        if (test_and_set(ck->owned, c))
+        {
+            count_add(&ck->cross_linked, 1);
+            return;
+        }
+        if (!read_at(ck->fd, buffer, vol->cluster_size, cluster_offset(vol, c))) return;
+
+        for (unsigned int off = 0; off < vol->cluster_size; off += DIR_ENTRY_SIZE, position++)
+        {
+            const uint8_t *entry = buffer + off;
+            if (entry[0] == 0x00)
+            {
+                if (position < 2 && !is_root) // '..' (or both) missing
+                    check_push(ck, (void **)&ck->bad_dots, &ck->bad_dot_count, &ck->bad_dot_capacity, sizeof(struct CheckDir), dir);
+                return;
+            }
+            uint32_t first = sfn_first_cluster(entry);
+
+            if (position < 2 && !is_root)
+            {
+                // '.' is the directory itself, '..' its parent (0 if the parent is the root)
+                uint32_t expected = position == 0 ? dir->cluster : dir->parent;
+                int name_ok = memcmp(entry, position == 0 ? ".          " : "..         ", 11) == 0;
+                int cluster_ok = first == expected || (position == 1 && dir->parent == root && first == 0);
+                if (!name_ok || !cluster_ok || !(entry[11] & 0x10)) dots_ok = 0;
+                if (position == 1 && !dots_ok)
+                    check_push(ck, (void **)&ck->bad_dots, &ck->bad_dot_count, &ck->bad_dot_capacity, sizeof(struct CheckDir), dir);
+                continue;
+            }
+
+            int parsed = dir_parse(&it, entry, c, off, &pe); // collects the long name
+            if (entry[0] == 0xE5 || entry[11] == 0x0F || (entry[11] & 0x08)) continue;
+            if (entry[0] == '.' && (entry[1] == ' ' || entry[1] == '.')) continue;
+            if (parsed == 1 && !name_is_legal(pe.name)) count_add(&ck->bad_names, 1);
+
+            if (first != 0 && (first < 2 || first > ck->last))
+            {
+                count_add(&ck->bad_start, 1);
+                continue;
+            }
+
+            if (entry[11] & 0x10)
+            {
+                if (first == 0) count_add(&ck->bad_start, 1);
+                else check_queue_dir(ck, first, dir->cluster);
+                continue;
+            }
+
+            count_add(&ck->files, 1);
+            uint32_t size = get_le32(entry + 28);
+            unsigned long clusters = first ? check_chain(ck, first) : 0;
+            if (clusters != (size + (uint64_t)vol->cluster_size - 1) / vol->cluster_size)
+                count_add(&ck->size_mismatch, 1);
+        }
+
+        uint32_t next = check_entry(ck, c);
+        if (next == 0)
+        {
+            count_add(&ck->free_in_chain, 1);
+            check_push(ck, (void **)&ck->bad_links, &ck->bad_link_count, &ck->bad_link_capacity, sizeof(uint32_t), &c);
+        }
+        c = (next >= 2 && next <= ck->last) ? next : 0;
+    }
+}
+
+// Phase 2: the directory tree, every thread takes the next directory from the queue.
+static void *check_tree_worker(void *arg)
+{
+    struct Check *ck = arg;
+    uint8_t *buffer = malloc(ck->vol->cluster_size);
+
+    pthread_mutex_lock(&ck->lock);
+    while (1)
+    {
+        while (ck->queued == 0 && ck->busy > 0) pthread_cond_wait(&ck->more, &ck->lock);
+        if (ck->queued == 0) break; // nothing queued and nobody can queue more
+
+        struct CheckDir dir = ck->queue[--ck->queued];
+        ck->busy++;
+        pthread_mutex_unlock(&ck->lock);
+
+        if (buffer) check_directory(ck, &dir, buffer);
+
+        pthread_mutex_lock(&ck->lock);
+        ck->busy--;
+        if (ck->busy == 0 && ck->queued == 0) pthread_cond_broadcast(&ck->more);
+    }
+    pthread_mutex_unlock(&ck->lock);
+    free(buffer);
+    return NULL;
+}
+
+// 'fn' on ck->threads threads, with a CheckTask each ('per_thread_task') or the Check itself
+static void run_threads(struct Check *ck, void *(*fn)(void *), int per_thread_task)
+{
+    pthread_t threads[CHECK_MAX_THREADS];
+    int started[CHECK_MAX_THREADS];
+    struct CheckTask tasks[CHECK_MAX_THREADS];
+
+    for (unsigned int i = 0; i < ck->threads; i++)
+    {
+        tasks[i].ck = ck;
+        tasks[i].index = i;
+        void *arg = per_thread_task ? (void *)&tasks[i] : (void *)ck;
+        started[i] = pthread_create(&threads[i], NULL, fn, arg) == 0;
+        if (!started[i]) fn(arg); // no thread: its part is done here
+    }
+    for (unsigned int i = 0; i < ck->threads; i++)
+    {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+// Fixes what check_volume() found (all but cross-links): FAT copies get FAT1's sectors,
+// chains with a bad link end there, lost clusters are freed, '.'/'..' are rewritten and
+// FSInfo is counted again.
+static void repair_volume(struct Check *ck)
+{
+    struct Volume *vol = ck->vol;
+    uint32_t bps = vol->bpb.bytes_per_sector;
+    long fat_offset = (long)vol->bpb.reserved_sectors * bps;
+
+    for (unsigned int i = 0; i < ck->diff_count; i++)
+    {
+        struct CheckDiff *diff = &ck->diffs[i];
+        write_bytes(vol, fat_offset + diff->copy * vol->fat_size_bytes + (long)diff->sector * bps,
+                    ck->fat + (size_t)diff->sector * bps, bps);
+    }
+
+    for (unsigned int i = 0; i < ck->bad_link_count; i++)
+        set_fat_entry(vol, ck->bad_links[i], FAT_EOC);
+
+    for (uint32_t c = 2; c <= ck->last; c++)
+    {
+        uint64_t bit = 1ULL << (c & 63);
+        if ((ck->used[c >> 6] & bit) && !(ck->owned[c >> 6] & bit)) set_fat_entry(vol, c, 0);
+    }
+
+    for (unsigned int i = 0; i < ck->bad_dot_count; i++)
+    {
+        struct CheckDir *dir = &ck->bad_dots[i];
+        uint8_t *data = get_cluster(vol, dir->cluster);
+        init_root_directory(data, dir->cluster, dotdot_cluster(vol, dir->parent));
+        put_cluster(vol, dir->cluster, data);
+    }
+
+    int first_free = find_free_cluster(vol, 2);
+    init_fsinfo(&vol->fsinfo, count_free_clusters(vol), first_free < 0 ? 2 : first_free);
+    drop_dir_indexes(vol);
+    drop_dentries(vol);
+    sync_volume(vol);
+}
+
+// Checks the whole volume with 'threads' threads and prints a report; repairs with 'repair'.
+// Returns the number of problems found (cross-links and size mismatches stay after a repair).
+long check_volume(struct Volume *vol, unsigned int threads, int repair, FILE *out)
+{
+    struct Check ck;
+    memset(&ck, 0, sizeof(ck));
+    sync_volume(vol); // everything cached is on disk, threads read the image directly
+
+    ck.vol = vol;
+    ck.fd = fileno(vol->file);
+    ck.threads = threads < 1 ? 1 : threads > CHECK_MAX_THREADS ? CHECK_MAX_THREADS : threads;
+    ck.last = vol->total_clusters + 1;
+    pthread_mutex_init(&ck.lock, NULL);
+    pthread_cond_init(&ck.more, NULL);
+
+    size_t words = ck.last / 64 + 1;
+    ck.fat = calloc(1, vol->fat_size_bytes + vol->bpb.bytes_per_sector);
+    ck.used = calloc(words, sizeof(uint64_t));
+    ck.owned = calloc(words, sizeof(uint64_t));
+    ck.has_pred = calloc(words, sizeof(uint64_t));
+    if (!ck.fat || !ck.used || !ck.owned || !ck.has_pred)
+    {
+        fprintf(out, "Not enough memory to check the volume\n");
+        free(ck.fat); free(ck.used); free(ck.owned); free(ck.has_pred);
+        return -1;
+    }
+
+    run_threads(&ck, check_fat_slice, 1);
+
+    check_queue_dir(&ck, vol->bpb.root_cluster, 0);
+    run_threads(&ck, check_tree_worker, 0);
+
+    for (size_t i = 0; i < words; i++)
+    {
+        uint64_t lost = ck.used[i] & ~ck.owned[i];
+        ck.lost += __builtin_popcountll(lost);
+        ck.lost_chains += __builtin_popcountll(lost & ~ck.has_pred[i]);
+    }
+
+    unsigned long fsinfo_free = vol->fsinfo.free_count;
+    long problems = ck.out_of_range + ck.free_in_chain + ck.cross_linked + ck.bad_start + ck.size_mismatch +
+                    ck.bad_names + ck.lost + ck.bad_dot_count + (ck.diff_count > 0) + (fsinfo_free != ck.free_clusters);
+
+    fprintf(out, "%lu directories, %lu files, %lu of %u clusters used (%u threads)\n",
+           ck.directories, ck.files, ck.clusters_used, vol->total_clusters, ck.threads);
+    if (ck.diff_count)     fprintf(out, "FAT copies differ: %lu entries in %u sectors\n", ck.diff_entries, ck.diff_count);
+    if (ck.out_of_range)   fprintf(out, "Links out of range: %lu\n", ck.out_of_range);
+    if (ck.free_in_chain)  fprintf(out, "Chains running into a free cluster: %lu\n", ck.free_in_chain);
+    if (ck.cross_linked)   fprintf(out, "Cross-linked clusters: %lu (not repaired)\n", ck.cross_linked);
+    if (ck.lost)           fprintf(out, "Lost clusters: %lu in %lu chains\n", ck.lost, ck.lost_chains);
+    if (ck.bad_start)      fprintf(out, "Entries with a bad first cluster: %lu (not repaired)\n", ck.bad_start);
+    if (ck.bad_dot_count)  fprintf(out, "Directories with broken '.'/'..': %u\n", ck.bad_dot_count);
+    if (ck.size_mismatch)  fprintf(out, "Files whose size does not match the chain: %lu (not repaired)\n", ck.size_mismatch);
+    if (ck.bad_names)      fprintf(out, "Names FAT does not allow: %lu (not repaired)\n", ck.bad_names);
+    if (fsinfo_free != ck.free_clusters)
+        fprintf(out, "FSInfo free count %lu, counted %lu\n", fsinfo_free, ck.free_clusters);
+
+    if (problems == 0)
+        fprintf(out, "No problems found\n");
+    else if (repair)
+    {
+        repair_volume(&ck);
+        problems = ck.cross_linked + ck.bad_start + ck.size_mismatch + ck.bad_names;
+        fprintf(out, "Repaired, %ld problems left\n", problems);
+    }
+
+    free(ck.fat); free(ck.used); free(ck.owned); free(ck.has_pred);
+    free(ck.queue); free(ck.diffs); free(ck.bad_links); free(ck.bad_dots);
+    pthread_mutex_destroy(&ck.lock);
+    pthread_cond_destroy(&ck.more);
+    return problems;
+}
+
+// Sets up the FAT access (mapping or sector cache) and the free bitmap for the current BPB.
+static int init_fat_access(struct Volume *vol, int all_free)
+{
+    struct FAT32_BPB *bpb = &vol->bpb;
+    long fat_offset = (long)bpb->reserved_sectors * bpb->bytes_per_sector;
+
+    vol->fat_size_bytes = (long)bpb->fat32_size * bpb->bytes_per_sector;
+    vol->fat_entries_per_page = bpb->bytes_per_sector / 4;
+
+    if (vol->map)
+    {
+        vol->fat = vol->map + fat_offset;
+    }
+    else
+    {
+        unsigned int pages = (unsigned long)vol->fat_cache_kb * 1024 / bpb->bytes_per_sector;
+        cache_init(&vol->fat_cache, pages, bpb->bytes_per_sector, fat_offset, bpb->fat_amount, vol->fat_size_bytes);
+        long data_offset = (long)vol->first_data_sector * bpb->bytes_per_sector;
+        cache_init(&vol->cache, vol->cache_clusters, vol->cluster_size,
+                   data_offset - 2L * vol->cluster_size, 1, 0); // block number = cluster number
+    }
+    return init_free_bitmap(vol, all_free);
+}
+
+// Reads the BPB and checks that it describes something that fits into the image.
+// Only the BPB and FSInfo are read here; FAT sectors are loaded when they are needed.
+int load_volume(struct Volume *vol)
+{
+    struct FAT32_BPB *bpb = &vol->bpb;
+    uint8_t sector[512];
+
+    vol->is_fat32 = 0;
+    if (vol->size < 512) return 0;
+
+    read_bytes(vol, 0, sector, sizeof(sector));
+    decode_bpb(sector, bpb);
+
+    if (bpb->root_cluster < 2) return 0;
+    if (bpb->bytes_per_sector < 512 || bpb->bytes_per_sector > 4096 || (bpb->bytes_per_sector & (bpb->bytes_per_sector - 1)))
+        return 0;
+    if (bpb->sectors_per_cluster == 0 || (bpb->sectors_per_cluster & (bpb->sectors_per_cluster - 1)))
+        return 0;
+    if (bpb->fat_amount == 0 || bpb->fat32_size == 0 || bpb->reserved_sectors <= bpb->sector_FS_info)
+        return 0;
+
+    // every FAT copy and the data region must be inside the image
+    uint64_t fat_entries = (uint64_t)bpb->fat32_size * bpb->bytes_per_sector / 4;
+    uint64_t meta_sectors = bpb->reserved_sectors + (uint64_t)bpb->fat_amount * bpb->fat32_size;
+    if (meta_sectors >= bpb->total_sectors || (uint64_t)bpb->total_sectors * bpb->bytes_per_sector > (uint64_t)vol->size)
+        return 0;
+
+    vol->cluster_size = bpb->sectors_per_cluster * bpb->bytes_per_sector;
+    vol->first_data_sector = meta_sectors;
+    vol->total_clusters = count_clusters(bpb);
+    if (vol->total_clusters == 0) return 0;
+    if (vol->total_clusters + 2 > fat_entries) vol->total_clusters = fat_entries - 2; // FAT is too small for the data region
+    if (bpb->root_cluster > vol->total_clusters + 1) return 0;
+
+    if (!init_fat_access(vol, 0)) return 0;
+    drop_dir_indexes(vol);
+    drop_dentries(vol);
+
+    // read FSInfo; if it is missing or broken, count free clusters once and rewrite it
+    read_bytes(vol, (long)bpb->sector_FS_info * bpb->bytes_per_sector, sector, sizeof(sector));
+    decode_fsinfo(sector, &vol->fsinfo);
+
+    vol->is_fat32 = 1;
+    if (!fsinfo_is_valid(&vol->fsinfo, vol->total_clusters))
+    {
+        int first_free = find_free_cluster(vol, 2);
+        init_fsinfo(&vol->fsinfo, count_free_clusters(vol), first_free < 0 ? 2 : first_free);
+        sync_volume(vol);
+    }
+    return 1;
+}
+
+// 'journal_path' is the metadata journal (NULL: none, not supported with --mmap);
+// transactions a crash left in it are written into the image before it is read.
+int open_volume(struct Volume *vol, FILE *file, long size_file, int use_mmap,
+                unsigned int cache_clusters, unsigned int fat_cache_kb, const char *journal_path)
+{
+    memset(vol, 0, sizeof(struct Volume));
+    vol->file = file;
+    vol->size = size_file;
+    vol->cache_clusters = cache_clusters;
+    vol->fat_cache_kb = fat_cache_kb;
+    vol->journal_fd = -1;
+    vol->journal_batch = DEFAULT_JOURNAL_BATCH;
+
+    if (journal_path != NULL)
+    {
+        int fd = open(journal_path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            perror(journal_path);
+            return 0;
+        }
+        int replayed = journal_replay(fd, fileno(file));
+        if (replayed > 0) printf("Journal: replayed %d transaction(s) from %s\n", replayed, journal_path);
+        vol->journal_fd = fd;
+        vol->journal_path = journal_path;
+    }
+
+    if (use_mmap && size_file > 0)
+    {
+        void *map = mmap(NULL, size_file, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(file), 0);
+        if (map == MAP_FAILED)
+        {
+            perror("mmap");
+            return 0;
+        }
+        vol->map = map;
+    }
+    if (vol->map == NULL) aio_init(&vol->aio, aio_backend, aio_queue_depth);
+
+    return load_volume(vol);
+}
+
+void close_volume(struct Volume *vol)
+{
+    sync_volume(vol);
+    if (vol->journal_fd >= 0)
+    {
+        // clean shutdown: the image is durable, the journal is not needed
+        fdatasync(fileno(vol->file));
+        close(vol->journal_fd);
+        unlink(vol->journal_path);
+    }
+    aio_free(&vol->aio);
+    cache_free(&vol->cache);
+    cache_free(&vol->fat_cache);
+    free(vol->free_bitmap);
+    free(vol->bitmap_built);
+    drop_dir_indexes(vol);
+    free(vol->dentries);
+    free(vol->discards);
+    free(vol->held);
+    if (vol->map) munmap(vol->map, vol->size);
+    fclose(vol->file);
+}
+
+// Deallocates a range of the image, it reads as zeros afterwards. Returns 0 if the file
+// system can not punch holes.
+int punch_hole(struct Volume *vol, long offset, long length)
+{
+    if (!vol->map) fflush(vol->file); // nothing buffered may land in the hole later
+    return fallocate(fileno(vol->file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0;
+}
+
+// Quick format: the image is punched out as a whole (old FAT, directories and data read as
+// zeros and take no space), then only the sectors that must not be zero are written: BPB
+// and FSInfo with their backups, the first FAT sector of each copy and the root directory. Where
+// holes are not supported the FAT copies are zeroed by writes. Returns 0 (and changes
+// nothing) if the volume can not have the geometry 'opt' asks for.
+int format_volume(struct Volume *vol, const struct FormatOptions *opt)
+{
+    struct FAT32_BPB *bpb = &vol->bpb;
+    struct FAT32_BPB planned;
+    uint8_t sector[512];
+
+    if (!to_format(&planned, vol->size, opt)) return 0; // the old file system stays
+    *bpb = planned;
+
+    vol->cluster_size = bpb->bytes_per_sector * bpb->sectors_per_cluster;
+    vol->first_data_sector = bpb->reserved_sectors + (bpb->fat_amount * bpb->fat32_size);
+    vol->total_clusters = count_clusters(bpb);
+
+    // whatever was cached, indexed or about to be discarded belongs to the old file system
+    init_fat_access(vol, 1);
+    drop_dir_indexes(vol);
+    drop_dentries(vol);
+    vol->discard_count = 0;
+
+    long fat_offset = (long)bpb->reserved_sectors * bpb->bytes_per_sector;
+    long total_fat = (long)bpb->fat_amount * vol->fat_size_bytes;
+    if (!punch_hole(vol, 0, vol->size))
+    {
+        if (vol->map)
+        {
+            memset(vol->map + fat_offset, 0, total_fat);
+            mark_dirty(vol, fat_offset, total_fat);
+        }
+        else
+        {
+            size_t chunk = 64 * 1024;
+            uint8_t *zero = calloc(1, chunk);
+            for (long done = 0; done < total_fat; done += chunk)
+            {
+                size_t length = (total_fat - done < (long)chunk) ? (size_t)(total_fat - done) : chunk;
+                write_bytes(vol, fat_offset + done, zero, length);
+            }
+            free(zero);
+        }
+    }
+
+    // Write FAT32 BPB and its backup
+    encode_bpb(bpb, sector);
+    write_bytes(vol, 0, sector, sizeof(sector));
+    write_bytes(vol, (long)bpb->sector_backup_boot * bpb->bytes_per_sector, sector, sizeof(sector));
+
+    set_fat_entry(vol, 0, 0x0FFFFFF8); // FATid
+    set_fat_entry(vol, 1, 0xFFFFFFFF); // reserved
+    set_fat_entry(vol, 2, FAT_EOC);    // rootdirectory — EOF
+
+    // FSInfo: everything is free except the root directory; its backup follows the backup
+    // boot sector and, as on other FAT32 volumes, is only written here
+    init_fsinfo(&vol->fsinfo, vol->total_clusters - 1, 3);
+    encode_fsinfo(&vol->fsinfo, sector);
+    write_bytes(vol, (long)(bpb->sector_backup_boot + 1) * bpb->bytes_per_sector, sector, sizeof(sector));
+
+    // root directory with '.' and '..'
+    uint8_t *cluster = new_cluster(vol, bpb->root_cluster);
+    init_root_directory(cluster, bpb->root_cluster, bpb->root_cluster); // '..' of the root points to itself
+    put_cluster(vol, bpb->root_cluster, cluster);
+
+    vol->is_fat32 = 1;
+    sync_volume(vol);
+    return 1;
+}
+
+// ---- sessions (server mode) ----
+
+// Many sessions use one volume at a time. A reading command runs on the session's view: its
+// own caches, name indexes and async I/O engine over the same image, read with pread(), each
+// directory under the read lock of its stripe. A changing command runs on the volume itself,
+// one at a time; it takes the write lock of every directory it changes and keeps them until
+// commit_volume() has written everything to the image, so a view never sees a half-done
+// change. Chains are only changed together with the entry of the directory that holds them,
+// so a view following a chain under that directory's lock reads FAT entries that do not
+// change under it. Every commit bumps the generation, and a view that takes a lock after one
+// drops what it cached before.
+
+static inline pthread_rwlock_t *dir_lock(struct VolumeLocks *locks, uint32_t dir)
+{
+    return &locks->dirs[dir % DIR_LOCK_STRIPES];
+}
+
+// Turns the locking on for a volume that is going to be served.
+int serve_volume(struct Volume *vol)
+{
+    struct VolumeLocks *locks = calloc(1, sizeof(struct VolumeLocks));
+    if (locks == NULL) return 0;
+
+    // a commit waits for the readers that are in, not for every reader that comes after it;
+    // nobody takes a read lock it already holds
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_mutex_init(&locks->writer, NULL);
+    pthread_rwlock_init(&locks->tree, &attr);
+    pthread_rwlock_init(&locks->fat, &attr);
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++) pthread_rwlock_init(&locks->dirs[i], &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    vol->locks = locks;
+    return 1;
+}
+
+// A session's read-only view of a served volume. It is filled by the first begin_read().
+void open_view(struct Volume *view, struct Volume *vol)
+{
+    memset(view, 0, sizeof(struct Volume));
+    view->file = vol->file;
+    view->map = vol->map;
+    view->size = vol->size;
+    view->cache_clusters = vol->cache_clusters;
+    view->fat_cache_kb = vol->fat_cache_kb;
+    view->journal_fd = -1;
+    view->locks = vol->locks;
+    view->shared = vol;
+    view->generation = (unsigned long)-1;
+    if (view->map == NULL) aio_init(&view->aio, aio_backend, aio_queue_depth);
+}
+
+void close_view(struct Volume *view)
+{
+    aio_free(&view->aio);
+    cache_free(&view->cache);
+    cache_free(&view->fat_cache);
+    free(view->free_bitmap);
+    free(view->bitmap_built);
+    drop_dir_indexes(view);
+    free(view->dentries);
+}
+
+// Drops what the view cached before the last commit; after a format the BPB is read again.
+static void refresh_view(struct Volume *view)
+{
+    struct Volume *vol = view->shared;
+    unsigned long generation = __atomic_load_n(&vol->locks->generation, __ATOMIC_ACQUIRE);
+    if (generation == view->generation) return;
+    view->generation = generation;
+
+    // the geometry only changes under the exclusive tree lock, the caller holds it shared
+    if (view->is_fat32 != vol->is_fat32 || (vol->is_fat32 &&
+        (view->cluster_size != vol->cluster_size || view->first_data_sector != vol->first_data_sector ||
+         view->total_clusters != vol->total_clusters || view->bpb.root_cluster != vol->bpb.root_cluster)))
+    {
+        load_volume(view);
+        return;
+    }
+    if (!view->map)
+    {
+        cache_sync_range(view, &view->cache, 0, UINT32_MAX, 1);
+        cache_sync_range(view, &view->fat_cache, 0, UINT32_MAX, 1);
+    }
+    drop_dir_indexes(view);
+    drop_dentries(view);
+}
+
+// A view reads directory 'dir' under its read lock. No-op for anything but a view.
+void lock_directory(struct Volume *vol, uint32_t dir)
+{
+    if (vol->shared == NULL) return;
+    pthread_rwlock_rdlock(dir_lock(vol->locks, dir));
+    refresh_view(vol);
+}
+
+void unlock_directory(struct Volume *vol, uint32_t dir)
+{
+    if (vol->shared == NULL) return;
+    pthread_rwlock_unlock(dir_lock(vol->locks, dir));
+}
+
+// Called by the changing command before it changes directory 'dir' (its entries, or the
+// chain of a file in it); the lock is held until commit_volume().
+void claim_directory(struct Volume *vol, uint32_t dir)
+{
+    if (vol->locks == NULL || vol->shared) return;
+
+    uint64_t stripe = 1ULL << (dir % DIR_LOCK_STRIPES);
+    if (vol->locks->claimed & stripe) return;
+    pthread_rwlock_wrlock(dir_lock(vol->locks, dir));
+    vol->locks->claimed |= stripe;
+}
+
+// Reading commands share the tree lock with each other and with a changing command.
+void begin_read(struct Volume *view)
+{
+    pthread_rwlock_rdlock(&view->locks->tree);
+    refresh_view(view);
+}
+
+void end_read(struct Volume *view)
+{
+    pthread_rwlock_unlock(&view->locks->tree);
+}
+
+// A changing command runs alone among the changing ones; with 'whole_tree' (format, defrag,
+// check, populate) it also waits until no one is reading.
+void begin_write(struct Volume *vol, int whole_tree)
+{
+    pthread_mutex_lock(&vol->locks->writer);
+    if (whole_tree)
+        pthread_rwlock_wrlock(&vol->locks->tree);
+    else
+        pthread_rwlock_rdlock(&vol->locks->tree);
+    vol->locks->exclusive = whole_tree;
+}
+
+// Ends a changing command: everything goes to the image (through the journal if there is
+// one), then the claimed directories are released. The views only start over if something
+// was claimed.
+void commit_volume(struct Volume *vol)
+{
+    struct VolumeLocks *locks = vol->locks;
+
+    pthread_rwlock_wrlock(&locks->fat);
+    sync_volume(vol);
+    if (locks->claimed || locks->exclusive) __atomic_add_fetch(&locks->generation, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&locks->fat);
+
+    for (int i = 0; i < DIR_LOCK_STRIPES; i++)
+    {
+        if (locks->claimed >> i & 1) pthread_rwlock_unlock(&locks->dirs[i]);
+    }
+    locks->claimed = 0;
+    pthread_rwlock_unlock(&locks->tree);
+    pthread_mutex_unlock(&locks->writer);
+}
+
+// ---- parallel tree walk (tree / du / find) ----
+//
+// Every directory is a work item. A worker keeps its items in its own deque (pushes and pops
+// at the tail, depth first) and, when that is empty, steals the oldest item of another
+// worker, usually a whole subtree near the top. Like check, the workers read the image
+// directly after a sync; each has a small cache of FAT sectors. Every directory becomes a
+// node of the result tree in its on-disk order, so the output does not depend on which
+// thread read what. A session's walk reads every directory under its lock instead, the
+// image holds all that is committed.
+
+#define WALK_FAT_PAGES 64          // FAT sectors cached by each worker
+
+struct WalkDir;
+
+struct WalkQueue
+{
+    pthread_mutex_t lock;
+    struct WalkDir **items;        // [head, tail)
+    unsigned int head, tail, capacity;
+};
+
+struct Walk
+{
+    struct Volume *vol;
+    int fd;
+    struct VolumeLocks *locks;     // a session's walk: directories are read under their locks
+    unsigned int threads;
+    int count_clusters;            // follow the chains of files too
+    uint64_t *visited;             // directory clusters, against loops
+    unsigned long pending;         // queued or being read
+    struct WalkQueue queues[WALK_MAX_THREADS];
+    unsigned long steals;
+};
+
+struct WalkWorker
+{
+    struct Walk *walk;
+    unsigned int index;
+    uint8_t *cluster;
+    uint8_t *fat;                  // WALK_FAT_PAGES sectors
+    uint32_t fat_tags[WALK_FAT_PAGES]; // page + 1, 0 = empty
+    unsigned long generation;      // commit the cached FAT sectors are from
+};
+
+static void walk_push(struct WalkQueue *queue, struct WalkDir *dir)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity)
+    {
+        if (queue->head > 0)
+        {
+            memmove(queue->items, queue->items + queue->head, (queue->tail - queue->head) * sizeof(struct WalkDir *));
+            queue->tail -= queue->head;
+            queue->head = 0;
+        }
+        else
+        {
+            queue->capacity = queue->capacity ? queue->capacity * 2 : 64;
+            queue->items = realloc(queue->items, queue->capacity * sizeof(struct WalkDir *));
+        }
+    }
+    queue->items[queue->tail++] = dir;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// the owner takes the newest item, a thief the oldest
+static struct WalkDir *walk_take(struct WalkQueue *queue, int steal)
+{
+    struct WalkDir *dir = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail > queue->head)
+        dir = steal ? queue->items[queue->head++] : queue->items[--queue->tail];
+    if (queue->tail == queue->head) queue->head = queue->tail = 0;
+    pthread_mutex_unlock(&queue->lock);
+    return dir;
+}
+
+static uint32_t walk_next_cluster(struct WalkWorker *w, uint32_t cluster)
+{
+    struct Volume *vol = w->walk->vol;
+    uint32_t page = cluster / vol->fat_entries_per_page;
+    unsigned int slot = page % WALK_FAT_PAGES;
+    uint8_t *sector = w->fat + (size_t)slot * vol->bpb.bytes_per_sector;
+
+    if (w->fat_tags[slot] != page + 1)
+    {
+        long offset = (long)vol->bpb.reserved_sectors * vol->bpb.bytes_per_sector + (long)page * vol->bpb.bytes_per_sector;
+        if (w->walk->locks) pthread_rwlock_rdlock(&w->walk->locks->fat);
+        int ok = read_at(w->walk->fd, sector, vol->bpb.bytes_per_sector, offset);
+        if (w->walk->locks) pthread_rwlock_unlock(&w->walk->locks->fat);
+        if (!ok) return 0;
+        w->fat_tags[slot] = page + 1;
+    }
+
+    uint32_t next = get_le32(sector + (cluster % vol->fat_entries_per_page) * 4) & 0x0FFFFFFF;
+    return (next < 2 || next >= FAT_EOC_MIN || next > vol->total_clusters + 1) ? 0 : next;
+}
+
+static unsigned int walk_chain_length(struct WalkWorker *w, uint32_t first)
+{
+    unsigned int length = 0;
+    for (uint32_t c = first; c != 0 && length <= w->walk->vol->total_clusters; c = walk_next_cluster(w, c)) length++;
+    return length;
+}
+
+static void walk_directory(struct WalkWorker *w, struct WalkDir *dir)
+{
+    struct Walk *walk = w->walk;
+    struct Volume *vol = walk->vol;
+    struct DirIterator it;
+    struct ParsedEntry pe;
+    memset(&it, 0, sizeof(it));
+    it.lfn_expect = -1;
+
+    for (uint32_t c = dir->cluster; c != 0 && dir->own_clusters <= vol->total_clusters; c = walk_next_cluster(w, c))
+    {
+        dir->own_clusters++;
+        if (!read_at(walk->fd, w->cluster, vol->cluster_size, cluster_offset(vol, c))) return;
+
+        for (unsigned int off = 0; off < vol->cluster_size; off += DIR_ENTRY_SIZE)
+        {
+            int parsed = dir_parse(&it, w->cluster + off, c, off, &pe);
+            if (parsed < 0) return;
+            if (parsed == 0 || strcmp(pe.name, ".") == 0 || strcmp(pe.name, "..") == 0) continue;
+
+            if (dir->count == dir->capacity)
+            {
+                dir->capacity = dir->capacity ? dir->capacity * 2 : 16;
+                dir->entries = realloc(dir->entries, dir->capacity * sizeof(struct WalkEntry));
+            }
+            struct WalkEntry *entry = &dir->entries[dir->count++];
+            memset(entry, 0, sizeof(*entry));
+            entry->name = strdup(pe.name);
+            entry->first_cluster = pe.first_cluster;
+            entry->size = pe.size;
+            entry->is_directory = pe.is_directory;
+
+            int in_range = pe.first_cluster >= 2 && pe.first_cluster <= vol->total_clusters + 1;
+            if (!pe.is_directory)
+            {
+                if (walk->count_clusters && in_range) entry->clusters = walk_chain_length(w, pe.first_cluster);
+                continue;
+            }
+            if (!in_range || test_and_set(walk->visited, pe.first_cluster)) continue;
+
+            entry->dir = calloc(1, sizeof(struct WalkDir));
+            entry->dir->cluster = pe.first_cluster;
+            __atomic_fetch_add(&walk->pending, 1, __ATOMIC_RELAXED);
+            walk_push(&walk->queues[w->index], entry->dir);
+        }
+    }
+}
+
+static void *walk_worker(void *arg)
+{
+    struct WalkWorker *w = arg;
+    struct Walk *walk = w->walk;
+    unsigned int victim = w->index;
+
+    while (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        struct WalkDir *dir = walk_take(&walk->queues[w->index], 0);
+        for (unsigned int i = 1; dir == NULL && i < walk->threads; i++)
+        {
+            victim = (victim + 1) % walk->threads;
+            if (victim == w->index) continue;
+            dir = walk_take(&walk->queues[victim], 1);
+            if (dir) __atomic_fetch_add(&walk->steals, 1, __ATOMIC_RELAXED);
+        }
+        if (dir == NULL)
+        {
+            sched_yield(); // the others are still reading, they may queue more
+            continue;
+        }
+
+        if (walk->locks)
+        {
+            pthread_rwlock_rdlock(dir_lock(walk->locks, dir->cluster));
+            unsigned long generation = __atomic_load_n(&walk->locks->generation, __ATOMIC_ACQUIRE);
+            if (generation != w->generation) memset(w->fat_tags, 0, sizeof(w->fat_tags));
+            w->generation = generation;
+        }
+        walk_directory(w, dir);
+        if (walk->locks) pthread_rwlock_unlock(dir_lock(walk->locks, dir->cluster));
+        __atomic_fetch_sub(&walk->pending, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Reads the tree under directory 'cluster' with 'threads' workers.
+struct WalkDir *walk_tree(struct Volume *vol, uint32_t cluster, unsigned int threads, int count_clusters)
+{
+    struct Walk walk;
+    memset(&walk, 0, sizeof(walk));
+    sync_volume(vol); // everything cached is on disk, workers read the image directly
+
+    walk.vol = vol;
+    walk.fd = fileno(vol->file);
+    walk.locks = vol->shared ? vol->locks : NULL;
+    walk.threads = threads < 1 ? 1 : threads > WALK_MAX_THREADS ? WALK_MAX_THREADS : threads;
+    walk.count_clusters = count_clusters;
+    walk.visited = calloc(vol->total_clusters / 64 + 2, sizeof(uint64_t));
+
+    struct WalkDir *root = calloc(1, sizeof(struct WalkDir));
+    root->cluster = cluster;
+    test_and_set(walk.visited, cluster);
+    walk.pending = 1;
+
+    pthread_t ids[WALK_MAX_THREADS];
+    int started[WALK_MAX_THREADS];
+    struct WalkWorker workers[WALK_MAX_THREADS];
+    for (unsigned int i = 0; i < walk.threads; i++) pthread_mutex_init(&walk.queues[i].lock, NULL);
+    walk_push(&walk.queues[0], root);
+
+    for (unsigned int i = 0; i < walk.threads; i++)
+    {
+        memset(&workers[i], 0, sizeof(struct WalkWorker));
+        workers[i].walk = &walk;
+        workers[i].index = i;
+        workers[i].cluster = malloc(vol->cluster_size);
+        workers[i].fat = malloc((size_t)WALK_FAT_PAGES * vol->bpb.bytes_per_sector);
+        started[i] = i > 0 && pthread_create(&ids[i], NULL, walk_worker, &workers[i]) == 0;
+    }
+    walk_worker(&workers[0]); // the calling thread works too; also alone if no thread started
+    for (unsigned int i = 0; i < walk.threads; i++)
+    {
+        if (started[i]) pthread_join(ids[i], NULL);
+    }
+    for (unsigned int i = 0; i < walk.threads; i++) // a late thief may still look at any queue
+    {
+        free(workers[i].cluster);
+        free(workers[i].fat);
+        free(walk.queues[i].items);
+        pthread_mutex_destroy(&walk.queues[i].lock);
+    }
+    free(walk.visited);
+    return root;
+}
+
+// Subtree totals, bottom up.
+void walk_sum(struct WalkDir *dir)
+{
+    dir->total_size = 0;
+    dir->total_clusters = dir->own_clusters;
+    dir->files = dir->directories = 0;
+    for (unsigned int i = 0; i < dir->count; i++)
+    {
+        struct WalkEntry *entry = &dir->entries[i];
+        if (entry->dir)
+        {
+            walk_sum(entry->dir);
+            dir->total_size += entry->dir->total_size;
+            dir->total_clusters += entry->dir->total_clusters;
+            dir->files += entry->dir->files;
+            dir->directories += entry->dir->directories + 1;
+        }
+        else if (!entry->is_directory)
+        {
+            dir->total_size += entry->size;
+            dir->total_clusters += entry->clusters;
+            dir->files++;
+        }
+    }
+}
+
+void walk_free(struct WalkDir *dir)
+{
+    for (unsigned int i = 0; i < dir->count; i++)
+    {
+        if (dir->entries[i].dir) walk_free(dir->entries[i].dir);
+        free(dir->entries[i].name);
+    }
+    free(dir->entries);
+    free(dir);
+}
+
+// ---- fragmentation (frag / defrag) ----
+
+// Both walk the tree from the root one directory at a time; defrag moves every fragmented
+// chain into one free extent, as low on the volume as there is one, with a single copy per run.
+
+struct FragDir
+{
+    uint32_t cluster;
+    struct SlotPos pos;            // its SFN entry in the parent, cluster 0 for the root
+    char *path;
+};
+
+// Clusters and contiguous runs of a chain; 0 if the chain is broken or loops.
+static int chain_shape(struct Volume *vol, uint32_t first, unsigned int *clusters, unsigned int *fragments)
+{
+    uint32_t cluster = first;
+    *clusters = *fragments = 0;
+
+    while (cluster != 0)
+    {
+        if (cluster < 2 || cluster > vol->total_clusters + 1 || get_fat_entry(vol, cluster) == 0) return 0;
+        uint32_t next;
+        *clusters += chain_run(vol, cluster, vol->total_clusters, &next);
+        (*fragments)++;
+        if (*clusters > vol->total_clusters) return 0;
+        cluster = next;
+    }
+    return *clusters > 0;
+}
+
+// Length of the free run that starts at 'start', 64 clusters per step.
+unsigned int free_run_length(struct Volume *vol, uint32_t start)
+{
+    uint32_t last = vol->total_clusters + 1;
+    uint32_t cluster = start;
+
+    while (cluster <= last)
+    {
+        ensure_bitmap(vol, cluster);
+        unsigned int bit = cluster & 63;
+        unsigned int span = 64 - bit;
+        if (span > last - cluster + 1) span = last - cluster + 1;
+
+        uint64_t used = ~(vol->free_bitmap[cluster >> 6] >> bit);
+        unsigned int ones = used == 0 ? 64 : (unsigned int)__builtin_ctzll(used);
+        if (ones > span) ones = span;
+        cluster += ones;
+        if (ones < span) break;
+    }
+    return cluster - start;
+}
+
+// Copies 'count' clusters. Directory clusters go through the cluster cache (and the journal
+// with it), file data is one copy_file_range() inside the image per run.
+static int copy_clusters(struct Volume *vol, uint32_t from, uint32_t to, unsigned int count, int through_cache)
+{
+    long source = cluster_offset(vol, from), target = cluster_offset(vol, to);
+    size_t length = (size_t)count * vol->cluster_size;
+
+    if (vol->map)
+    {
+        count_read(vol, source, length);
+        write_bytes(vol, target, vol->map + source, length);
+        return FS_OK;
+    }
+
+    if (through_cache)
+    {
+        for (unsigned int i = 0; i < count; i++)
+        {
+            uint8_t *data = get_cluster(vol, from + i);
+            uint8_t *copy = new_cluster(vol, to + i);
+            memcpy(copy, data, vol->cluster_size);
+            put_cluster(vol, to + i, copy);
+        }
+        return FS_OK;
+    }
+
+    count_read(vol, source, length);
+    count_write(vol, target, length);
+    cache_sync_range(vol, &vol->cache, from, count, 0);
+    cache_sync_range(vol, &vol->cache, to, count, 1);
+    fflush(vol->file);
+
+    int fd = fileno(vol->file);
+    loff_t in = source, out = target;
+    while (length > 0)
+    {
+        ssize_t n = copy_file_range(fd, &in, fd, &out, length, 0);
+        if (n <= 0) break; // not supported here, copied through a buffer below
+        length -= n;
+    }
+    if (length == 0) return FS_OK;
+
+    uint8_t *buffer = malloc(TRANSFER_CHUNK);
+    int err = buffer ? FS_OK : FS_IO;
+    while (length > 0 && err == FS_OK)
+    {
+        size_t chunk = length < TRANSFER_CHUNK ? length : TRANSFER_CHUNK;
+        if (!read_at(fd, buffer, chunk, in)) err = FS_IO;
+        for (size_t done = 0; done < chunk && err == FS_OK; )
+        {
+            ssize_t w = pwrite(fd, buffer + done, chunk - done, out + done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) err = FS_IO;
+            else done += w;
+        }
+        in += chunk;
+        out += chunk;
+        length -= chunk;
+    }
+    free(buffer);
+    return err;
+}
+
+// Copies a chain of 'clusters' clusters into the lowest free extent that holds it and links
+// the extent. The old chain is still allocated, the caller frees it once nothing points to
+// it. Returns the new first cluster, 0 if no free extent is large enough.
+static uint32_t relocate_chain(struct Volume *vol, uint32_t first, unsigned int clusters, int is_directory)
+{
+    int target = find_free_run(vol, 2, vol->total_clusters + 1, clusters);
+    if (target < 0) return 0;
+
+    uint32_t cluster = first, to = target;
+    while (cluster != 0 && to < (uint32_t)target + clusters)
+    {
+        uint32_t next;
+        unsigned int run = chain_run(vol, cluster, target + clusters - to, &next);
+        if (copy_clusters(vol, cluster, to, run, is_directory) < 0) return 0;
+        to += run;
+        cluster = next;
+    }
+    claim_extent(vol, &vol->fsinfo, target, clusters);
+    return target;
+}
+
+// Points a directory entry (SFN) at another first cluster.
+static void set_entry_cluster(struct Volume *vol, struct SlotPos pos, uint32_t first_cluster)
+{
+    uint8_t *data = get_cluster(vol, pos.cluster);
+    put_le16(data + pos.offset + 20, (first_cluster >> 16) & 0xFFFF);
+    put_le16(data + pos.offset + 26, first_cluster & 0xFFFF);
+    put_cluster(vol, pos.cluster, data);
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    size_t length = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(length);
+    snprintf(path, length, "%s%s%s", dir, strcmp(dir, "/") == 0 ? "" : "/", name);
+    return path;
+}
+
+// Counts one chain; with 'relocate' a fragmented one is moved and its SFN entry at 'pos'
+// updated. Returns the (new) first cluster.
+static uint32_t frag_chain(struct Volume *vol, struct FragScan *scan, const char *path, uint32_t first,
+                           int is_directory, struct SlotPos pos)
+{
+    unsigned int clusters, fragments;
+    if (!chain_shape(vol, first, &clusters, &fragments)) return first; // 'check' deals with it
+
+    scan->chains++;
+    scan->clusters += clusters;
+    scan->fragments += fragments;
+    if (fragments < 2) return first;
+
+    if (is_directory) scan->fragmented_directories++; else scan->fragmented_files++;
+    if (scan->count == scan->capacity)
+    {
+        scan->capacity = scan->capacity ? scan->capacity * 2 : 64;
+        scan->list = realloc(scan->list, scan->capacity * sizeof(struct FragChain));
+    }
+    scan->list[scan->count++] = (struct FragChain){ strdup(path), clusters, fragments, is_directory };
+
+    // the root directory is where the BPB says, it stays
+    if (!scan->relocate || pos.cluster == 0) return first;
+
+    uint32_t moved = relocate_chain(vol, first, clusters, is_directory);
+    if (moved == 0)
+    {
+        scan->not_placed++;
+        return first;
+    }
+    set_entry_cluster(vol, pos, moved);
+    if (is_directory) set_entry_cluster(vol, (struct SlotPos){ moved, 0 }, moved); // '.'
+    free_chain(vol, &vol->fsinfo, first);
+    scan->moved++;
+    scan->moved_clusters += clusters;
+    return moved;
+}
+
+int compare_fragments(const void *a, const void *b)
+{
+    const struct FragChain *x = a, *y = b;
+    if (x->fragments != y->fragments) return x->fragments < y->fragments ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+// Walks the tree from the root: each directory is (re)located first, then its entries are
+// read from where it is now, so the positions of the SFN entries are never stale.
+void frag_walk(struct Volume *vol, struct FragScan *scan)
+{
+    uint8_t *visited = calloc(vol->total_clusters / 8 + 2, 1);
+    struct FragDir *stack = malloc(sizeof(struct FragDir));
+    unsigned int depth = 1, capacity = 1;
+    stack[0] = (struct FragDir){ vol->bpb.root_cluster, { 0, 0 }, strdup("/") };
+
+    while (depth > 0)
+    {
+        struct FragDir dir = stack[--depth];
+        uint32_t index = dir.cluster - 2;
+        if (dir.cluster < 2 || dir.cluster > vol->total_clusters + 1 || (visited[index >> 3] & (1 << (index & 7))))
+        {
+            free(dir.path);
+            continue;
+        }
+        visited[index >> 3] |= 1 << (index & 7);
+        scan->directories++;
+
+        uint32_t cluster = frag_chain(vol, scan, dir.path, dir.cluster, 1, dir.pos);
+        int moved = cluster != dir.cluster;
+
+        struct DirIterator it;
+        struct ParsedEntry pe;
+        dir_open(&it, vol, cluster);
+        while (dir_next(&it, &pe))
+        {
+            if (strcmp(pe.name, ".") == 0 || strcmp(pe.name, "..") == 0 || pe.first_cluster < 2) continue;
+
+            char *path = join_path(dir.path, pe.name);
+            struct SlotPos pos = { pe.cluster, pe.offset };
+            if (!pe.is_directory)
+            {
+                scan->files++;
+                frag_chain(vol, scan, path, pe.first_cluster, 0, pos);
+                free(path);
+                continue;
+            }
+
+            if (moved && pe.first_cluster <= vol->total_clusters + 1)
+                set_entry_cluster(vol, (struct SlotPos){ pe.first_cluster, DIR_ENTRY_SIZE }, cluster); // its '..'
+            if (depth == capacity)
+            {
+                capacity *= 2;
+                stack = realloc(stack, capacity * sizeof(struct FragDir));
+            }
+            stack[depth++] = (struct FragDir){ pe.first_cluster, pos, path };
+        }
+        free(dir.path);
+    }
+
+    free(stack);
+    free(visited);
+    if (scan->relocate)
+    {
+        // names were indexed under the old clusters
+        drop_dir_indexes(vol);
+        drop_dentries(vol);
+    }
+}
+
+void frag_free(struct FragScan *scan)
+{
+    for (unsigned int i = 0; i < scan->count; i++) free(scan->list[i].path);
+    free(scan->list);
+}
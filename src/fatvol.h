@@ -0,0 +1,673 @@
+// Volume library of FATik: the on-disk structures, caches, journal and async I/O of an
+// opened image and the operations on it. All the state of an image is in its struct Volume
+// (only the --aio settings are global), so views of one volume can be used from many
+// threads at once, see "sessions" in fatvol.c. src/fatman.c is the command line on top of it.
+
+#ifndef FATVOL_H
+#define FATVOL_H
+
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct FAT32_BPB // SECTOR 0
+{
+    char jmp[3];
+    char oem[8];                               // OC label
+    unsigned short bytes_per_sector;          // size sector (e.g. 512 bytes)
+    unsigned char sectors_per_cluster;       // number of sectors per cluster (e.g.8 => 8 * 512 = 4096 bytes (4KB) size of cluster)
+    unsigned short reserved_sectors;        // size of reserved sector of FAT table: adress of FAT table (32 * 512 as 0x20 * 0x200 = 0x4000)
+    unsigned char fat_amount;              // amount of copies of FAT table (if someone is corrupted, we can use another one)
+    unsigned short root_dir_entries;      //  number of entries in root directory (number of clusters in data block)
+    unsigned short total_sectors_16;
+
+    unsigned char media_descriptor;      // type of media 0xF8 hard disk (0xF0 = floppy)
+    //unsigned short sectors_per_fat;     //  size of FAT32 table; e.g.(8 * 512) * 512 = 1,8MB
+    unsigned short fat16_size; // 0
+    unsigned short sectors_per_track;
+    unsigned short heads;              // number of heads
+    unsigned int hidden_sectors;      // number of sector before the disk
+
+    unsigned int total_sectors;      // size of disk; e.g. 15118440 sectors * 512 = 7,2GB
+    unsigned int fat32_size;
+
+    unsigned short flags;
+    unsigned short version;
+    unsigned int root_cluster;
+    unsigned short sector_FS_info;
+    unsigned short sector_backup_boot;
+    unsigned char reserved[12];
+    unsigned char drive_number;   // number of drive
+    unsigned char reserved2;
+    unsigned char boot_signature; // 0x29
+    unsigned int volume_id;
+    char volume_label[11];
+    char file_system[8];
+
+    unsigned char unused[420]; // if it was boot device here should be a code to be executed.
+    unsigned char signature[2]; // 0x55, 0xAA
+};
+
+struct SFNentry
+{
+    unsigned char name[8];
+    unsigned char ext[3];
+    unsigned char attributes;
+    unsigned char reserved;
+    unsigned short time_created;
+    unsigned short date_created;
+    unsigned short date_last_accessed;
+    unsigned short cluster_high;
+    unsigned short time_last_modified;
+    unsigned short date_last_modified;
+    unsigned short cluster_low;
+    unsigned int size;
+};
+
+#define FSINFO_LEAD_SIGNATURE   0x41615252
+#define FSINFO_STRUCT_SIGNATURE 0x61417272
+#define FSINFO_TRAIL_SIGNATURE  0xAA550000
+#define FSINFO_UNKNOWN          0xFFFFFFFF
+
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_EOC_MIN 0x0FFFFFF8
+#define FAT32_MAX_CLUSTERS 0x0FFFFFF5
+
+// Geometry asked for by 'format'; a field left 0 (or "") gets the default.
+struct FormatOptions
+{
+    unsigned int cluster_size;     // 512 B .. 64 KB, by default picked by volume and file size
+    uint64_t file_size;            // expected size of a file, 0 if not known
+    unsigned int fat_count;        // 2
+    unsigned int reserved_sectors; // 32, at least 8 (the backup BPB is sector 6)
+    unsigned int align;            // the data region starts on this boundary, one cluster
+    uint32_t volume_id;            // 0x12345678
+    char label[12];                // "FAT32IMG"
+};
+
+#define DIR_ENTRY_SIZE 32
+#define MAX_LFN_ENTRIES 20                     // 255 characters, 13 per entry
+#define MAX_NAME_ENTRIES (MAX_LFN_ENTRIES + 1) // + SFN
+#define MAX_LFN_UNITS 255                      // UTF-16 units of a long name
+#define MAX_NAME_BYTES (MAX_LFN_UNITS * 3 + 1) // the same as UTF-8, with the NUL
+
+// errors of the file system operations (they return a negative value)
+#define FS_OK         0
+#define FS_NOT_FOUND -1
+#define FS_NOT_DIR   -2
+#define FS_EXISTS    -3
+#define FS_NO_SPACE  -4
+#define FS_DIR_FULL  -5
+#define FS_INVALID   -6
+#define FS_IS_DIR    -7
+#define FS_TOO_BIG   -8
+#define FS_IO        -9
+#define FS_NOT_EMPTY -10
+
+struct FSInfo // SECTOR bpb.sector_FS_info (1)
+{
+    uint32_t lead_signature;      // 0x41615252 "RRaA"
+    uint8_t reserved1[480];
+    uint32_t struct_signature;    // 0x61417272 "rrAa"
+    uint32_t free_count;          // number of free clusters, 0xFFFFFFFF if unknown
+    uint32_t next_free;           // cluster to start searching from, 0xFFFFFFFF if unknown
+    uint8_t reserved2[12];
+    uint32_t trail_signature;     // 0xAA550000
+};
+
+static inline uint16_t get_le16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void put_le16(uint8_t *p, uint16_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static inline void put_le32(uint8_t *p, uint32_t value)
+{
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = value >> 24;
+}
+
+// Short names in use in one directory, kept as hashes (open addressing, 0 = empty):
+// a false hit only costs trying the next "~N" tail.
+struct SfnSet
+{
+    uint32_t *slots;
+    unsigned int count, mask;
+};
+
+struct ParsedEntry
+{
+    char name[MAX_NAME_BYTES]; // LFN or SFN
+    unsigned char sfn[11];     // the short name as stored
+    unsigned int first_cluster;
+    unsigned char is_directory;
+    unsigned int size;
+
+    // where the SFN entry is
+    uint32_t cluster;
+    unsigned int offset;
+};
+
+// clusters [first, first + count)
+struct ClusterRun
+{
+    uint32_t first;
+    uint32_t count;
+};
+
+#define DEFAULT_CACHE_CLUSTERS 64
+#define DEFAULT_FAT_CACHE_KB 256
+#define MIN_CACHE_BLOCKS 4
+
+#define CACHE_EMPTY 0xFFFFFFFF     // slot was discarded and holds no block
+
+struct CacheSlot
+{
+    uint32_t block;
+    int dirty;
+    int prev, next;                // LRU list, most recently used is the head
+    int hash_next;
+    uint8_t *data;
+};
+
+// Write-back LRU cache of equally sized blocks of the image: data clusters (block = cluster
+// number) and FAT sectors (block = sector inside the FAT). Not used with --mmap, there the
+// page cache does the same job. Dirty blocks are written on eviction and on sync_volume().
+struct BlockCache
+{
+    struct CacheSlot *slots;
+    int *buckets;
+    unsigned int capacity;
+    unsigned int bucket_mask;
+    unsigned int used;             // slots [0, used) hold blocks
+    int head, tail;
+
+    long base;                     // image offset of block 0
+    unsigned int block_size;
+    unsigned int copies;           // the region is stored this many times (FAT copies)
+    long copy_stride;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+};
+
+#define DIR_INDEX_SLOTS 8
+
+// position of a 32-byte directory entry
+struct SlotPos
+{
+    uint32_t cluster;
+    unsigned int offset;
+};
+
+struct NameIndexEntry
+{
+    char *name;
+    uint32_t hash;
+    uint32_t first_cluster;
+    unsigned char is_directory;
+    struct SlotPos pos;            // SFN entry
+    int hash_next;
+};
+
+// Hashed names of one directory. Built on the first lookup and kept up to date by
+// dir_add_entries(), so lookups, duplicate checks and inserts do not walk the directory.
+struct DirIndex
+{
+    uint32_t dir_cluster;          // 0 = slot is unused
+    unsigned long last_used;
+
+    struct NameIndexEntry *names;
+    unsigned int count, capacity;
+    int *buckets;
+    unsigned int bucket_mask;
+
+    struct SfnSet sfns;            // short names in use, for the tails of new long names
+
+    struct SlotPos *holes;         // deleted (0xE5) slots before the end, in chain order
+    unsigned int hole_count, hole_capacity;
+
+    struct SlotPos end;            // first slot after the last entry (offset == cluster_size: chain is full)
+    int error;                     // ran out of memory while building
+};
+
+#define DENTRY_CACHE_SIZE 1024 // power of 2
+
+// (parent directory cluster, name) -> cluster, filled by path lookups
+struct Dentry
+{
+    uint32_t parent;               // 0 = slot is empty
+    uint32_t hash;
+    uint32_t cluster;
+    unsigned char is_directory;
+    char name[MAX_NAME_BYTES];     // as it is stored in the directory
+};
+
+// Where an access to the image lands: reserved sectors (BPB, FSInfo), FAT copies, data clusters.
+enum IoRegion { REGION_BPB, REGION_FAT, REGION_DATA, REGION_COUNT };
+
+// Image traffic since open (or 'stats reset'). With --mmap reads and writes are memory
+// copies in the mapping, there are no seeks and a flush is an msync.
+struct IoStats
+{
+    unsigned long reads[REGION_COUNT];
+    unsigned long writes[REGION_COUNT];
+    unsigned long seeks[REGION_COUNT];
+    unsigned long long bytes_read[REGION_COUNT];
+    unsigned long long bytes_written[REGION_COUNT];
+    unsigned long flushes;         // also fdatasync of the image and the journal
+    unsigned long journal_commits;
+    unsigned long long journal_bytes;
+    unsigned long aio_batches;     // submitted to the asynchronous I/O engine at once
+    unsigned long aio_requests;
+};
+
+// Asynchronous I/O of the image (not used with --mmap): a batch of requests is submitted at
+// once and up to 'depth' of them are in flight, so reading ahead a chain or writing back
+// the dirty blocks costs about one device round trip instead of one per block. io_uring
+// through its system calls where the kernel has it, otherwise a pool of threads doing
+// preadv()/pwritev(); AIO_SYNC runs the requests one by one in the caller.
+enum AioBackend { AIO_AUTO, AIO_URING, AIO_THREADS, AIO_SYNC };
+
+#define DEFAULT_QUEUE_DEPTH 32
+#define MAX_AIO_THREADS 16
+#define AIO_MAX_IOV 64             // blocks written by one request
+
+struct AioRequest
+{
+    int write;
+    int fd;
+    off_t offset;
+    struct iovec iov[AIO_MAX_IOV];
+    int iovcnt;
+    ssize_t result;                // bytes done or -errno
+};
+
+struct AioEngine
+{
+    enum AioBackend backend;
+    unsigned int depth;
+
+    // io_uring: shared rings
+    int ring_fd;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+
+    // thread pool: workers take requests [next, count) of the current batch
+    pthread_t threads[MAX_AIO_THREADS];
+    unsigned int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work, finished;
+    struct AioRequest *batch;
+    unsigned int count, next, done;
+    int stop;
+};
+
+// Opened image. With --mmap the whole image is mapped once and the BPB, FAT and
+// directory clusters are read and changed in place; otherwise it goes through stdio
+// and the FAT and data clusters go through the block caches.
+#define DIR_LOCK_STRIPES 64        // directories share a lock by cluster number
+
+// Locks of a volume that is served to many sessions at once (--serve). Sessions read through
+// views of it (open_view()); a command that changes something runs on the volume itself, one
+// at a time, and is committed before the next one starts.
+struct VolumeLocks
+{
+    pthread_mutex_t writer;        // held by the changing command
+    pthread_rwlock_t tree;         // shared by every command, exclusive for format/defrag/check/populate
+    pthread_rwlock_t fat;          // exclusive while a commit writes the FAT and FSInfo back
+    pthread_rwlock_t dirs[DIR_LOCK_STRIPES];
+    uint64_t claimed;              // stripes the writer holds until its commit, bit per stripe
+    int exclusive;                 // the writer holds the tree lock exclusively
+    unsigned long generation;      // commits so far: a view drops what it cached before
+};
+
+struct Volume
+{
+    FILE *file;
+    uint8_t *map;                  // whole image, NULL if not mapped
+    long size;
+
+    // part of the mapping changed since the last sync_volume()
+    long dirty_begin;
+    long dirty_end;
+
+    struct FAT32_BPB bpb;
+    unsigned int cluster_size;
+    uint32_t first_data_sector;
+    unsigned int total_clusters;
+    int is_fat32;
+
+    struct BlockCache cache;       // data clusters
+    unsigned int cache_clusters;   // requested cache size
+
+    // The FAT is never read as a whole: with --mmap it is used in place (FAT1 at 'fat'),
+    // otherwise its sectors are loaded on demand into 'fat_cache', which is bounded by
+    // 'fat_cache_kb'.
+    uint8_t *fat;
+    struct BlockCache fat_cache;
+    unsigned int fat_cache_kb;
+    uint32_t fat_entries_per_page; // entries in one FAT sector
+    long fat_size_bytes;
+
+    // 1 bit per cluster, bit set = cluster is free. Built page by page (one FAT sector at a
+    // time, 'bitmap_built' has 1 bit per FAT sector) when a search gets there first, and
+    // kept in sync by set_fat_entry(), so searching looks at 64 clusters per step.
+    uint64_t *free_bitmap;
+    uint64_t *bitmap_built;
+
+    struct DirIndex dir_index[DIR_INDEX_SLOTS];
+    unsigned long index_tick;
+
+    struct Dentry *dentries;       // DENTRY_CACHE_SIZE slots, direct mapped
+
+    // Metadata journal (--journal), -1 if there is none. See journal_commit().
+    int journal_fd;
+    const char *journal_path;
+    uint64_t journal_sequence;
+    unsigned int journal_ops;      // commands since the last commit
+    unsigned int journal_batch;    // commit after this many commands
+    // clusters freed since the last commit: used in the free bitmap until it, see hold_cluster()
+    struct ClusterRun *held;
+    unsigned int held_count, held_capacity;
+
+    struct AioEngine aio;          // without --mmap
+
+    struct FSInfo fsinfo;          // as on the image, kept up to date by every allocation
+
+    // --discard: runs of clusters freed since the last sync, punched out of the image by it
+    int discard;
+    struct ClusterRun *discards;
+    unsigned int discard_count, discard_capacity;
+
+    struct IoStats io;
+
+    // Server mode: 'locks' of the served volume, also set in its views; 'shared' is the
+    // volume a view reads (NULL if this is not a view), 'generation' the commit that the
+    // view's caches are from.
+    struct VolumeLocks *locks;
+    struct Volume *shared;
+    unsigned long generation;
+};
+
+// Streams the entries of a directory one by one, following its cluster chain.
+struct DirIterator
+{
+    struct Volume *vol;
+    uint32_t cluster;
+    unsigned int offset;          // of the next entry inside 'cluster'
+    unsigned int clusters_left;   // guards against looped chains
+    int done;
+
+    uint16_t lfn_units[MAX_LFN_ENTRIES * 13]; // parts of a long name, by sequence number
+    int lfn_expect;               // sequence number of the next LFN part, 0 = complete, -1 = none
+    int lfn_length;               // in units, known from the last part
+    uint8_t lfn_checksum;
+
+    struct DirIndex *index;       // if set, deleted slots are collected into it
+    struct SlotPos end;           // where the directory ended, valid once dir_next() returned 0
+};
+
+// What remove_path() may remove.
+enum RemoveMode
+{
+    REMOVE_FILE,                   // rm: files only
+    REMOVE_DIR,                    // rmdir: empty directories only
+    REMOVE_TREE                    // rm -r: files and directories with everything in them
+};
+
+struct RemoveCount
+{
+    unsigned long files, directories;
+    unsigned long long clusters;   // released
+};
+
+// A file found in a directory: where its SFN entry is and what it holds.
+struct FileRef
+{
+    uint32_t parent;
+    char name[MAX_NAME_BYTES];
+    uint32_t first_cluster;        // 0 for an empty file
+    uint32_t size;
+    struct SlotPos pos;            // SFN entry
+};
+
+// One host file or directory of a bulk import. The whole tree is scanned and every node
+// gets its clusters before anything is written.
+struct PopulateNode
+{
+    char *host_path;
+    char name[MAX_NAME_BYTES];
+    int is_directory;
+    uint64_t size;                 // bytes of data, for directories of their entries
+    unsigned int clusters;
+    uint32_t first_cluster;        // 0 = nothing allocated (empty file)
+    int parent;                    // index in the node array, -1 = the target directory
+};
+
+struct PopulatePlan
+{
+    struct PopulateNode *nodes;
+    unsigned int count, capacity;
+    uint64_t clusters;             // all of them, directories and data
+    uint64_t bytes;
+    unsigned int directories, files;
+};
+
+struct WalkEntry
+{
+    char *name;
+    uint32_t first_cluster;
+    uint32_t size;
+    unsigned int clusters;         // of its chain, with -l (du always)
+    unsigned char is_directory;
+    struct WalkDir *dir;           // read by the walk, NULL for files and loops
+};
+
+struct WalkDir
+{
+    uint32_t cluster;
+    unsigned int own_clusters;     // of the directory itself
+    struct WalkEntry *entries;
+    unsigned int count, capacity;
+
+    // whole subtree, filled after the walk
+    unsigned long long total_size, total_clusters;
+    unsigned long files, directories;
+};
+
+struct FragChain
+{
+    char *path;
+    unsigned int clusters;
+    unsigned int fragments;
+    unsigned char is_directory;
+};
+
+struct FragScan
+{
+    int relocate;                  // defrag, otherwise only counted
+
+    unsigned long files, directories;
+    unsigned long fragmented_files, fragmented_directories;
+    unsigned long long clusters, fragments, chains;
+
+    struct FragChain *list;        // fragmented chains
+    unsigned int count, capacity;
+
+    unsigned long moved, moved_clusters, not_placed;
+};
+
+#define DEFAULT_JOURNAL_BATCH 64
+#define CHECK_MAX_THREADS 64
+#define WALK_MAX_THREADS 64
+
+extern const char *region_names[REGION_COUNT];
+extern const char *aio_backend_names[];
+
+// requested with --aio / --queue-depth, used by open_volume()
+extern enum AioBackend aio_backend;
+extern unsigned int aio_queue_depth;
+
+// on-disk structures and names
+const char *fs_error(int err);
+void decode_bpb(const uint8_t *sector, struct FAT32_BPB *bpb);
+void encode_bpb(const struct FAT32_BPB *bpb, uint8_t *sector);
+void read_sfn(const uint8_t *entry, struct SFNentry *sfn);
+void write_sfn(uint8_t *entry, const struct SFNentry *sfn);
+uint32_t sfn_first_cluster(const uint8_t *entry);
+void decode_fsinfo(const uint8_t *sector, struct FSInfo *fsinfo);
+void encode_fsinfo(const struct FSInfo *fsinfo, uint8_t *sector);
+int utf8_to_utf16(const char *src, uint16_t *dst, int max);
+int utf16_to_utf8(const uint16_t *src, int count, char *dst, int size);
+uint32_t upcase_code(uint32_t code);
+int name_is_legal(const char *name);
+unsigned char sfn_checksum(const unsigned char *sfn);
+int sfn_basis(const char *name, unsigned char sfn[11], uint8_t *case_bits);
+int sfn_set_has(const struct SfnSet *set, const unsigned char *sfn);
+int sfn_set_add(struct SfnSet *set, const unsigned char *sfn);
+void sfn_set_free(struct SfnSet *set);
+int build_name_entries(const char *name, const struct SfnSet *taken, uint8_t attributes,
+                       uint32_t first_cluster, uint32_t size, uint8_t *entries);
+int create_folder(const char *name, const struct SfnSet *taken, uint8_t *entries, uint32_t id_cluster);
+int create_file_entry(const char *name, const struct SfnSet *taken, uint8_t *entries,
+                      uint32_t start_cluster, uint32_t size_bytes);
+
+// geometry
+int to_format(struct FAT32_BPB* bpb, long size_file, const struct FormatOptions *opt);
+void init_root_directory(uint8_t *cluster_data, uint32_t self_cluster, uint32_t parent_cluster);
+uint32_t dotdot_cluster(const struct Volume *vol, uint32_t parent_cluster);
+unsigned int count_clusters(const struct FAT32_BPB *bpb);
+
+// async I/O engine
+void aio_init(struct AioEngine *aio, enum AioBackend backend, unsigned int depth);
+void aio_free(struct AioEngine *aio);
+int aio_run(struct AioEngine *aio, struct AioRequest *reqs, unsigned int count);
+
+// image access and caches
+void mark_dirty(struct Volume *vol, long offset, long length);
+void read_bytes(struct Volume *vol, long offset, void *buf, size_t length);
+void write_bytes(struct Volume *vol, long offset, const void *buf, size_t length);
+long cluster_offset(const struct Volume *vol, uint32_t cluster);
+void cache_free(struct BlockCache *cache);
+void cache_init(struct BlockCache *cache, unsigned int capacity, unsigned int block_size,
+                long base, unsigned int copies, long copy_stride);
+void cache_flush(struct Volume *vol, struct BlockCache *cache);
+void cache_sync_range(struct Volume *vol, struct BlockCache *cache, uint32_t first, uint32_t count, int discard);
+uint8_t *get_cluster(struct Volume *vol, uint32_t cluster);
+uint8_t *new_cluster(struct Volume *vol, uint32_t cluster);
+void put_cluster(struct Volume *vol, uint32_t cluster, const uint8_t *data);
+void readahead_chain(struct Volume *vol, uint32_t cluster);
+
+// FAT, free space and FSInfo
+uint32_t get_fat_entry(struct Volume *vol, uint32_t cluster);
+int init_free_bitmap(struct Volume *vol, int all_free);
+void set_fat_entry(struct Volume *vol, uint32_t cluster, uint32_t value);
+int find_free_run(struct Volume *vol, uint32_t from, uint32_t to, unsigned int count);
+int find_free_extent(struct Volume *vol, uint32_t start, unsigned int count);
+int find_free_cluster(struct Volume *vol, uint32_t start);
+unsigned int count_free_clusters(struct Volume *vol);
+void init_fsinfo(struct FSInfo *fsinfo, uint32_t free_count, uint32_t next_free);
+int fsinfo_is_valid(const struct FSInfo *fsinfo, unsigned int total_clusters);
+void claim_extent(struct Volume *vol, struct FSInfo *fsinfo, uint32_t first, unsigned int count);
+int allocate_extent(struct Volume *vol, struct FSInfo *fsinfo, unsigned int count);
+int allocate_cluster(struct Volume *vol, struct FSInfo *fsinfo);
+void release_cluster(struct Volume *vol, struct FSInfo *fsinfo, uint32_t cluster);
+int allocate_chain(struct Volume *vol, struct FSInfo *fsinfo, unsigned int count);
+void flush_fat(struct Volume *vol);
+void write_fsinfo(struct Volume *vol, const struct FSInfo *fsinfo);
+
+// journal and sync points
+int journal_replay(int journal_fd, int image_fd);
+void sync_volume(struct Volume *vol);
+
+// chains and directories
+uint32_t next_cluster(struct Volume *vol, uint32_t cluster);
+unsigned int free_chain(struct Volume *vol, struct FSInfo *fsinfo, uint32_t first);
+unsigned int chain_run(struct Volume *vol, uint32_t cluster, unsigned int limit, uint32_t *next);
+void dir_open(struct DirIterator *it, struct Volume *vol, uint32_t first_cluster);
+int dir_next(struct DirIterator *it, struct ParsedEntry *pe);
+uint32_t extend_directory(struct Volume *vol, uint32_t last_cluster);
+uint32_t name_hash(const char *name);
+int name_equal(const char *a, const char *b);
+void dir_index_free(struct DirIndex *index);
+void drop_dir_indexes(struct Volume *vol);
+struct DirIndex *get_dir_index(struct Volume *vol, uint32_t dir_cluster);
+const struct NameIndexEntry *index_find(const struct DirIndex *index, const char *name);
+const struct NameIndexEntry *dir_lookup(struct Volume *vol, uint32_t dir_cluster, const char *name);
+int dir_add_entries(struct Volume *vol, uint32_t dir_cluster, const char *name, const uint8_t *entries,
+                    unsigned int count, uint32_t *entry_cluster, unsigned int *entry_offset);
+
+// paths, files and bulk import
+void trim_to_parent(char *path);
+void drop_dentries(struct Volume *vol);
+int lookup_entry(struct Volume *vol, uint32_t dir, const char *name, uint32_t *cluster,
+                 unsigned char *is_directory, const char **stored_name);
+int resolve_path(struct Volume *vol, uint32_t cwd, const char *path, uint32_t *cluster,
+                 unsigned char *is_directory, char *display, size_t display_size);
+int resolve_parent(struct Volume *vol, uint32_t cwd, const char *path, uint32_t *parent, char *name, size_t name_size);
+int make_directory(struct Volume *vol, uint32_t parent, char *name);
+int make_directories(struct Volume *vol, uint32_t cwd, const char *path, int parents);
+int create_file(struct Volume *vol, uint32_t parent, char *name);
+int lookup_file(struct Volume *vol, struct FileRef *file);
+int find_file(struct Volume *vol, uint32_t cwd, const char *path, struct FileRef *file);
+int read_file(struct Volume *vol, const struct FileRef *file, int fd, loff_t *fd_offset);
+int store_file(struct Volume *vol, uint32_t cwd, const char *path, int fd, loff_t *fd_offset,
+               const uint8_t *buf, uint64_t size);
+int remove_path(struct Volume *vol, uint32_t cwd, const char *path, enum RemoveMode mode, struct RemoveCount *removed);
+int is_directory_start(struct Volume *vol, uint32_t cluster);
+unsigned long compact_volume(struct Volume *vol, unsigned long *runs);
+int populate(struct Volume *vol, uint32_t target, const char *host_dir, struct PopulatePlan *plan, FILE *out);
+
+// opening, checking and formatting
+long check_volume(struct Volume *vol, unsigned int threads, int repair, FILE *out);
+int load_volume(struct Volume *vol);
+int open_volume(struct Volume *vol, FILE *file, long size_file, int use_mmap,
+                unsigned int cache_clusters, unsigned int fat_cache_kb, const char *journal_path);
+void close_volume(struct Volume *vol);
+int punch_hole(struct Volume *vol, long offset, long length);
+int format_volume(struct Volume *vol, const struct FormatOptions *opt);
+
+// sessions (server mode), see fatvol.c
+int serve_volume(struct Volume *vol);
+void open_view(struct Volume *view, struct Volume *vol);
+void close_view(struct Volume *view);
+void lock_directory(struct Volume *vol, uint32_t dir);
+void unlock_directory(struct Volume *vol, uint32_t dir);
+void claim_directory(struct Volume *vol, uint32_t dir);
+void begin_read(struct Volume *view);
+void end_read(struct Volume *view);
+void begin_write(struct Volume *vol, int whole_tree);
+void commit_volume(struct Volume *vol);
+
+// tree walk and fragmentation
+struct WalkDir *walk_tree(struct Volume *vol, uint32_t cluster, unsigned int threads, int count_clusters);
+void walk_sum(struct WalkDir *dir);
+void walk_free(struct WalkDir *dir);
+unsigned int free_run_length(struct Volume *vol, uint32_t start);
+int compare_fragments(const void *a, const void *b);
+void frag_walk(struct Volume *vol, struct FragScan *scan);
+void frag_free(struct FragScan *scan);
+
+#endif
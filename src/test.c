@@ -0,0 +1,147 @@
+// Checks of FATik's name rules and journal: `make test` (or ./fatik_test). Like bench.c it includes
+// fatvol.c as a whole; every check prints a line and the exit code is 1 if one failed.
+#include "fatvol.c"
+
+#include <sys/wait.h>
+
+static int failures = 0;
+
+static void expect(int ok, const char *what)
+{
+    printf("%s  %s\n", ok ? "ok  " : "FAIL", what);
+    if (!ok) failures++;
+}
+
+// Formats a sparse mapped scratch image, as bench_volume() does.
+static void test_volume(struct Volume *vol, long size)
+{
+    FILE *file = tmpfile();
+    if (file == NULL || ftruncate(fileno(file), size) != 0)
+    {
+        perror("tmpfile");
+        exit(1);
+    }
+    open_volume(vol, file, size, 1, DEFAULT_CACHE_CLUSTERS, DEFAULT_FAT_CACHE_KB, NULL);
+    if (vol->map == NULL) exit(1);
+    format_volume(vol, NULL);
+}
+
+static int same_name(const char *a, const char *b)
+{
+    return name_equal(a, b) && name_hash(a) == name_hash(b);
+}
+
+static void test_folding(void)
+{
+    expect(same_name("readme.txt", "README.TXT"), "ASCII letters fold");
+    expect(same_name("\xC3\x9C" "ber", "\xC3\xBC" "BER"), "\"\xC3\x9C" "ber\" and \"\xC3\xBC" "BER\" are one name");
+    expect(same_name("\xC3\xBF", "\xC5\xB8"), "y with diaeresis folds to U+0178");
+    expect(same_name("\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82", "\xD0\xBF\xD0\xA0\xD0\x98\xD0\x92\xD0\x95\xD0\xA2"),
+           "Cyrillic folds");
+    expect(same_name("\xCF\x83\xCE\xBF\xCF\x86\xCE\xAF\xCE\xB1", "\xCE\xA3\xCE\x9F\xCE\xA6\xCE\x8A\xCE\x91"),
+           "Greek folds, with the accent");
+    expect(!name_equal("stra\xC3\x9F" "e", "STRASSE"), "sharp s is not SS (no full case mapping)");
+    expect(!name_equal("\xC3\xA9", "e"), "accented letters stay different from plain ones");
+    expect(!name_equal("ab", "abc") && !name_equal("abc", "ab"), "a prefix is another name");
+    expect(!name_equal("\xC3", "\xC3\x83") && name_equal("a\xFF", "A\xFF"), "invalid UTF-8 compares byte by byte");
+}
+
+static void test_legal_names(void)
+{
+    expect(name_is_legal("Long name, (1) [a+b=c];") && name_is_legal("\xC3\x9C" "ber.txt"), "legal long names");
+    const char *illegal[] = { "a*b", "c:d", "e?f", "g|h", "i\"j", "k<l", "m>n", "o\\p", "q/r", "tab\t", "dot.", "space " };
+    int refused = 1;
+    for (size_t i = 0; i < sizeof(illegal) / sizeof(illegal[0]); i++) refused &= !name_is_legal(illegal[i]);
+    expect(refused, "forbidden characters, a trailing dot or space are refused");
+
+    uint8_t entries[MAX_NAME_ENTRIES * DIR_ENTRY_SIZE];
+    expect(create_file_entry("a*b", NULL, entries, 0, 0) == FS_INVALID, "no entries are built for a*b");
+}
+
+static void test_collision(void)
+{
+    struct Volume vol;
+    test_volume(&vol, 8L << 20);
+    uint32_t root = vol.bpb.root_cluster;
+
+    char upper[] = "\xC3\x9C" "ber", lower[] = "\xC3\xBC" "ber", file[] = "\xC3\x9C" "BER";
+    expect(make_directory(&vol, root, upper) >= 2, "mkdir \xC3\x9C" "ber");
+    expect(make_directory(&vol, root, lower) == FS_EXISTS, "mkdir \xC3\xBC" "ber is refused");
+    expect(create_file(&vol, root, file) == FS_EXISTS, "touch \xC3\x9C" "BER is refused");
+
+    // the same from the entries on disk: no index or dentry cached
+    drop_dir_indexes(&vol);
+    drop_dentries(&vol);
+    uint32_t cluster;
+    unsigned char is_directory;
+    expect(resolve_path(&vol, root, lower, &cluster, &is_directory, NULL, 0) == FS_OK && is_directory,
+           "cd \xC3\xBC" "ber finds \xC3\x9C" "ber");
+    expect(make_directory(&vol, root, lower) == FS_EXISTS, "mkdir \xC3\xBC" "ber is refused after a reload");
+
+    char sharp[] = "stra\xC3\x9F" "e", strasse[] = "STRASSE";
+    expect(make_directory(&vol, root, sharp) >= 2 && make_directory(&vol, root, strasse) >= 2,
+           "stra\xC3\x9F" "e and STRASSE are two names");
+    close_volume(&vol);
+}
+
+// File data goes past the journal, so a cluster freed since the last commit must not get
+// new data: a crash brings back the entry that uses it. rm A and import B in one batch,
+// then a crash before the commit, as kill -9 does.
+static void test_journal_crash(void)
+{
+    char image[] = "/tmp/fatik_testXXXXXX", journal[64];
+    int fd = mkstemp(image);
+    long size = 8L << 20;
+    snprintf(journal, sizeof(journal), "%s.wal", image);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        perror(image);
+        exit(1);
+    }
+
+    uint8_t a[16384], b[16384];
+    memset(a, 'A', sizeof(a));
+    memset(b, 'B', sizeof(b));
+    pid_t child = fork();
+    if (child == 0)
+    {
+        struct Volume vol;
+        open_volume(&vol, fdopen(dup(fd), "r+b"), size, 0, DEFAULT_CACHE_CLUSTERS, DEFAULT_FAT_CACHE_KB, journal);
+        if (vol.journal_fd < 0 || !format_volume(&vol, NULL)) _exit(1);
+        uint32_t root = vol.bpb.root_cluster;
+        store_file(&vol, root, "A.bin", -1, NULL, a, sizeof(a));
+        sync_volume(&vol);
+        remove_path(&vol, root, "A.bin", REMOVE_FILE, NULL);
+        store_file(&vol, root, "B.bin", -1, NULL, b, sizeof(b));
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+
+    struct Volume vol;
+    FILE *out = tmpfile();
+    struct FileRef file;
+    loff_t offset = 0;
+    uint8_t back[sizeof(a)];
+    int ok = open_volume(&vol, fdopen(fd, "r+b"), size, 0, DEFAULT_CACHE_CLUSTERS, DEFAULT_FAT_CACHE_KB, journal) &&
+             find_file(&vol, vol.bpb.root_cluster, "A.bin", &file) == FS_OK &&
+             read_file(&vol, &file, fileno(out), &offset) == FS_OK &&
+             pread(fileno(out), back, sizeof(back), 0) == (ssize_t)sizeof(back) && memcmp(back, a, sizeof(a)) == 0;
+    expect(ok, "after a crash A.bin is back with its own data");
+    if (vol.is_fat32)
+    {
+        expect(check_volume(&vol, 1, 0, out) == 0, "and the image checks clean");
+        close_volume(&vol);
+    }
+    fclose(out);
+    unlink(image);
+}
+
+int main(void)
+{
+    test_folding();
+    test_legal_names();
+    test_collision();
+    test_journal_crash();
+    printf("%s\n", failures ? "FAILED" : "all passed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,272 @@
+// Synthetic workload for FATik: writes a trace of mkdir/touch/mkfile/ls/cd commands to
+// stdout, to be run with `./FATik --replay <trace> <image>`. The shape of the tree (depth,
+// fan-out), the names (8.3 or long), the file sizes, the command mix and the number of
+// sessions are set by options; the same seed gives the same trace.
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-"
+#define MAX_SESSIONS 4096
+
+struct Dir
+{
+    char *path;                    // "/a/b", "" for the root of the workload if that is '/'
+    unsigned int depth;            // root 0
+    unsigned int subdirs;
+};
+
+struct Options
+{
+    unsigned long ops;             // -n
+    unsigned int depth;            // -d
+    unsigned int fanout;           // -F
+    unsigned int dir_share;        // -D, % of creations that are directories
+    unsigned int lfn_share;        // -l, % of long names
+    unsigned int lfn_min, lfn_max; // -L
+    unsigned long long size_min, size_max; // -s, log-uniform
+    unsigned int empty_share;      // -e, % of new files that are empty (touch)
+    unsigned int rewrite_share;    // -w, % of file creations that replace an existing file
+    unsigned int mix[3];           // -m create:list:cd
+    unsigned int sessions;         // -S
+    double think_us;               // -t, mean time between commands
+    const char *root;              // -r, NULL: format and use '/'
+    unsigned long long seed;
+};
+
+static unsigned long long rng_state;
+
+// xorshift64*
+static unsigned long long next_random(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+// [0, n)
+static unsigned long random_below(unsigned long n)
+{
+    return n ? next_random() % n : 0;
+}
+
+// (0, 1)
+static double random_unit(void)
+{
+    return ((next_random() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static unsigned long long parse_size(const char *text, char **end)
+{
+    unsigned long long size = strtoull(text, end, 10);
+    switch (**end)
+    {
+        case 'G': case 'g': size <<= 10; // fall through
+        case 'M': case 'm': size <<= 10; // fall through
+        case 'K': case 'k': size <<= 10; (*end)++; break;
+        default: break;
+    }
+    return size;
+}
+
+// Unique within the workload: a counter is part of every name. Short names are 8.3 in
+// lower case (one entry), long ones mixed case of 'lfn_min'..'lfn_max' characters.
+static void make_name(const struct Options *opt, unsigned long serial, int is_dir, char *name, size_t size)
+{
+    const char *ext = is_dir ? "" : ".dat";
+    if (random_below(100) >= opt->lfn_share)
+    {
+        snprintf(name, size, "%c%lu%s", is_dir ? 'd' : 'f', serial % 10000000, ext);
+        return;
+    }
+
+    char tail[32];
+    int tail_length = snprintf(tail, sizeof(tail), "-%lu%s", serial, ext);
+    unsigned int length = opt->lfn_min + random_below(opt->lfn_max - opt->lfn_min + 1);
+    unsigned int head = length > (unsigned int)tail_length + 1 ? length - tail_length : 1;
+    if (head >= size - tail_length) head = size - tail_length - 1;
+    for (unsigned int i = 0; i < head; i++) name[i] = NAME_CHARS[random_below(sizeof(NAME_CHARS) - 1)];
+    name[0] = 'A' + random_below(26); // upper case first: never a valid short name
+    strcpy(name + head, tail);
+}
+
+static unsigned long long file_size(const struct Options *opt)
+{
+    if (random_below(100) < opt->empty_share || opt->size_max == 0) return 0;
+    double low = log(opt->size_min ? opt->size_min : 1), high = log(opt->size_max);
+    return (unsigned long long)exp(low + (high - low) * random_unit());
+}
+
+static void usage(const char *program)
+{
+    printf("Usage: %s [-n <commands>] [-d <depth>] [-F <fan-out>] [-D <dir %%>] [-l <long name %%>] "
+           "[-L <min>-<max>] [-s <min>:<max>] [-e <empty %%>] [-w <rewrite %%>] [-m <create>:<list>:<cd>] "
+           "[-S <sessions>] [-t <us>] [-r <dir>] [--seed <n>]\n", program);
+}
+
+int main(int argc, char *argv[])
+{
+    struct Options opt =
+    {
+        .ops = 10000, .depth = 4, .fanout = 8, .dir_share = 20, .lfn_share = 30, .lfn_min = 12, .lfn_max = 40,
+        .size_min = 512, .size_max = 1 << 20, .empty_share = 20, .rewrite_share = 10, .mix = { 50, 35, 15 },
+        .sessions = 1, .seed = 1,
+    };
+
+    for (int i = 1; i < argc; i++)
+    {
+        char *end = "";
+        const char *arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        const char *value = argv[++i];
+
+        if (strcmp(arg, "-n") == 0) opt.ops = strtoul(value, &end, 10);
+        else if (strcmp(arg, "-d") == 0) opt.depth = strtoul(value, &end, 10);
+        else if (strcmp(arg, "-F") == 0) opt.fanout = strtoul(value, &end, 10);
+        else if (strcmp(arg, "-D") == 0) opt.dir_share = strtoul(value, &end, 10);
+        else if (strcmp(arg, "-l") == 0) opt.lfn_share = strtoul(value, &end, 10);
+        else if (strcmp(arg, "-L") == 0)
+        {
+            if (sscanf(value, "%u-%u", &opt.lfn_min, &opt.lfn_max) != 2) end = "?";
+        }
+        else if (strcmp(arg, "-s") == 0)
+        {
+            opt.size_min = parse_size(value, &end);
+            if (*end == ':') opt.size_max = parse_size(end + 1, &end);
+            else opt.size_max = opt.size_min;
+        }
+        else if (strcmp(arg, "-e") == 0) opt.empty_share = strtoul(value, &end, 10);
+        else if (strcmp(arg, "-w") == 0) opt.rewrite_share = strtoul(value, &end, 10);
+        else if (strcmp(arg, "-m") == 0)
+        {
+            if (sscanf(value, "%u:%u:%u", &opt.mix[0], &opt.mix[1], &opt.mix[2]) != 3) end = "?";
+        }
+        else if (strcmp(arg, "-S") == 0) opt.sessions = strtoul(value, &end, 10);
+        else if (strcmp(arg, "-t") == 0) opt.think_us = strtod(value, &end);
+        else if (strcmp(arg, "-r") == 0) opt.root = value;
+        else if (strcmp(arg, "--seed") == 0) opt.seed = strtoull(value, &end, 10);
+        else end = "?";
+
+        if (*end != '\0')
+        {
+            printf("Invalid %s: %s\n", arg, value);
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (opt.lfn_min < 1 || opt.lfn_max < opt.lfn_min || opt.lfn_max > 200 || opt.size_max < opt.size_min ||
+        opt.sessions < 1 || opt.sessions > MAX_SESSIONS || opt.mix[0] + opt.mix[1] + opt.mix[2] == 0 ||
+        (opt.root && (opt.root[0] != '/' || opt.root[1] == '\0')))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    rng_state = opt.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+    size_t dir_count = 1, dir_capacity = 1024, file_count = 0, file_capacity = 1024;
+    struct Dir *dirs = malloc(dir_capacity * sizeof(struct Dir));
+    char **files = malloc(file_capacity * sizeof(char *));
+    unsigned int *cwd = calloc(opt.sessions, sizeof(unsigned int)); // index in dirs
+    if (dirs == NULL || files == NULL || cwd == NULL) return 1;
+
+    printf("# fatik_workload");
+    for (int i = 1; i < argc; i++) printf(" %s", argv[i]);
+    printf("\n# <us> <session> <command>\n");
+
+    // every session starts in '/': with -r the workload lives in a directory of its own
+    dirs[0] = (struct Dir){ strdup(opt.root ? opt.root : ""), 0, 0 };
+    if (opt.root) printf("0 0 mkdir %s -p\n", opt.root);
+    else printf("0 0 format\n");
+    if (opt.root)
+    {
+        for (unsigned int s = 0; s < opt.sessions; s++) printf("0 %u cd %s\n", s, opt.root);
+    }
+
+    double clock_us = 0;
+    unsigned long serial = 0;
+    unsigned int mix_total = opt.mix[0] + opt.mix[1] + opt.mix[2];
+    for (unsigned long op = 0; op < opt.ops; op++)
+    {
+        if (opt.think_us > 0) clock_us += -log(random_unit()) * opt.think_us; // Poisson arrivals
+        unsigned int s = random_below(opt.sessions);
+        const char *here = dirs[cwd[s]].path;
+        printf("%.0f %u ", clock_us, s);
+
+        unsigned int pick = random_below(mix_total);
+        if (pick >= opt.mix[0] + opt.mix[1])
+        {
+            cwd[s] = random_below(dir_count);
+            printf("cd %s\n", dirs[cwd[s]].path[0] ? dirs[cwd[s]].path : "/");
+            continue;
+        }
+        if (pick >= opt.mix[0])
+        {
+            printf("ls\n");
+            continue;
+        }
+
+        // create: a directory with room to grow, or a file anywhere
+        size_t parent = random_below(dir_count);
+        int make_dir = random_below(100) < opt.dir_share;
+        for (size_t tries = 0; make_dir && tries < dir_count; tries++)
+        {
+            size_t d = (parent + tries) % dir_count;
+            if (dirs[d].depth < opt.depth && dirs[d].subdirs < opt.fanout)
+            {
+                parent = d;
+                break;
+            }
+            if (tries + 1 == dir_count) make_dir = 0;
+        }
+
+        if (!make_dir && file_count > 0 && random_below(100) < opt.rewrite_share)
+        {
+            printf("mkfile %s %llu\n", files[random_below(file_count)], file_size(&opt));
+            continue;
+        }
+
+        char name[256], path[4096];
+        make_name(&opt, ++serial, make_dir, name, sizeof(name));
+        snprintf(path, sizeof(path), "%s/%s", dirs[parent].path, name);
+        const char *shown = (dirs[parent].path == here) ? name : path; // relative in the current directory
+
+        if (make_dir)
+        {
+            if (dir_count == dir_capacity)
+            {
+                dir_capacity *= 2;
+                dirs = realloc(dirs, dir_capacity * sizeof(struct Dir));
+                if (dirs == NULL) return 1;
+            }
+            dirs[parent].subdirs++;
+            dirs[dir_count++] = (struct Dir){ strdup(path), dirs[parent].depth + 1, 0 };
+            printf("mkdir %s\n", shown);
+            continue;
+        }
+
+        if (file_count == file_capacity)
+        {
+            file_capacity *= 2;
+            files = realloc(files, file_capacity * sizeof(char *));
+            if (files == NULL) return 1;
+        }
+        files[file_count++] = strdup(path);
+        unsigned long long size = file_size(&opt);
+        if (size == 0) printf("touch %s\n", shown);
+        else printf("mkfile %s %llu\n", shown, size);
+    }
+
+    for (size_t i = 0; i < dir_count; i++) free(dirs[i].path);
+    for (size_t i = 0; i < file_count; i++) free(files[i]);
+    free(dirs);
+    free(files);
+    free(cwd);
+    return 0;
+}